@@ -0,0 +1,291 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Run a benchmark repeatedly saving its results, see results.h, as a
+ * baseline or comparing them with the baseline.
+ *
+ * For each bench, scenario and metric the trials are compared with
+ * the baseline results of the same fingerprint with a two sided
+ * Mann-Whitney U test, using the normal approximation with the tie
+ * correction so at least 5 trials of each are needed. A scenario is
+ * flagged as a regression when p is below alpha and the median moved
+ * more than threshold percent in the worse direction.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "results.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_TRIALS 5
+
+typedef struct Ranked {
+  double value;
+  bool first;               // From the first sample
+} Ranked;
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int cmp_ranked(const void* a, const void* b) {
+  return cmp_double(&((const Ranked*)a)->value, &((const Ranked*)b)->value);
+}
+
+/**
+ * Return the median of the count values, which are sorted
+ */
+static double median(double* values, uint32_t count) {
+  qsort(values, count, sizeof(double), cmp_double);
+  return (count & 1) != 0 ? values[count / 2] :
+      (values[(count / 2) - 1] + values[count / 2]) / 2.0;
+}
+
+/**
+ * Return the two sided p value of the Mann-Whitney U test of a and b
+ */
+static double mann_whitney_p(const double* a, uint32_t na, const double* b, uint32_t nb) {
+  uint32_t n = na + nb;
+  Ranked* all = malloc(n * sizeof(Ranked));
+  if (all == NULL) {
+    return 1.0;
+  }
+  for (uint32_t i = 0; i < na; i++) {
+    all[i] = (Ranked){ .value = a[i], .first = true };
+  }
+  for (uint32_t i = 0; i < nb; i++) {
+    all[na + i] = (Ranked){ .value = b[i], .first = false };
+  }
+  qsort(all, n, sizeof(Ranked), cmp_ranked);
+
+  // Ties get the mean of their ranks
+  double rank_sum = 0.0;
+  double ties = 0.0;
+  for (uint32_t i = 0; i < n; ) {
+    uint32_t j = i + 1;
+    while ((j < n) && (all[j].value == all[i].value)) {
+      j += 1;
+    }
+    double t = (double)(j - i);
+    double rank = (double)(i + j + 1) / 2.0;
+    for (uint32_t k = i; k < j; k++) {
+      if (all[k].first) {
+        rank_sum += rank;
+      }
+    }
+    ties += (t * t * t) - t;
+    i = j;
+  }
+  free(all);
+
+  double u = rank_sum - ((double)na * (double)(na + 1) / 2.0);
+  double mean = (double)na * (double)nb / 2.0;
+  double var = ((double)na * (double)nb / 12.0) *
+      ((double)(n + 1) - (ties / ((double)n * (double)(n - 1))));
+  if (var <= 0.0) {
+    return 1.0;
+  }
+  double diff = fabs(u - mean) - 0.5;
+  double z = diff > 0.0 ? diff / sqrt(var) : 0.0;
+  return erfc(z / sqrt(2.0));
+}
+
+/**
+ * Run argv trials times with RESULTS_ENV set to path, its output
+ * is discarded
+ */
+static bool run_trials(const char* path, uint32_t trials, char* argv[]) {
+  setenv(RESULTS_ENV, path, 1);
+  for (uint32_t i = 0; i < trials; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      int fd = open("/dev/null", O_WRONLY);
+      if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+      }
+      execvp(argv[0], argv);
+      _exit(127);
+    }
+    int status;
+    if ((pid < 0) || (waitpid(pid, &status, 0) != pid) ||
+        !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+      printf("run_trials: ERROR %s failed on trial %u\n", argv[0], i);
+      return true;
+    }
+    printf("\rtrial %u/%u", i + 1, trials);
+    fflush(stdout);
+  }
+  printf("\n");
+  return false;
+}
+
+static bool same_key(const Result_t* a, const Result_t* b) {
+  return (strcmp(a->bench, b->bench) == 0) && (strcmp(a->scenario, b->scenario) == 0) &&
+      (strcmp(a->metric, b->metric) == 0) && (strcmp(a->fingerprint, b->fingerprint) == 0);
+}
+
+/**
+ * Compare each scenario of now with base, returning the number of
+ * regressions in pRegressions
+ */
+static bool compare(Result_t* base, uint32_t base_count, Result_t* now, uint32_t now_count,
+    double alpha, double threshold, uint32_t* pRegressions) {
+  double* a = malloc((base_count + 1) * sizeof(double));
+  double* b = malloc((now_count + 1) * sizeof(double));
+  bool* done = calloc(now_count + 1, sizeof(bool));
+  if ((a == NULL) || (b == NULL) || (done == NULL)) {
+    free(a);
+    free(b);
+    free(done);
+    return true;
+  }
+
+  const char* fingerprint = NULL;
+  for (uint32_t i = 0; i < now_count; i++) {
+    if (done[i]) {
+      continue;
+    }
+    Result_t* key = &now[i];
+    if ((fingerprint == NULL) || (strcmp(fingerprint, key->fingerprint) != 0)) {
+      fingerprint = key->fingerprint;
+      printf("%s\n", fingerprint);
+    }
+    uint32_t nb = 0;
+    for (uint32_t j = i; j < now_count; j++) {
+      if (same_key(key, &now[j])) {
+        b[nb++] = now[j].value;
+        done[j] = true;
+      }
+    }
+    uint32_t na = 0;
+    for (uint32_t j = 0; j < base_count; j++) {
+      if (same_key(key, &base[j])) {
+        a[na++] = base[j].value;
+      }
+    }
+    printf("%-14s %-24s %-16s ", key->bench, key->scenario, key->metric);
+    if (na == 0) {
+      printf("no baseline for this fingerprint\n");
+      continue;
+    }
+
+    double p = mann_whitney_p(a, na, b, nb);
+    double base_median = median(a, na);
+    double now_median = median(b, nb);
+    double change = base_median != 0.0 ? 100.0 * (now_median - base_median) / base_median : 0.0;
+    double worse = results_higher_is_better(key->metric) ? -change : change;
+    const char* verdict = "same";
+    if ((na < MIN_TRIALS) || (nb < MIN_TRIALS)) {
+      verdict = "too few trials";
+    } else if ((p < alpha) && (worse > threshold)) {
+      verdict = "REGRESSION";
+      *pRegressions += 1;
+    } else if ((p < alpha) && (-worse > threshold)) {
+      verdict = "improved";
+    }
+    printf("base=%.1f now=%.1f change=%+.1f%% p=%.4f n=%u/%u %s\n",
+        base_median, now_median, change, p, na, nb, verdict);
+  }
+
+  free(a);
+  free(b);
+  free(done);
+  return false;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+  double alpha = 0.01;
+  double threshold = 2.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "+a:t:")) != -1) {
+    switch (opt) {
+      case 'a':
+        sscanf(optarg, "%lf", &alpha);
+        break;
+      case 't':
+        sscanf(optarg, "%lf", &threshold);
+        break;
+      default:
+        argc = 0; // Force usage
+        break;
+    }
+  }
+
+  if ((argc - optind < 4) ||
+      ((strcmp(argv[optind], "save") != 0) && (strcmp(argv[optind], "cmp") != 0))) {
+    printf("Usage:\n");
+    printf(" %s [-a alpha] [-t threshold] save|cmp results_file trials command [args]...\n",
+        argc > 0 ? argv[0] : "bench_compare");
+    printf("  runs command trials times, save appends its results to results_file,\n");
+    printf("  cmp compares them with those in results_file flagging a regression\n");
+    printf("  when the Mann-Whitney p < alpha, default 0.01, and the median is worse\n");
+    printf("  by more than threshold percent, default 2\n");
+    return 1;
+  }
+
+  const char* mode = argv[optind];
+  const char* path = argv[optind + 1];
+  uint32_t trials;
+  sscanf(argv[optind + 2], "%u", &trials);
+  char** command = &argv[optind + 3];
+  printf("bench_compare %s results_file=%s trials=%u alpha=%.3f threshold=%.1f%%\n",
+      mode, path, trials, alpha, threshold);
+
+  if (strcmp(mode, "save") == 0) {
+    error |= run_trials(path, trials, command);
+  } else {
+    Result_t* base;
+    uint32_t base_count;
+    if (results_load(path, &base, &base_count) || (base_count == 0)) {
+      printf("no baseline in %s, run save first\n", path);
+      return 1;
+    }
+    char now_path[] = "/tmp/bench_compare.XXXXXX";
+    int fd = mkstemp(now_path);
+    if (fd < 0) {
+      printf("ERROR unable to create a temporary results file\n");
+      return 1;
+    }
+    close(fd);
+
+    Result_t* now = NULL;
+    uint32_t now_count = 0;
+    uint32_t regressions = 0;
+    error |= run_trials(now_path, trials, command);
+    if (!error) {
+      error |= results_load(now_path, &now, &now_count);
+      error |= compare(base, base_count, now, now_count, alpha, threshold, &regressions);
+    }
+    unlink(now_path);
+    free(base);
+    free(now);
+    if (regressions != 0) {
+      printf("regressions=%u\n", regressions);
+      error = true;
+    }
+  }
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
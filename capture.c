@@ -0,0 +1,119 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "capture.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+_Atomic(uint32_t) gCaptureEnabled = 0;
+
+static int gFd = -1;
+static CaptureFileHeader_t* gHdr = NULL;
+static CaptureRecord_t* gRecords = NULL;
+static uint64_t gMaxRecords = 0;
+static size_t gMapSize = 0;
+static _Atomic(uint64_t) gReserved = 0;
+static _Atomic(uint32_t) gSrcCount = 0;
+static __thread uint32_t tSrc = 0;
+
+/**
+ * @see capture.h
+ */
+bool capture_start(const char* path, uint64_t max_records) {
+  gFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (gFd < 0) {
+    printf("capture_start: ERROR unable to open %s\n", path);
+    return true;
+  }
+  gMapSize = sizeof(CaptureFileHeader_t) + (max_records * sizeof(CaptureRecord_t));
+  if (ftruncate(gFd, (off_t)gMapSize) != 0) {
+    printf("capture_start: ERROR unable to size %s to %lu\n", path, gMapSize);
+    goto error;
+  }
+  void* p = mmap(NULL, gMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, gFd, 0);
+  if (p == MAP_FAILED) {
+    printf("capture_start: ERROR unable to map %s\n", path);
+    goto error;
+  }
+  gHdr = (CaptureFileHeader_t*)p;
+  gRecords = (CaptureRecord_t*)(gHdr + 1);
+  gMaxRecords = max_records;
+  __atomic_store_n(&gReserved, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&gCaptureEnabled, 1, __ATOMIC_RELEASE);
+  return false;
+
+error:
+  close(gFd);
+  gFd = -1;
+  return true;
+}
+
+/**
+ * @see capture.h
+ */
+bool capture_stop(void) {
+  bool error = false;
+  if (gHdr == NULL) {
+    return false;
+  }
+  __atomic_store_n(&gCaptureEnabled, 0, __ATOMIC_RELEASE);
+
+  uint64_t reserved = __atomic_load_n(&gReserved, __ATOMIC_ACQUIRE);
+  uint64_t count = reserved < gMaxRecords ? reserved : gMaxRecords;
+  gHdr->magic = CAPTURE_MAGIC;
+  gHdr->ns_per_tick = gTiming.ns_per_tick;
+  gHdr->count = count;
+  gHdr->dropped = reserved - count;
+  gHdr->record_size = sizeof(CaptureRecord_t);
+  gHdr->src_count = __atomic_load_n(&gSrcCount, __ATOMIC_RELAXED);
+  DPF("capture_stop: count=%lu dropped=%lu\n", gHdr->count, gHdr->dropped);
+
+  error |= munmap(gHdr, gMapSize) != 0;
+  error |= ftruncate(gFd, (off_t)(sizeof(CaptureFileHeader_t)
+        + (count * sizeof(CaptureRecord_t)))) != 0;
+  error |= close(gFd) != 0;
+  if (error) {
+    printf("capture_stop: ERROR finishing the capture file\n");
+  }
+  gHdr = NULL;
+  gRecords = NULL;
+  gFd = -1;
+  return error;
+}
+
+/**
+ * @see capture.h
+ */
+void capture_record(const void* pQ, uint64_t arg1, uint64_t arg2) {
+  uint32_t src = tSrc;
+  if (__builtin_expect(src == 0, 0)) {
+    src = tSrc = __atomic_add_fetch(&gSrcCount, 1, __ATOMIC_RELAXED);
+  }
+  uint64_t idx = __atomic_fetch_add(&gReserved, 1, __ATOMIC_RELAXED);
+  if (idx >= gMaxRecords) {
+    return;
+  }
+  CaptureRecord_t* r = &gRecords[idx];
+  r->tick = ticks();
+  r->dst = (uint64_t)pQ;
+  r->arg1 = arg1;
+  r->arg2 = arg2;
+  r->src = src;
+  r->reserved = 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Capture the msgs sent with add, so production traffic can be
+ * replayed offline, see replay.c.
+ *
+ * Each add writes a CaptureRecord_t with the tick, the sending
+ * thread, the destination fifo and the msg's arg1 and arg2 into a
+ * memory mapped file. A slot is reserved with one fetch_add so
+ * threads don't contend beyond that. Returning msgs to their pools
+ * isn't traffic and isn't captured. Capture is compiled in when
+ * USE_CAPTURE is 1 and started at runtime with capture_start().
+ *
+ * The file is a CaptureFileHeader_t followed by count records in
+ * the order their slots were reserved.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef USE_CAPTURE
+#define USE_CAPTURE 1
+#endif
+
+#define CAPTURE_MAGIC 0x315041434353504Dull // "MPSCCAP1"
+
+typedef struct CaptureRecord_t {
+  uint64_t tick;
+  uint64_t dst;         // Address of the fifo
+  uint64_t arg1;
+  uint64_t arg2;
+  uint32_t src;         // Capturing thread, numbered from 1 in order of first capture
+  uint32_t reserved;
+} CaptureRecord_t;
+
+typedef struct CaptureFileHeader_t {
+  uint64_t magic;
+  double ns_per_tick;
+  uint64_t count;
+  uint64_t dropped;     // Records not written because the file was full
+  uint32_t record_size;
+  uint32_t src_count;
+} CaptureFileHeader_t;
+
+extern _Atomic(uint32_t) gCaptureEnabled;
+
+/**
+ * Create path with room for max_records and start capturing.
+ *
+ * @return true if an error.
+ */
+bool capture_start(const char* path, uint64_t max_records);
+
+/**
+ * Stop capturing and finish the file, should be called when the
+ * captured threads are quiescent.
+ *
+ * @return true if an error.
+ */
+bool capture_stop(void);
+
+/**
+ * Record an add, use CAPTURE.
+ */
+void capture_record(const void* pQ, uint64_t arg1, uint64_t arg2);
+
+#if USE_CAPTURE
+#define CAPTURE(pQ, pMsg) do { \
+  if (__builtin_expect(__atomic_load_n(&gCaptureEnabled, __ATOMIC_RELAXED), 0)) { \
+    capture_record((pQ), (pMsg)->arg1, (pMsg)->arg2); \
+  } \
+} while (0)
+#else
+#define CAPTURE(pQ, pMsg) ((void)(0))
+#endif
+
+#endif
@@ -0,0 +1,226 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Create and destroy fifos while producers send to them.
+ *
+ * There are slot_count slots each holding a fifo. The producers
+ * send with DynFifo_send to random slots and the main thread
+ * consumes every slot, with churn it then replaces one slot's fifo
+ * with a new one and destroys the old one each iteration. At the
+ * end every msg must have been consumed, drained when its fifo was
+ * reclaimed or returned because its slot was empty, and every pool
+ * must get all of its msgs back.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "dyn_fifo.h"
+#include "epoch.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEINIT_TIMEOUT_NS (1000000000ull)
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Producer {
+  pthread_t thread;
+  MsgPool_t pool;
+  uint32_t idx;
+  ATOMIC(MpscFifo_t*)* slots;
+  uint32_t slot_count;
+  _Atomic(uint32_t) stop;
+  uint64_t sent;
+  uint64_t empty_slot;
+} Producer;
+
+static void* producer(void* p) {
+  Producer* prod = (Producer*)p;
+  uint64_t rng = prod->idx + 1;
+
+  while (__atomic_load_n(&prod->stop, __ATOMIC_ACQUIRE) == 0) {
+    Msg_t* msg = MsgPool_get_msg(&prod->pool);
+    if (msg == NULL) {
+      sched_yield();
+      continue;
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    msg->arg1 = prod->idx;
+    if (DynFifo_send(&prod->slots[rng % prod->slot_count], msg)) {
+      prod->empty_slot += 1;
+    } else {
+      prod->sent += 1;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Remove and return every msg in the slots
+ */
+static uint64_t consume(ATOMIC(MpscFifo_t*)* slots, uint32_t slot_count) {
+  uint64_t count = 0;
+  for (uint32_t i = 0; i < slot_count; i++) {
+    MpscFifo_t* pQ = __atomic_load_n(&slots[i], __ATOMIC_RELAXED);
+    Msg_t* msg;
+    while ((msg = rmv(pQ)) != NULL) {
+      ret_msg(msg);
+      count += 1;
+    }
+  }
+  return count;
+}
+
+bool run(bool churn, uint32_t slot_count, uint32_t producer_count,
+    uint64_t iterations, uint32_t window) {
+  bool error = false;
+  const char* mode_name = churn ? "churn" : "static";
+  DynFifoStats_t stats_start;
+  DynFifoStats_t stats_stop;
+
+  DynFifo_get_stats(&stats_start);
+  ATOMIC(MpscFifo_t*)* slots = calloc(slot_count, sizeof(MpscFifo_t*));
+  Producer* producers = calloc(producer_count, sizeof(Producer));
+  MsgPool_t stubs;
+  if ((slots == NULL) || (producers == NULL)
+      || MsgPool_init_elastic(&stubs, slot_count * 2, 64, 8, 0)) {
+    printf(LDR "run: ERROR unable to allocate\n", ldr());
+    return true;
+  }
+  for (uint32_t i = 0; i < slot_count; i++) {
+    slots[i] = DynFifo_create(MsgPool_get_msg(&stubs));
+  }
+
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < producer_count; i++) {
+    Producer* prod = &producers[i];
+    if (MsgPool_init(&prod->pool, window)) {
+      printf(LDR "run: ERROR unable to create producer pool\n", ldr());
+      return true;
+    }
+    prod->idx = i;
+    prod->slots = slots;
+    prod->slot_count = slot_count;
+    pthread_create(&prod->thread, NULL, producer, prod);
+  }
+
+  uint64_t consumed = 0;
+  uint32_t peak_pending = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    consumed += consume(slots, slot_count);
+    if ((i % 16) == 0) {
+      // The producers don't run on a single cpu unless we yield, the
+      // fifo replaced next then has msgs for reclaim to drain
+      sched_yield();
+    }
+    if (churn) {
+      MpscFifo_t* pNew = DynFifo_create(MsgPool_get_msg(&stubs));
+      MpscFifo_t* pOld = __atomic_exchange_n(&slots[i % slot_count], pNew, __ATOMIC_ACQ_REL);
+      DynFifo_destroy(pOld);
+      uint32_t pending = Epoch_pending();
+      if (pending > peak_pending) {
+        peak_pending = pending;
+      }
+    }
+  }
+
+  uint64_t sent = 0;
+  uint64_t empty_slot = 0;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    __atomic_store_n(&producers[i].stop, 1, __ATOMIC_RELEASE);
+  }
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+    sent += producers[i].sent;
+    empty_slot += producers[i].empty_slot;
+  }
+  consumed += consume(slots, slot_count);
+  for (uint32_t i = 0; i < slot_count; i++) {
+    DynFifo_destroy(__atomic_exchange_n(&slots[i], NULL, __ATOMIC_ACQ_REL));
+  }
+  Epoch_reclaim_all();
+  uint64_t time_stop = ticks_serialized();
+  DynFifo_get_stats(&stats_stop);
+
+  uint64_t drained = stats_stop.drained_msgs - stats_start.drained_msgs;
+  uint64_t created = stats_stop.created - stats_start.created;
+  uint64_t reclaimed = stats_stop.reclaimed - stats_start.reclaimed;
+  if ((consumed + drained != sent) || (reclaimed != created)) {
+    printf(LDR "run: ERROR %s sent=%lu consumed=%lu drained=%lu created=%lu reclaimed=%lu\n",
+        ldr(), mode_name, sent, consumed, drained, created, reclaimed);
+    error = true;
+  }
+  for (uint32_t i = 0; i < producer_count; i++) {
+    if (MsgPool_try_deinit(&producers[i].pool, DEINIT_TIMEOUT_NS, NULL)) {
+      printf(LDR "run: ERROR %s producer %u pool has msgs outstanding\n", ldr(), mode_name, i);
+      error = true;
+    }
+  }
+  if (MsgPool_try_deinit(&stubs, DEINIT_TIMEOUT_NS, NULL)) {
+    printf(LDR "run: ERROR %s stub pool has msgs outstanding\n", ldr(), mode_name);
+    error = true;
+  }
+
+  double secs = diff_ticks_ns(time_stop, time_start) / ns_flt;
+  printf("%-6s sends_per_sec=%.0f creates_per_sec=%.0f sent=%lu drained=%lu "
+      "empty_slot=%lu peak_pending=%u\n", mode_name, (double)sent / secs,
+      (double)created / secs, sent, drained, empty_slot, peak_pending);
+
+  free(producers);
+  free((void*)slots);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 5) {
+    printf("Usage:\n");
+    printf(" %s slot_count producer_count iterations window\n", argv[0]);
+    printf("  the producers send to random slots with at most window msgs outstanding,\n");
+    printf("  each iteration consumes every slot and with churn replaces one fifo\n");
+    return 1;
+  }
+
+  u_int32_t slot_count;
+  sscanf(argv[1], "%u", &slot_count);
+  u_int32_t producer_count;
+  sscanf(argv[2], "%u", &producer_count);
+  u_int64_t iterations;
+  sscanf(argv[3], "%lu", &iterations);
+  u_int32_t window;
+  sscanf(argv[4], "%u", &window);
+  printf("churn_bench slot_count=%u producer_count=%u iterations=%lu window=%u\n",
+      slot_count, producer_count, iterations, window);
+
+  if ((slot_count == 0) || (producer_count == 0) || (window == 0)) {
+    printf("slot_count, producer_count and window must be > 0\n");
+    return 1;
+  }
+
+  error |= timing_init();
+  error |= run(false, slot_count, producer_count, iterations, window);
+  error |= run(true, slot_count, producer_count, iterations, window);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
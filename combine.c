@@ -0,0 +1,205 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "combine.h"
+#include "capture.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Spins waiting for the combiner before yielding
+#define COMB_SPINS 64
+
+// The batch average each time combining starts, 2 msgs, so a few
+// small batches are needed before switching back to plain
+#define COMB_START_BATCH_X16 32
+
+static ATOMIC(uint32_t) gSlotInUse[COMB_MAX_THREADS];
+static ATOMIC(uint32_t) gSlotsHigh = 0;     // Slots at or above this were never used
+
+static pthread_once_t gKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gKey;
+static __thread uint32_t tSlot = 0;         // Slot + 1, 0 if none yet
+static __thread uint32_t tAdds = 0;
+
+/**
+ * Release the exiting thread's slot
+ */
+static void release_slot(void* p) {
+  uint32_t slot = (uint32_t)(uintptr_t)p - 1;
+  __atomic_store_n(&gSlotInUse[slot], 0, __ATOMIC_RELEASE);
+}
+
+static void create_key(void) {
+  pthread_key_create(&gKey, release_slot);
+}
+
+/**
+ * Return the calling thread's slot + 1 claiming one if needed, 0 if
+ * there are none left
+ */
+static uint32_t get_slot(void) {
+  uint32_t slot = tSlot;
+  if (__builtin_expect(slot != 0, 1)) {
+    return slot;
+  }
+  pthread_once(&gKeyOnce, create_key);
+  for (uint32_t i = 0; i < COMB_MAX_THREADS; i++) {
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&gSlotInUse[i], &expected, 1,
+          false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      uint32_t high = __atomic_load_n(&gSlotsHigh, __ATOMIC_RELAXED);
+      while ((high < i + 1) && !__atomic_compare_exchange_n(&gSlotsHigh, &high, i + 1,
+            false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      }
+      tSlot = i + 1;
+      pthread_setspecific(gKey, (void*)(uintptr_t)tSlot);
+      return tSlot;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @see combine.h
+ */
+void CombFifo_init(CombFifo_t* cf, Msg_t* pStub, uint32_t policy, uint64_t contended_ns) {
+  initMpscFifo(&cf->fifo, pStub);
+  cf->combining = 0;
+  cf->combine = policy == COMB_COMBINE ? 1 : 0;
+  cf->policy = policy;
+  cf->contended_ticks = (uint64_t)((double)contended_ns / gTiming.ns_per_tick);
+  cf->add_ticks_x16 = 0;
+  cf->batch_x16 = COMB_START_BATCH_X16;
+  memset(&cf->stats, 0, sizeof(cf->stats));
+  for (uint32_t i = 0; i < COMB_MAX_THREADS; i++) {
+    cf->slots[i].pMsg = NULL;
+  }
+}
+
+/**
+ * @see combine.h
+ */
+uint64_t CombFifo_deinit(CombFifo_t* cf) {
+  return deinitMpscFifo(&cf->fifo, NULL);
+}
+
+/**
+ * Add pMsg with add, if adaptive time some of them and start
+ * combining if they're slow
+ */
+static void plain_add(CombFifo_t* cf, Msg_t* pMsg) {
+  if ((cf->policy != COMB_ADAPTIVE) || ((++tAdds % COMB_SAMPLE_PERIOD) != 0)) {
+    add(&cf->fifo, pMsg);
+    return;
+  }
+  uint64_t start = ticks();
+  add(&cf->fifo, pMsg);
+  uint64_t elapsed = ticks() - start;
+
+  // Clamp so a preempted add doesn't look like contention
+  uint64_t limit = cf->contended_ticks * 4;
+  if (elapsed > limit) {
+    elapsed = limit;
+  }
+  uint64_t avg = __atomic_load_n(&cf->add_ticks_x16, __ATOMIC_RELAXED);
+  avg = avg - (avg / 8) + (elapsed * 2);
+  __atomic_store_n(&cf->add_ticks_x16, avg, __ATOMIC_RELAXED);
+  if (avg >= cf->contended_ticks * 16) {
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&cf->combine, &expected, 1,
+          false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      __atomic_fetch_add(&cf->stats.to_combine, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Add the published msgs as one chain, called with the combining flag
+ */
+static void combine(CombFifo_t* cf) {
+  Msg_t* pFirst = NULL;
+  Msg_t* pLast = NULL;
+  uint32_t count = 0;
+  uint32_t high = __atomic_load_n(&gSlotsHigh, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < high; i++) {
+    CombSlot_t* slot = &cf->slots[i];
+    if (__atomic_load_n(&slot->pMsg, __ATOMIC_RELAXED) == NULL) {
+      continue;
+    }
+    Msg_t* pMsg = __atomic_exchange_n(&slot->pMsg, NULL, __ATOMIC_ACQUIRE);
+    if (pLast == NULL) {
+      pFirst = pMsg;
+    } else {
+      MPSC_STORE(&pLast->pNext, pMsg, __ATOMIC_RELAXED);
+    }
+    pLast = pMsg;
+    count += 1;
+  }
+  if (pFirst == NULL) {
+    return;
+  }
+  add_chain(&cf->fifo, pFirst, pLast);
+  cf->stats.passes += 1;
+  cf->stats.combined += count;
+
+  // Only after the chain is added so a producer switching to plain
+  // adds can't overtake its own combined msg
+  cf->batch_x16 = cf->batch_x16 - (cf->batch_x16 / 8) + (count * 2);
+  if ((cf->policy == COMB_ADAPTIVE) && (cf->batch_x16 < COMB_MIN_BATCH_X16)) {
+    cf->batch_x16 = COMB_START_BATCH_X16;
+    __atomic_store_n(&cf->add_ticks_x16, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cf->combine, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&cf->stats.to_plain, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @see combine.h
+ */
+void CombFifo_add(CombFifo_t* cf, Msg_t* pMsg) {
+  uint32_t slot = 0;
+  if (__atomic_load_n(&cf->combine, __ATOMIC_ACQUIRE) != 0) {
+    slot = get_slot();
+  }
+  if (slot == 0) {
+    plain_add(cf, pMsg);
+    return;
+  }
+
+  CAPTURE(&cf->fifo, pMsg);
+  CombSlot_t* pSlot = &cf->slots[slot - 1];
+  __atomic_store_n(&pSlot->pMsg, pMsg, __ATOMIC_RELEASE);
+  uint32_t spins = 0;
+  while (__atomic_load_n(&pSlot->pMsg, __ATOMIC_ACQUIRE) != NULL) {
+    if ((__atomic_load_n(&cf->combining, __ATOMIC_RELAXED) == 0)
+        && (__atomic_exchange_n(&cf->combining, 1, __ATOMIC_ACQUIRE) == 0)) {
+      combine(cf);
+      __atomic_store_n(&cf->combining, 0, __ATOMIC_RELEASE);
+    } else if (++spins >= COMB_SPINS) {
+      spins = 0;
+      sched_yield();
+    }
+  }
+}
+
+/**
+ * @see combine.h
+ */
+void CombFifo_get_stats(CombFifo_t* cf, CombStats_t* pStats) {
+  *pStats = cf->stats;
+}
@@ -0,0 +1,99 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A flat combining front end for a fifo with many producers.
+ *
+ * With CombFifo_add a producer publishes its msg in its own slot and
+ * whichever producer takes the combining flag links every published
+ * msg into a chain and adds it with one add_chain, so the producers
+ * don't each exchange pHead. The others spin until their slot is
+ * cleared, a producer's msgs stay in order.
+ *
+ * Combining costs a slot write and a wait when there's little
+ * contention, so with COMB_ADAPTIVE producers start with plain adds
+ * and every COMB_SAMPLE_PERIOD'th add is timed. When the average
+ * reaches contended_ns they switch to combining, and switch back when
+ * the combined batches average fewer than COMB_MIN_BATCH msgs.
+ *
+ * Producers register a slot on their first combining add, at most
+ * COMB_MAX_THREADS at a time, others always add plainly. The
+ * consumer uses rmv on CombFifo_t.fifo as usual.
+ */
+
+#ifndef _COMBINE_H
+#define _COMBINE_H
+
+#include "mpscfifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COMB_MAX_THREADS 64
+
+#define COMB_SAMPLE_PERIOD 32
+
+// Times 16, i.e. 1.5 msgs
+#define COMB_MIN_BATCH_X16 24
+
+#define COMB_PLAIN    0   // Always add
+#define COMB_COMBINE  1   // Always combine
+#define COMB_ADAPTIVE 2   // Combine while contended
+
+typedef struct CombSlot_t {
+  ATOMIC(Msg_t*) pMsg __attribute__(( aligned (64) ));
+} CombSlot_t;
+
+typedef struct CombStats_t {
+  uint64_t passes;          // Chains added by combiners
+  uint64_t combined;        // Msgs in those chains
+  uint64_t to_combine;      // Switches from plain to combining
+  uint64_t to_plain;        // Switches from combining to plain
+} CombStats_t;
+
+typedef struct CombFifo_t {
+  MpscFifo_t fifo;
+
+  ATOMIC(uint32_t) combining __attribute__(( aligned (64) ));
+  ATOMIC(uint32_t) combine; // Currently combining
+  uint32_t policy;
+  uint64_t contended_ticks;
+  ATOMIC(uint64_t) add_ticks_x16;   // Average of the timed plain adds
+  uint64_t batch_x16;               // Average batch, only the combiner uses it
+  CombStats_t stats;                // Only written by the combiner, other than the switches
+
+  CombSlot_t slots[COMB_MAX_THREADS];
+} CombFifo_t;
+
+/**
+ * Initialize cf with pStub, policy is COMB_PLAIN, COMB_COMBINE or
+ * COMB_ADAPTIVE and contended_ns the timed add average at which
+ * COMB_ADAPTIVE starts combining.
+ */
+void CombFifo_init(CombFifo_t* cf, Msg_t* pStub, uint32_t policy, uint64_t contended_ns);
+
+/**
+ * Deinitialize cf, see deinitMpscFifo.
+ *
+ * @return number of messages removed.
+ */
+uint64_t CombFifo_deinit(CombFifo_t* cf);
+
+/**
+ * Add pMsg, may be used by multiple producers.
+ */
+void CombFifo_add(CombFifo_t* cf, Msg_t* pMsg);
+
+/**
+ * Get cf's counts, only exact once the producers are idle.
+ */
+void CombFifo_get_stats(CombFifo_t* cf, CombStats_t* pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "compact.h"
+#include "dpf.h"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+CMsg_t* gCArena = NULL;
+
+static uint32_t gCArenaMax = 0;
+static ATOMIC(uint32_t) gCArenaUsed = 0;
+static CFifo_t* gCFifos[CID_MAX_COUNT];
+
+/**
+ * @see compact.h
+ */
+bool CArena_init(uint32_t max_msgs) {
+  void* p = mmap(NULL, (size_t)max_msgs * sizeof(CMsg_t), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    printf(LDR "CArena_init: ERROR unable to reserve max_msgs=%u\n", ldr(), max_msgs);
+    return true;
+  }
+  gCArena = (CMsg_t*)p;
+  gCArenaMax = max_msgs;
+  gCArenaUsed = 0;
+  return false;
+}
+
+/**
+ * @see compact.h
+ */
+void CArena_deinit(void) {
+  munmap(gCArena, (size_t)gCArenaMax * sizeof(CMsg_t));
+  gCArena = NULL;
+  gCArenaMax = 0;
+  gCArenaUsed = 0;
+}
+
+/**
+ * @see compact.h
+ */
+bool CFifo_init(CFifo_t* pQ, CIdx_t stub) {
+  for (uint32_t id = 0; id < CID_MAX_COUNT - 1; id++) {
+    CFifo_t* expected = NULL;
+    if ((__atomic_load_n(&gCFifos[id], __ATOMIC_RELAXED) == NULL)
+        && __atomic_compare_exchange_n(&gCFifos[id], &expected, pQ,
+          false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      CMsg(stub)->next = CIDX_NIL;
+      pQ->head = stub;
+      pQ->tail = stub;
+      pQ->id = (uint16_t)id;
+      pQ->msgs_processed = 0;
+      return false;
+    }
+  }
+  printf(LDR "CFifo_init: ERROR pQ=%p no ids remain\n", ldr(), pQ);
+  return true;
+}
+
+/**
+ * @see compact.h
+ */
+void CFifo_deinit(CFifo_t* pQ) {
+  CIdx_t stub = pQ->head;
+  if (CMsg(stub)->pool_id != pQ->id) {
+    CMsg_ret(stub);
+  }
+  pQ->head = pQ->tail = CIDX_NIL;
+  __atomic_store_n(&gCFifos[pQ->id], NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * @see compact.h
+ */
+CFifo_t* CFifo_from_id(uint16_t id) {
+  return id < CID_MAX_COUNT ? __atomic_load_n(&gCFifos[id], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/**
+ * @see compact.h
+ */
+void CFifo_add(CFifo_t* pQ, CIdx_t idx) {
+  __atomic_store_n(&CMsg(idx)->next, CIDX_NIL, __ATOMIC_RELAXED);
+  CIdx_t prev = __atomic_exchange_n(&pQ->head, idx, __ATOMIC_ACQ_REL);
+  // rmv will stall spinning if preempted at this critical spot
+  __atomic_store_n(&CMsg(prev)->next, idx, __ATOMIC_RELEASE);
+}
+
+/**
+ * @see compact.h
+ */
+CIdx_t CFifo_rmv(CFifo_t* pQ) {
+  CIdx_t tail = pQ->tail;
+  CMsg_t* pTail = CMsg(tail);
+  CIdx_t next = __atomic_load_n(&pTail->next, __ATOMIC_ACQUIRE);
+  if (next == CIDX_NIL) {
+    if (tail == __atomic_load_n(&pQ->head, __ATOMIC_ACQUIRE)) {
+      return CIDX_NIL;
+    }
+    // Q is NOT empty but producer was preempted at the critical spot
+    while ((next = __atomic_load_n(&pTail->next, __ATOMIC_ACQUIRE)) == CIDX_NIL) {
+      sched_yield();
+    }
+  }
+  CMsg_t* pNext = CMsg(next);
+  pTail->rsp_id = pNext->rsp_id;
+  pTail->arg1 = pNext->arg1;
+  pTail->arg2 = pNext->arg2;
+  pQ->tail = next;
+  __atomic_store_n(&pQ->msgs_processed, pQ->msgs_processed + 1, __ATOMIC_RELAXED);
+  return tail;
+}
+
+/**
+ * @see compact.h
+ */
+bool CPool_init(CPool_t* pool, uint32_t msg_count) {
+  // One more for the stub
+  uint32_t count = msg_count + 1;
+  uint32_t first = __atomic_fetch_add(&gCArenaUsed, count, __ATOMIC_RELAXED);
+  if ((first > gCArenaMax) || (count > gCArenaMax - first)) {
+    printf(LDR "CPool_init: ERROR pool=%p arena has too few msgs for msg_count=%u\n",
+        ldr(), pool, msg_count);
+    return true;
+  }
+  CMsg_t* pStub = CMsg(first);
+  if (CFifo_init(&pool->fifo, first)) {
+    return true;
+  }
+  pStub->pool_id = pool->fifo.id;
+  pStub->rsp_id = CID_NONE;
+  pool->first = first;
+  pool->msg_count = msg_count;
+  pool->unused = first + 1;
+  pool->unused_end = first + count;
+  return false;
+}
+
+/**
+ * @see compact.h
+ */
+void CPool_deinit(CPool_t* pool) {
+  CFifo_deinit(&pool->fifo);
+
+  // Give the pages back, the range is reused only if it was the last
+  uint32_t count = pool->msg_count + 1;
+  madvise(CMsg(pool->first), (size_t)count * sizeof(CMsg_t), MADV_DONTNEED);
+  uint32_t end = pool->first + count;
+  __atomic_compare_exchange_n(&gCArenaUsed, &end, pool->first,
+      false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * @see compact.h
+ */
+CIdx_t CPool_get_msg(CPool_t* pool) {
+  CIdx_t idx;
+  if (pool->unused < pool->unused_end) {
+    idx = pool->unused++;
+    CMsg_t* pMsg = CMsg(idx);
+    pMsg->pool_id = pool->fifo.id;
+    pMsg->version = 0;
+  } else {
+    idx = CFifo_rmv(&pool->fifo);
+    if (idx == CIDX_NIL) {
+      return CIDX_NIL;
+    }
+  }
+  CMsg_t* pMsg = CMsg(idx);
+  pMsg->version += 1;
+  pMsg->rsp_id = CID_NONE;
+  return idx;
+}
+
+/**
+ * @see compact.h
+ */
+void CMsg_ret(CIdx_t idx) {
+  CFifo_t* pPool = CFifo_from_id(CMsg(idx)->pool_id);
+  if (pPool != NULL) {
+    CFifo_add(pPool, idx);
+  }
+}
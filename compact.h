@@ -0,0 +1,162 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A compact layout of the msgs, fifos and pools where a msg is a
+ * 32 bit index rather than a pointer.
+ *
+ * Every CMsg_t lives in one arena reserved by CArena_init so an
+ * index alone finds a msg, as with Msg_t the msgs move between pools
+ * because rmv returns the old stub. The pool and response fifo are
+ * 16 bit ids registered in CArena's tables. A CMsg_t is 32 bytes,
+ * two per cache line, rather than the 64 of a Msg_t and the spare
+ * bits are a version which is bumped each time the msg is handed
+ * out so a stale CHandle_t can be detected.
+ *
+ * The algorithm is the same as mpscfifo.c with indices, add is wait
+ * free and rmv is single consumer.
+ */
+
+#ifndef _COMPACT_H
+#define _COMPACT_H
+
+#include "mpscfifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t CIdx_t;
+
+#define CIDX_NIL      UINT32_MAX
+#define CID_NONE      UINT16_MAX
+#define CID_MAX_COUNT UINT16_MAX
+
+typedef struct CMsg_t {
+  ATOMIC(CIdx_t) next;
+  uint16_t pool_id;
+  uint16_t rsp_id;        // Response fifo or CID_NONE
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t arg1;
+  uint64_t arg2;
+} CMsg_t;
+
+// A msg index with its version
+typedef uint64_t CHandle_t;
+
+typedef struct CFifo_t {
+  ATOMIC(CIdx_t) head __attribute__(( aligned (64) ));
+  CIdx_t tail __attribute__(( aligned (64) ));
+  uint16_t id;
+  uint64_t msgs_processed;
+} CFifo_t;
+
+typedef struct CPool_t {
+  CFifo_t fifo;
+  CIdx_t first;           // Of the pool's range in the arena
+  uint32_t msg_count;
+  CIdx_t unused;          // Next never used msg
+  CIdx_t unused_end;
+} CPool_t;
+
+extern CMsg_t* gCArena;
+
+/**
+ * Reserve address space for max_msgs msgs, pages are only backed
+ * when a pool uses them.
+ *
+ * @return true if an error.
+ */
+bool CArena_init(uint32_t max_msgs);
+
+/**
+ * Release the arena, every pool must be deinitialized.
+ */
+void CArena_deinit(void);
+
+/**
+ * Return the msg idx
+ */
+static inline CMsg_t* CMsg(CIdx_t idx) {
+  return &gCArena[idx];
+}
+
+/**
+ * Return a handle to idx as it is now.
+ */
+static inline CHandle_t CMsg_handle(CIdx_t idx) {
+  return ((uint64_t)gCArena[idx].version << 32) | idx;
+}
+
+/**
+ * Return the index of handle or CIDX_NIL if the msg has since been
+ * handed out again.
+ */
+static inline CIdx_t CMsg_from_handle(CHandle_t handle) {
+  CIdx_t idx = (CIdx_t)handle;
+  return gCArena[idx].version == (uint32_t)(handle >> 32) ? idx : CIDX_NIL;
+}
+
+/**
+ * Initialize pQ with stub and give it an id for rsp_id.
+ *
+ * @return true if no ids remain.
+ */
+bool CFifo_init(CFifo_t* pQ, CIdx_t stub);
+
+/**
+ * Deinitialize pQ, it must be empty, the stub is returned to its
+ * pool unless it's pQ's own.
+ */
+void CFifo_deinit(CFifo_t* pQ);
+
+/**
+ * Return the fifo with id
+ */
+CFifo_t* CFifo_from_id(uint16_t id);
+
+/**
+ * Add msg idx, may be used by multiple producers.
+ */
+void CFifo_add(CFifo_t* pQ, CIdx_t idx);
+
+/**
+ * Remove a msg, used by a single consumer.
+ *
+ * @return CIDX_NIL if empty.
+ */
+CIdx_t CFifo_rmv(CFifo_t* pQ);
+
+/**
+ * Initialize a pool of msg_count msgs from the arena, like MsgPool_t
+ * they're handed out in order before any returned ones.
+ *
+ * @return true if an error.
+ */
+bool CPool_init(CPool_t* pool, uint32_t msg_count);
+
+/**
+ * Deinitialize the pool, every msg must have been returned.
+ */
+void CPool_deinit(CPool_t* pool);
+
+/**
+ * Get a msg, only one thread may get from a pool.
+ *
+ * @return CIDX_NIL if none are available.
+ */
+CIdx_t CPool_get_msg(CPool_t* pool);
+
+/**
+ * Return msg idx to its pool.
+ */
+void CMsg_ret(CIdx_t idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,230 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Compare the memory and speed of Msg_t's and CMsg_t's, see
+ * compact.h, with msg_count msgs queued at once.
+ *
+ * Each pass gets every msg of a msg_count pool and adds it to a fifo
+ * then removes and returns them all, checking the order. The first
+ * pass also touches the pages, the rest are reported separately. A
+ * layout is skipped if its msgs won't fit in MemAvailable.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "compact.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+_Atomic(uint64_t) gTick = 0;
+
+/**
+ * Return MemAvailable from /proc/meminfo in bytes, 0 if unknown
+ */
+static uint64_t mem_available(void) {
+  uint64_t kb = 0;
+  char line[128];
+  FILE* f = fopen("/proc/meminfo", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return kb * 1024;
+}
+
+/**
+ * Return the resident set size in bytes
+ */
+static uint64_t rss(void) {
+  uint64_t size = 0;
+  uint64_t resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Return true if bytes, with 10% to spare, fit in MemAvailable
+ */
+static bool fits(const char* name, uint64_t bytes) {
+  uint64_t avail = mem_available();
+  if ((avail != 0) && (bytes + (bytes / 10) > avail)) {
+    printf("%-7s skipped, needs %lu MB and %lu MB is available\n",
+        name, bytes >> 20, avail >> 20);
+    return false;
+  }
+  return true;
+}
+
+static void report(const char* name, uint32_t msg_count, uint32_t msg_size,
+    uint64_t rss_bytes, uint64_t first_ticks, uint64_t rest_ticks, uint32_t passes) {
+  printf("%-7s msg_size=%u rss_per_msg=%.1f first_pass_ns_per_msg=%.2f ns_per_msg=%.2f\n",
+      name, msg_size, (double)rss_bytes / msg_count,
+      ticks_to_ns(first_ticks) / msg_count,
+      passes > 1 ? ticks_to_ns(rest_ticks) / ((double)msg_count * (passes - 1)) : 0.0);
+}
+
+bool pointer(uint32_t msg_count, uint32_t passes) {
+  bool error = false;
+  MsgPool_t stubs;
+  MsgPool_t pool;
+  MpscFifo_t fifo;
+  uint64_t first_ticks = 0;
+  uint64_t rest_ticks = 0;
+
+  if (!fits("pointer", (uint64_t)(msg_count + 3) * sizeof(Msg_t))) {
+    return false;
+  }
+  uint64_t rss_start = rss();
+  // One more as after a pass the fifo's stub is one of the pool's
+  if (MsgPool_init(&stubs, 1) || MsgPool_init(&pool, msg_count + 1)) {
+    return true;
+  }
+  initMpscFifo(&fifo, MsgPool_get_msg(&stubs));
+
+  uint64_t rss_bytes = 0;
+  for (uint32_t pass = 0; pass < passes; pass++) {
+    uint64_t start = ticks_serialized();
+    for (uint32_t i = 0; i < msg_count; i++) {
+      Msg_t* msg = MsgPool_get_msg(&pool);
+      msg->arg1 = i;
+      add(&fifo, msg);
+    }
+    if (pass == 0) {
+      rss_bytes = rss() - rss_start;
+    }
+    for (uint32_t i = 0; i < msg_count; i++) {
+      Msg_t* msg = rmv(&fifo);
+      if ((msg == NULL) || (msg->arg1 != i)) {
+        printf(LDR "pointer: ERROR expected arg1=%u\n", ldr(), i);
+        error = true;
+        break;
+      }
+      ret_msg(msg);
+    }
+    uint64_t stop = ticks_serialized();
+    if (pass == 0) {
+      first_ticks = stop - start;
+    } else {
+      rest_ticks += stop - start;
+    }
+  }
+
+  deinitMpscFifo(&fifo, NULL);
+  MsgPool_deinit(&pool);
+  MsgPool_deinit(&stubs);
+  report("pointer", msg_count, sizeof(Msg_t), rss_bytes, first_ticks, rest_ticks, passes);
+  return error;
+}
+
+bool compact(uint32_t msg_count, uint32_t passes) {
+  bool error = false;
+  CPool_t stubs;
+  CPool_t pool;
+  CFifo_t fifo;
+  uint64_t first_ticks = 0;
+  uint64_t rest_ticks = 0;
+
+  if (!fits("compact", (uint64_t)(msg_count + 4) * sizeof(CMsg_t))) {
+    return false;
+  }
+  uint64_t rss_start = rss();
+  if (CArena_init(msg_count + 4) || CPool_init(&stubs, 1) || CPool_init(&pool, msg_count + 1)) {
+    return true;
+  }
+  if (CFifo_init(&fifo, CPool_get_msg(&stubs))) {
+    return true;
+  }
+
+  uint64_t rss_bytes = 0;
+  for (uint32_t pass = 0; pass < passes; pass++) {
+    uint64_t start = ticks_serialized();
+    for (uint32_t i = 0; i < msg_count; i++) {
+      CIdx_t idx = CPool_get_msg(&pool);
+      CMsg(idx)->arg1 = i;
+      CFifo_add(&fifo, idx);
+    }
+    if (pass == 0) {
+      rss_bytes = rss() - rss_start;
+    }
+    for (uint32_t i = 0; i < msg_count; i++) {
+      CIdx_t idx = CFifo_rmv(&fifo);
+      if ((idx == CIDX_NIL) || (CMsg(idx)->arg1 != i)) {
+        printf(LDR "compact: ERROR expected arg1=%u\n", ldr(), i);
+        error = true;
+        break;
+      }
+      CMsg_ret(idx);
+    }
+    uint64_t stop = ticks_serialized();
+    if (pass == 0) {
+      first_ticks = stop - start;
+    } else {
+      rest_ticks += stop - start;
+    }
+  }
+
+  CFifo_deinit(&fifo);
+  CPool_deinit(&pool);
+  CPool_deinit(&stubs);
+  CArena_deinit();
+  report("compact", msg_count, sizeof(CMsg_t), rss_bytes, first_ticks, rest_ticks, passes);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 3) {
+    printf("Usage:\n");
+    printf(" %s msg_count passes\n", argv[0]);
+    printf("  each pass queues msg_count msgs then removes them\n");
+    return 1;
+  }
+
+  u_int32_t msg_count;
+  sscanf(argv[1], "%u", &msg_count);
+  u_int32_t passes;
+  sscanf(argv[2], "%u", &passes);
+  printf("compact_bench msg_count=%u passes=%u\n", msg_count, passes);
+  if ((msg_count == 0) || (msg_count >= CIDX_NIL - 4) || (passes == 0)) {
+    printf("msg_count must be > 0 and < %u, passes > 0\n", CIDX_NIL - 4);
+    return 1;
+  }
+
+  error |= timing_init();
+  error |= pointer(msg_count, passes);
+  error |= compact(msg_count, passes);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
@@ -2,7 +2,31 @@
  * This software is released into the public domain.
  */
 
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
 #include "diff_timespec.h"
+#include "dpf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define CALIBRATION_NS 20000000ll // 20ms
+#define OVERHEAD_SAMPLES 1000
+
+Timing_t gTiming = {
+  .use_tsc = false,
+  .ns_per_tick = 1.0,
+  .overhead = 0,
+  .overhead_fast = 0,
+};
 
 /**
  * Return the difference between to timespec in nano seconds
@@ -13,3 +37,93 @@ double diff_timespec_ns(struct timespec* t1, struct timespec* t2) {
    double diff = t1_ns - t2_ns;
    return diff;
 }
+
+/**
+ * Return true if the TSC runs at a constant rate in all
+ * ACPI P-, C- and T-states, CPUID.80000007H:EDX[8].
+ */
+static bool tsc_is_invariant(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) {
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx & (1 << 8)) != 0;
+#else
+  return false;
+#endif
+}
+
+static uint64_t monotonic_raw_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ((uint64_t)ts.tv_sec * ns_u64) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Read CLOCK_MONOTONIC_RAW and the tick bracketing it, returning
+ * the tick midway between the two reads.
+ */
+static uint64_t sample(uint64_t* pNs) {
+  uint64_t t0 = ticks_serialized();
+  *pNs = monotonic_raw_ns();
+  uint64_t t1 = ticks_serialized();
+  return t0 + ((t1 - t0) / 2);
+}
+
+/**
+ * Return the minimum ticks seen between two back to back reads.
+ */
+static uint64_t measure_overhead(bool serialized) {
+  uint64_t min = UINT64_MAX;
+  for (uint32_t i = 0; i < OVERHEAD_SAMPLES; i++) {
+    uint64_t t0, t1;
+    if (serialized) {
+      t0 = ticks_serialized();
+      t1 = ticks_serialized();
+    } else {
+      t0 = ticks();
+      t1 = ticks();
+    }
+    if ((t1 - t0) < min) {
+      min = t1 - t0;
+    }
+  }
+  return min;
+}
+
+/**
+ * @see diff_timespec.h
+ */
+bool timing_init(void) {
+  bool error = false;
+
+  gTiming.use_tsc = tsc_is_invariant();
+  gTiming.ns_per_tick = 1.0;
+  if (gTiming.use_tsc) {
+    uint64_t ns_start, ns_stop;
+    uint64_t tsc_start = sample(&ns_start);
+    while ((monotonic_raw_ns() - ns_start) < CALIBRATION_NS) {
+      // Busy wait so the cpu doesn't change state
+    }
+    uint64_t tsc_stop = sample(&ns_stop);
+
+    if (tsc_stop <= tsc_start) {
+      printf("timing_init: ERROR tsc didn't advance, using CLOCK_MONOTONIC\n");
+      gTiming.use_tsc = false;
+      error = true;
+    } else {
+      gTiming.ns_per_tick = (double)(ns_stop - ns_start) / (double)(tsc_stop - tsc_start);
+    }
+  }
+
+  gTiming.overhead = 0;
+  gTiming.overhead_fast = 0;
+  gTiming.overhead = measure_overhead(true);
+  gTiming.overhead_fast = measure_overhead(false);
+
+  DPF("timing_init: use_tsc=%u ns_per_tick=%.6f overhead=%lu overhead_fast=%lu\n",
+      gTiming.use_tsc, gTiming.ns_per_tick, gTiming.overhead, gTiming.overhead_fast);
+  return error;
+}
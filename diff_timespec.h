@@ -1,21 +1,148 @@
 /**
  * This software is released into the public domain.
+ *
+ * Timing support for the benchmarks.
+ *
+ * When the cpu has an invariant TSC, ticks() and ticks_serialized()
+ * read it directly and timing_init() calibrates it against
+ * CLOCK_MONOTONIC_RAW. Otherwise they fall back to CLOCK_MONOTONIC
+ * and a tick is a nano second.
  */
 
 #ifndef _DIFF_TIMESPEC_H
 #define _DIFF_TIMESPEC_H
 
 #include <sys/types.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 static const uint64_t ns_u64 = 1000000000ll;
 static const double ns_flt = 1000000000.0;
 
+typedef struct Timing_t {
+  bool use_tsc;           // true if ticks are TSC cycles
+  double ns_per_tick;     // Calibrated conversion factor
+  uint64_t overhead;      // Ticks to read ticks_serialized() twice
+  uint64_t overhead_fast; // Ticks to read ticks() twice
+} Timing_t;
+
+extern Timing_t gTiming;
+
 /**
  * Return the difference between to timespec in nano seconds
  */
 double diff_timespec_ns(struct timespec* t1, struct timespec* t2);
 
+/**
+ * Determine the tick source, calibrate it and measure the
+ * overhead of reading it. Must be called before using any
+ * of the ticks routines.
+ *
+ * @return true if an error, in which case CLOCK_MONOTONIC is used.
+ */
+bool timing_init(void);
+
+/**
+ * Return CLOCK_MONOTONIC in nano seconds, the fallback tick source.
+ */
+static inline uint64_t ticks_monotonic(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * ns_u64) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Return the current tick, not serialized so the cpu may
+ * reorder it with respect to surrounding instructions.
+ */
+static inline uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (gTiming.use_tsc) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+  }
+#endif
+  return ticks_monotonic();
+}
+
+/**
+ * Return the current tick, serialized so that all preceding
+ * instructions have completed and no following instruction
+ * starts before the tick is read. Use to bracket a region.
+ */
+static inline uint64_t ticks_serialized(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (gTiming.use_tsc) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("lfence\n\trdtsc\n\tlfence" : "=a" (lo), "=d" (hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+  }
+#endif
+  return ticks_monotonic();
+}
+
+/**
+ * Return the ticks between start and stop less the overhead
+ * of reading ticks_serialized() twice, never less than zero.
+ */
+static inline uint64_t ticks_elapsed(uint64_t stop, uint64_t start) {
+  uint64_t elapsed = stop - start;
+  return elapsed > gTiming.overhead ? elapsed - gTiming.overhead : 0;
+}
+
+/**
+ * Return the ticks between start and stop less the overhead
+ * of reading ticks() twice, never less than zero. Use for
+ * intervals taken with ticks() rather than ticks_serialized().
+ */
+static inline uint64_t ticks_elapsed_fast(uint64_t stop, uint64_t start) {
+  uint64_t elapsed = stop - start;
+  return elapsed > gTiming.overhead_fast ? elapsed - gTiming.overhead_fast : 0;
+}
+
+/**
+ * Convert ticks to nano seconds
+ */
+static inline double ticks_to_ns(uint64_t t) {
+  return (double)t * gTiming.ns_per_tick;
+}
+
+/**
+ * Spin for ns nano seconds
+ */
+static inline void spin_ns(uint64_t ns) {
+  if (ns == 0) {
+    return;
+  }
+  uint64_t start = ticks();
+  while (ticks_to_ns(ticks() - start) < (double)ns) {
+  }
+}
+
+/**
+ * Return the difference between two ticks in nano seconds
+ * with the overhead removed.
+ */
+static inline double diff_ticks_ns(uint64_t stop, uint64_t start) {
+  return ticks_to_ns(ticks_elapsed(stop, start));
+}
+
+/**
+ * Return the difference between two ticks() in nano seconds
+ * with the overhead of ticks() removed.
+ */
+static inline double diff_ticks_fast_ns(uint64_t stop, uint64_t start) {
+  return ticks_to_ns(ticks_elapsed_fast(stop, start));
+}
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
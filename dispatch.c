@@ -0,0 +1,150 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "dispatch.h"
+#include "dpf.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Return the next pseudo random number
+ */
+static inline uint64_t next_rand(Dispatch_t* d) {
+  uint64_t x = d->rng;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  d->rng = x;
+  return x;
+}
+
+/**
+ * @see dispatch.h
+ */
+bool DispatchSent_init(DispatchSent_t* s, uint32_t producer_count, uint32_t target_count) {
+  // Each row on its own cache lines so producers don't share them
+  uint32_t per_line = 64 / sizeof(uint64_t);
+  s->producer_count = producer_count;
+  s->target_count = target_count;
+  s->stride = ((target_count + per_line - 1) / per_line) * per_line;
+  size_t size = (size_t)producer_count * s->stride * sizeof(uint64_t);
+  size_t done_size = (size_t)target_count * DISPATCH_DONE_STRIDE * sizeof(uint64_t);
+  s->counts = NULL;
+  s->done = NULL;
+  if ((size == 0) || (done_size == 0) ||
+      (posix_memalign((void**)&s->counts, 64, size) != 0) ||
+      (posix_memalign((void**)&s->done, 64, done_size) != 0)) {
+    DispatchSent_deinit(s);
+    return true;
+  }
+  memset(s->counts, 0, size);
+  memset(s->done, 0, done_size);
+  return false;
+}
+
+/**
+ * @see dispatch.h
+ */
+void DispatchSent_deinit(DispatchSent_t* s) {
+  free(s->counts);
+  free(s->done);
+  s->counts = NULL;
+  s->done = NULL;
+}
+
+/**
+ * @see dispatch.h
+ */
+void Dispatch_init(Dispatch_t* d, uint64_t seed) {
+  d->rng = seed != 0 ? seed : 0x9e3779b97f4a7c15ull;
+  d->rr_idx = 0;
+  d->sent = NULL;
+  d->row = NULL;
+}
+
+/**
+ * @see dispatch.h
+ */
+void Dispatch_attach(Dispatch_t* d, DispatchSent_t* sent, uint32_t producer) {
+  d->sent = sent;
+  d->row = &sent->counts[producer * sent->stride];
+}
+
+/**
+ * @see dispatch.h
+ */
+uint32_t Dispatch_pick_rr(Dispatch_t* d, uint32_t count) {
+  uint32_t idx = d->rr_idx;
+  if (idx >= count) {
+    idx = 0;
+  }
+  d->rr_idx = idx + 1;
+  return idx;
+}
+
+/**
+ * @see dispatch.h
+ */
+uint32_t Dispatch_pick_random(Dispatch_t* d, uint32_t count) {
+  return (uint32_t)((next_rand(d) & 0xffffffff) % count);
+}
+
+/**
+ * @see dispatch.h
+ */
+uint32_t Dispatch_pick_p2c(Dispatch_t* d, const uint32_t* ids, uint32_t count) {
+  if (count < 2) {
+    return 0;
+  }
+  uint64_t r = next_rand(d);
+  uint32_t a = (uint32_t)((r & 0xffffffff) % count);
+  uint32_t b = (uint32_t)((r >> 32) % (count - 1));
+  if (b >= a) {
+    // Distinct from a
+    b += 1;
+  }
+  uint64_t depth_a = Dispatch_sent_depth(d, ids != NULL ? ids[a] : a);
+  uint64_t depth_b = Dispatch_sent_depth(d, ids != NULL ? ids[b] : b);
+  return depth_b < depth_a ? b : a;
+}
+
+/**
+ * @see dispatch.h
+ */
+void Dispatch_zipf_init(double* cdf, uint32_t count) {
+  double sum = 0.0;
+  for (uint32_t i = 0; i < count; i++) {
+    sum += 1.0 / (double)(i + 1);
+    cdf[i] = sum;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    cdf[i] /= sum;
+  }
+}
+
+/**
+ * @see dispatch.h
+ */
+uint32_t Dispatch_pick_cdf(Dispatch_t* d, const double* cdf, uint32_t count) {
+  double u = (double)(next_rand(d) >> 11) * (1.0 / (double)(1ull << 53));
+  uint32_t lo = 0;
+  uint32_t hi = count - 1;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (cdf[mid] <= u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
@@ -0,0 +1,157 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Choose which of several consumer fifos to send a msg to.
+ *
+ * Dispatch_pick_p2c uses the power of two choices, of two random
+ * targets it picks the one with the smaller approximate depth. The
+ * depth is the sum of the producers' sequence counters for a target,
+ * counted by Dispatch_send after it adds, less the target's done
+ * counter, counted by its consumer with Dispatch_done. Each producer's
+ * counters are in its own row of a DispatchSent_t written only by it
+ * and each done counter is on its own cache line, so add and
+ * Dispatch_send have no shared atomic, the cost is reading
+ * producer_count counters for each of the two targets a pick. Only
+ * the msgs sent with Dispatch_send should be counted done, the
+ * target's other msgs don't change its depth.
+ *
+ * Dispatch_depth and Dispatch_add are for a single target shared by
+ * producers that aren't known up front, see spill.h, there the count
+ * is enq_seq and Dispatch_add pays for an atomic add on it.
+ */
+
+#ifndef _DISPATCH_H
+#define _DISPATCH_H
+
+#include "mpscfifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DispatchSent_t {
+  uint32_t producer_count;
+  uint32_t target_count;
+  uint32_t stride;          // Counters per row, target_count rounded up to a cache line
+  uint64_t* counts;         // [producer_count][stride] msgs sent to each target
+  uint64_t* done;           // [target_count] msgs handled, each on its own cache line
+} DispatchSent_t;
+
+typedef struct Dispatch_t {
+  uint64_t rng;             // xorshift state
+  uint32_t rr_idx;          // Next target for Dispatch_pick_rr
+  DispatchSent_t* sent;     // NULL until Dispatch_attach
+  uint64_t* row;            // This producer's counters in sent
+} Dispatch_t;
+
+/**
+ * Initialize the sequence counters of producer_count producers
+ * sending to target_count targets.
+ *
+ * @return true if an error.
+ */
+bool DispatchSent_init(DispatchSent_t* s, uint32_t producer_count, uint32_t target_count);
+
+/**
+ * Deinitialize the sequence counters.
+ */
+void DispatchSent_deinit(DispatchSent_t* s);
+
+/**
+ * Initialize a dispatcher, each producer has its own.
+ */
+void Dispatch_init(Dispatch_t* d, uint64_t seed);
+
+/**
+ * Attach a dispatcher to its producer's row of sent, needed for
+ * Dispatch_send and Dispatch_pick_p2c.
+ */
+void Dispatch_attach(Dispatch_t* d, DispatchSent_t* sent, uint32_t producer);
+
+#define DISPATCH_DONE_STRIDE (64 / sizeof(uint64_t))
+
+/**
+ * Count a msg sent to the target id with Dispatch_send as handled,
+ * called only by the target's consumer.
+ */
+static inline void Dispatch_done(DispatchSent_t* s, uint32_t id) {
+  uint64_t* done = &s->done[id * DISPATCH_DONE_STRIDE];
+  __atomic_store_n(done, *done + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return the approximate number of msgs sent to the target id not
+ * yet handled.
+ */
+static inline uint64_t Dispatch_sent_depth(const Dispatch_t* d, uint32_t id) {
+  const DispatchSent_t* s = d->sent;
+  uint64_t processed = __atomic_load_n(&s->done[id * DISPATCH_DONE_STRIDE], __ATOMIC_RELAXED);
+  uint64_t enqueued = 0;
+  for (uint32_t i = 0; i < s->producer_count; i++) {
+    enqueued += __atomic_load_n(&s->counts[(i * s->stride) + id], __ATOMIC_RELAXED);
+  }
+  return enqueued > processed ? enqueued - processed : 0;
+}
+
+/**
+ * Add pMsg to pQ, the target id, and count it in this producer's row.
+ */
+static inline void Dispatch_send(Dispatch_t* d, uint32_t id, MpscFifo_t* pQ, Msg_t* pMsg) {
+  add(pQ, pMsg);
+  // Only this producer writes its row so a plain increment, stored
+  // relaxed so the others may read it
+  __atomic_store_n(&d->row[id], d->row[id] + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return the approximate number of msgs in pQ.
+ */
+static inline uint64_t Dispatch_depth(MpscFifo_t* pQ) {
+  uint64_t processed = __atomic_load_n(&pQ->msgs_processed, __ATOMIC_RELAXED);
+  uint64_t enqueued = __atomic_load_n(&pQ->enq_seq, __ATOMIC_RELAXED);
+  return enqueued > processed ? enqueued - processed : 0;
+}
+
+/**
+ * Add pMsg to pQ and count it in pQ->enq_seq.
+ */
+static inline void Dispatch_add(MpscFifo_t* pQ, Msg_t* pMsg) {
+  add(pQ, pMsg);
+  __atomic_fetch_add(&pQ->enq_seq, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return the index of the next of count targets round robin.
+ */
+uint32_t Dispatch_pick_rr(Dispatch_t* d, uint32_t count);
+
+/**
+ * Return the index of a random one of count targets.
+ */
+uint32_t Dispatch_pick_random(Dispatch_t* d, uint32_t count);
+
+/**
+ * Return the index of the shallower of two random of count targets,
+ * the target id of index i is ids[i] or i if ids is NULL.
+ */
+uint32_t Dispatch_pick_p2c(Dispatch_t* d, const uint32_t* ids, uint32_t count);
+
+/**
+ * Fill cdf[0..count) with the cumulative zipf distribution, with an
+ * exponent of 1, of count targets where target 0 is the hottest.
+ */
+void Dispatch_zipf_init(double* cdf, uint32_t count);
+
+/**
+ * Return the index of a target drawn from cdf, see Dispatch_zipf_init.
+ */
+uint32_t Dispatch_pick_cdf(Dispatch_t* d, const double* cdf, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Compare round robin and power of two choices dispatch when one
+ * consumer is slow.
+ *
+ * Each producer sends msg_count msgs, at most window outstanding,
+ * with arg2 the tick it was sent. Consumer 0 spins slow_ns per msg
+ * then yields and the others spin work_ns, every consumer records the latency from
+ * send to receive and the histograms are merged for each mode.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "dispatch.h"
+#include "histo.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MODE_RR  0
+#define MODE_P2C 1
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Consumer {
+  pthread_t thread;
+  MpscFifo_t fifo;
+  MsgPool_t pool;           // Only for the stub
+  DispatchSent_t* sent;
+  uint32_t idx;
+  uint64_t work_ns;
+  bool slow;
+  _Atomic(uint32_t) stop;
+  uint64_t received;
+  Histo_t histo;
+} Consumer;
+
+typedef struct Producer {
+  pthread_t thread;
+  MsgPool_t pool;
+  uint32_t idx;
+  uint32_t mode;
+  uint64_t msg_count;
+  MpscFifo_t** targets;
+  uint32_t target_count;
+  DispatchSent_t* sent;
+  uint64_t no_msgs;
+} Producer;
+
+static void* consumer(void* p) {
+  Consumer* c = (Consumer*)p;
+
+  while (true) {
+    Msg_t* msg = rmv(&c->fifo);
+    if (msg == NULL) {
+      if (__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE) != 0) {
+        // Check again as the msgs may have been added before stop
+        if ((msg = rmv(&c->fifo)) == NULL) {
+          break;
+        }
+      } else {
+        sched_yield();
+        continue;
+      }
+    }
+    Histo_record(&c->histo, ticks() - msg->arg2);
+    c->received += 1;
+    spin_ns(c->work_ns);
+    ret_msg(msg);
+    Dispatch_done(c->sent, c->idx);
+    if (c->slow) {
+      // Also give up the cpu so it falls behind when cpus are shared
+      sched_yield();
+    }
+  }
+
+  deinitMpscFifo(&c->fifo, NULL);
+  return NULL;
+}
+
+static void* producer(void* p) {
+  Producer* prod = (Producer*)p;
+  Dispatch_t d;
+
+  Dispatch_init(&d, prod->idx + 1);
+  Dispatch_attach(&d, prod->sent, prod->idx);
+  for (uint64_t i = 0; i < prod->msg_count; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&prod->pool)) == NULL) {
+      prod->no_msgs += 1;
+      sched_yield();
+    }
+    uint32_t idx = prod->mode == MODE_P2C
+      ? Dispatch_pick_p2c(&d, NULL, prod->target_count)
+      : Dispatch_pick_rr(&d, prod->target_count);
+    msg->arg1 = prod->idx;
+    msg->arg2 = ticks();
+    if (prod->mode == MODE_P2C) {
+      Dispatch_send(&d, idx, prod->targets[idx], msg);
+    } else {
+      add(prod->targets[idx], msg);
+    }
+  }
+  return NULL;
+}
+
+bool run(uint32_t mode, uint32_t consumer_count, uint32_t producer_count,
+    uint64_t msg_count, uint32_t window, uint64_t work_ns, uint64_t slow_ns) {
+  bool error = false;
+  const char* mode_name = mode == MODE_P2C ? "p2c" : "rr";
+
+  Consumer* consumers = calloc(consumer_count, sizeof(Consumer));
+  Producer* producers = calloc(producer_count, sizeof(Producer));
+  MpscFifo_t** targets = calloc(consumer_count, sizeof(MpscFifo_t*));
+  DispatchSent_t sent;
+  if ((consumers == NULL) || (producers == NULL) || (targets == NULL) ||
+      DispatchSent_init(&sent, producer_count, consumer_count)) {
+    printf(LDR "run: ERROR unable to allocate\n", ldr());
+    return true;
+  }
+
+  for (uint32_t i = 0; i < consumer_count; i++) {
+    Consumer* c = &consumers[i];
+    if (MsgPool_init(&c->pool, 1)) {
+      printf(LDR "run: ERROR unable to create consumer pool\n", ldr());
+      return true;
+    }
+    initMpscFifo(&c->fifo, MsgPool_get_msg(&c->pool));
+    c->sent = &sent;
+    c->idx = i;
+    c->slow = i == 0;
+    c->work_ns = c->slow ? slow_ns : work_ns;
+    Histo_clear(&c->histo);
+    targets[i] = &c->fifo;
+    pthread_create(&c->thread, NULL, consumer, c);
+  }
+
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < producer_count; i++) {
+    Producer* prod = &producers[i];
+    if (MsgPool_init(&prod->pool, window)) {
+      printf(LDR "run: ERROR unable to create producer pool\n", ldr());
+      return true;
+    }
+    prod->idx = i;
+    prod->mode = mode;
+    prod->msg_count = msg_count;
+    prod->targets = targets;
+    prod->target_count = consumer_count;
+    prod->sent = &sent;
+    pthread_create(&prod->thread, NULL, producer, prod);
+  }
+
+  // Producers are done sending, then the consumers are stopped so
+  // their stubs, which may belong to a producer pool, are returned
+  uint64_t no_msgs = 0;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+    no_msgs += producers[i].no_msgs;
+  }
+  for (uint32_t i = 0; i < consumer_count; i++) {
+    __atomic_store_n(&consumers[i].stop, 1, __ATOMIC_RELEASE);
+  }
+  Histo_t histo;
+  Histo_clear(&histo);
+  uint64_t received = 0;
+  for (uint32_t i = 0; i < consumer_count; i++) {
+    pthread_join(consumers[i].thread, NULL);
+    Histo_merge(&histo, &consumers[i].histo);
+    received += consumers[i].received;
+  }
+  uint64_t time_stop = ticks_serialized();
+
+  for (uint32_t i = 0; i < producer_count; i++) {
+    MsgPool_deinit(&producers[i].pool);
+  }
+  for (uint32_t i = 0; i < consumer_count; i++) {
+    MsgPool_deinit(&consumers[i].pool);
+  }
+
+  uint64_t expected = msg_count * producer_count;
+  if (received != expected) {
+    printf(LDR "run: ERROR received=%lu expected=%lu\n", ldr(), received, expected);
+    error = true;
+  }
+
+  double slow_share = received != 0 ? (double)consumers[0].received / (double)received : 0.0;
+  printf("%-4s msgs_per_sec=%.0f slow_share=%.3f no_msgs=%lu\n", mode_name,
+      (double)received * ns_flt / diff_ticks_ns(time_stop, time_start), slow_share, no_msgs);
+  char name[32];
+  snprintf(name, sizeof(name), "%-4s latency_ns", mode_name);
+  Histo_print(&histo, name, gTiming.ns_per_tick);
+
+  DispatchSent_deinit(&sent);
+  free(targets);
+  free(producers);
+  free(consumers);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 7) {
+    printf("Usage:\n");
+    printf(" %s consumer_count producer_count msg_count window work_ns slow_ns\n", argv[0]);
+    printf("  each producer sends msg_count msgs with at most window outstanding,\n");
+    printf("  consumer 0 spins slow_ns per msg and the others work_ns\n");
+    return 1;
+  }
+
+  u_int32_t consumer_count;
+  sscanf(argv[1], "%u", &consumer_count);
+  u_int32_t producer_count;
+  sscanf(argv[2], "%u", &producer_count);
+  u_int64_t msg_count;
+  sscanf(argv[3], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[4], "%u", &window);
+  u_int64_t work_ns;
+  sscanf(argv[5], "%lu", &work_ns);
+  u_int64_t slow_ns;
+  sscanf(argv[6], "%lu", &slow_ns);
+  printf("dispatch_bench consumer_count=%u producer_count=%u msg_count=%lu window=%u "
+      "work_ns=%lu slow_ns=%lu\n", consumer_count, producer_count, msg_count, window,
+      work_ns, slow_ns);
+
+  if ((consumer_count < 2) || (producer_count == 0) || (window == 0)) {
+    printf("consumer_count must be >= 2, producer_count and window > 0\n");
+    return 1;
+  }
+
+  error |= timing_init();
+  error |= run(MODE_RR, consumer_count, producer_count, msg_count, window, work_ns, slow_ns);
+  error |= run(MODE_P2C, consumer_count, producer_count, msg_count, window, work_ns, slow_ns);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "dyn_fifo.h"
+#include "epoch.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct DynFifo_t {
+  MpscFifo_t fifo;            // First so a MpscFifo_t* is a DynFifo_t*
+  EpochEntry_t entry;
+} DynFifo_t;
+
+static ATOMIC(uint64_t) gCreated = 0;
+static ATOMIC(uint64_t) gDestroyed = 0;
+static ATOMIC(uint64_t) gReclaimed = 0;
+static ATOMIC(uint64_t) gDrainedMsgs = 0;
+
+/**
+ * Called when no producer can be adding to the fifo
+ */
+static void reclaim(EpochEntry_t* pEntry) {
+  DynFifo_t* pDyn = (DynFifo_t*)((char*)pEntry - offsetof(DynFifo_t, entry));
+  uint32_t drained = drain(&pDyn->fifo);
+  Msg_t* pStub;
+  deinitMpscFifo(&pDyn->fifo, &pStub);
+  if (pStub != NULL) {
+    printf(LDR "reclaim: ERROR fifo=%p stub=%p has no pool, leaked\n", ldr(), pDyn, pStub);
+  }
+  DPF(LDR "reclaim: fifo=%p drained=%u\n", ldr(), pDyn, drained);
+  free(pDyn);
+  __atomic_fetch_add(&gDrainedMsgs, drained, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&gReclaimed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @see dyn_fifo.h
+ */
+MpscFifo_t* DynFifo_create(Msg_t* pStub) {
+  DynFifo_t* pDyn;
+  if (posix_memalign((void**)&pDyn, 64, sizeof(DynFifo_t)) != 0) {
+    printf(LDR "DynFifo_create: ERROR unable to allocate\n", ldr());
+    return NULL;
+  }
+  initMpscFifo(&pDyn->fifo, pStub);
+  __atomic_fetch_add(&gCreated, 1, __ATOMIC_RELAXED);
+  return &pDyn->fifo;
+}
+
+/**
+ * @see dyn_fifo.h
+ */
+void DynFifo_destroy(MpscFifo_t* pQ) {
+  DynFifo_t* pDyn = (DynFifo_t*)pQ;
+  __atomic_fetch_add(&gDestroyed, 1, __ATOMIC_RELAXED);
+  Epoch_retire(&pDyn->entry, reclaim);
+}
+
+/**
+ * @see dyn_fifo.h
+ */
+bool DynFifo_send(ATOMIC(MpscFifo_t*)* ppSlot, Msg_t* pMsg) {
+  bool error;
+  Epoch_enter();
+  MpscFifo_t* pQ = __atomic_load_n(ppSlot, __ATOMIC_ACQUIRE);
+  if (pQ != NULL) {
+    add(pQ, pMsg);
+    error = false;
+  } else {
+    error = true;
+  }
+  Epoch_exit();
+  if (error) {
+    ret_msg(pMsg);
+  }
+  return error;
+}
+
+/**
+ * @see dyn_fifo.h
+ */
+void DynFifo_get_stats(DynFifoStats_t* pStats) {
+  pStats->created = __atomic_load_n(&gCreated, __ATOMIC_RELAXED);
+  pStats->destroyed = __atomic_load_n(&gDestroyed, __ATOMIC_RELAXED);
+  pStats->reclaimed = __atomic_load_n(&gReclaimed, __ATOMIC_RELAXED);
+  pStats->drained_msgs = __atomic_load_n(&gDrainedMsgs, __ATOMIC_RELAXED);
+}
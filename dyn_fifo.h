@@ -0,0 +1,64 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Fifos which are created and destroyed at runtime while producers
+ * may still be sending to them.
+ *
+ * Producers find a fifo through a shared pointer, a slot, and send
+ * with DynFifo_send which reads the slot and adds in an epoch
+ * critical section. To destroy a fifo its consumer clears or
+ * replaces the slot, stops removing and calls DynFifo_destroy. Once
+ * no producer can still be adding, see epoch.h, the fifo is drained,
+ * returning late msgs to their pools, its stub is returned and it's
+ * freed.
+ */
+
+#ifndef _DYN_FIFO_H
+#define _DYN_FIFO_H
+
+#include "mpscfifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DynFifoStats_t {
+  uint64_t created;
+  uint64_t destroyed;
+  uint64_t reclaimed;
+  uint64_t drained_msgs;      // Msgs which arrived after their fifo was destroyed
+} DynFifoStats_t;
+
+/**
+ * Allocate and initialize a fifo, pStub must belong to a pool.
+ *
+ * @return NULL if it couldn't be allocated
+ */
+MpscFifo_t* DynFifo_create(Msg_t* pStub);
+
+/**
+ * Destroy pQ, it must no longer be reachable through any slot and
+ * its consumer must have stopped removing.
+ */
+void DynFifo_destroy(MpscFifo_t* pQ);
+
+/**
+ * Add pMsg to the fifo in *ppSlot.
+ *
+ * @return true if the slot is empty, pMsg is returned to its pool
+ */
+bool DynFifo_send(ATOMIC(MpscFifo_t*)* ppSlot, Msg_t* pMsg);
+
+/**
+ * Get the counts since the program started.
+ */
+void DynFifo_get_stats(DynFifoStats_t* pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
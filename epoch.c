@@ -0,0 +1,213 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "epoch.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A thread's epoch while it's not in a critical section
+#define EPOCH_QUIESCENT 0
+
+typedef struct EpochThread_t {
+  ATOMIC(uint64_t) epoch __attribute__(( aligned (64) ));
+  ATOMIC(uint32_t) in_use;
+  uint32_t nesting;             // Only used by the owning thread
+} EpochThread_t;
+
+static EpochThread_t gThreads[EPOCH_MAX_THREADS];
+static ATOMIC(uint32_t) gThreadsHigh = 0;   // Slots at or above this were never used
+static ATOMIC(uint64_t) gEpoch = 1;
+
+static pthread_once_t gKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gKey;
+static __thread EpochThread_t* tThread = NULL;
+
+static pthread_mutex_t gRetiredLock = PTHREAD_MUTEX_INITIALIZER;
+static EpochEntry_t* gRetired = NULL;
+static uint32_t gRetiredCount = 0;
+
+/**
+ * Release the exiting thread's slot
+ */
+static void release_thread(void* p) {
+  EpochThread_t* t = (EpochThread_t*)p;
+  __atomic_store_n(&t->epoch, EPOCH_QUIESCENT, __ATOMIC_RELEASE);
+  __atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_key(void) {
+  pthread_key_create(&gKey, release_thread);
+}
+
+/**
+ * Return the calling thread's slot, claiming one if needed
+ */
+static EpochThread_t* get_thread(void) {
+  EpochThread_t* t = tThread;
+  if (__builtin_expect(t != NULL, 1)) {
+    return t;
+  }
+  pthread_once(&gKeyOnce, create_key);
+  for (uint32_t i = 0; i < EPOCH_MAX_THREADS; i++) {
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&gThreads[i].in_use, &expected, 1,
+          false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      t = &gThreads[i];
+      t->nesting = 0;
+      uint32_t high = __atomic_load_n(&gThreadsHigh, __ATOMIC_RELAXED);
+      while ((high < i + 1) && !__atomic_compare_exchange_n(&gThreadsHigh, &high, i + 1,
+            false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      }
+      pthread_setspecific(gKey, t);
+      tThread = t;
+      return t;
+    }
+  }
+  printf(LDR "get_thread: ERROR more than EPOCH_MAX_THREADS=%u threads\n",
+      ldr(), EPOCH_MAX_THREADS);
+  CRASH();
+  return NULL;
+}
+
+/**
+ * @see epoch.h
+ */
+void Epoch_enter(void) {
+  EpochThread_t* t = get_thread();
+  if (t->nesting++ != 0) {
+    return;
+  }
+  // Announce the epoch then check it didn't advance before the
+  // announcement was visible, otherwise we might announce a stale one
+  uint64_t epoch = __atomic_load_n(&gEpoch, __ATOMIC_ACQUIRE);
+  while (true) {
+    __atomic_store_n(&t->epoch, epoch, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t now = __atomic_load_n(&gEpoch, __ATOMIC_ACQUIRE);
+    if (now == epoch) {
+      break;
+    }
+    epoch = now;
+  }
+}
+
+/**
+ * @see epoch.h
+ */
+void Epoch_exit(void) {
+  EpochThread_t* t = tThread;
+  if (--t->nesting == 0) {
+    __atomic_store_n(&t->epoch, EPOCH_QUIESCENT, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * Advance the global epoch if every thread in a critical section
+ * has announced the current one.
+ */
+static void try_advance(void) {
+  uint64_t epoch = __atomic_load_n(&gEpoch, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  uint32_t high = __atomic_load_n(&gThreadsHigh, __ATOMIC_ACQUIRE);
+  for (uint32_t i = 0; i < high; i++) {
+    uint64_t te = __atomic_load_n(&gThreads[i].epoch, __ATOMIC_ACQUIRE);
+    if ((te != EPOCH_QUIESCENT) && (te != epoch)) {
+      return;
+    }
+  }
+  __atomic_compare_exchange_n(&gEpoch, &epoch, epoch + 1,
+      false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/**
+ * @see epoch.h
+ */
+void Epoch_retire(EpochEntry_t* pEntry, void (*reclaim)(EpochEntry_t* pEntry)) {
+  pEntry->reclaim = reclaim;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  pEntry->epoch = __atomic_load_n(&gEpoch, __ATOMIC_ACQUIRE);
+
+  pthread_mutex_lock(&gRetiredLock);
+  pEntry->pNext = gRetired;
+  gRetired = pEntry;
+  uint32_t count = ++gRetiredCount;
+  pthread_mutex_unlock(&gRetiredLock);
+
+  if ((count >= EPOCH_RECLAIM_THRESHOLD) && ((tThread == NULL) || (tThread->nesting == 0))) {
+    Epoch_reclaim();
+  }
+}
+
+/**
+ * @see epoch.h
+ */
+uint32_t Epoch_reclaim(void) {
+  try_advance();
+  uint64_t epoch = __atomic_load_n(&gEpoch, __ATOMIC_ACQUIRE);
+
+  // Take the entries at least two epochs old off the list
+  EpochEntry_t* pReclaim = NULL;
+  pthread_mutex_lock(&gRetiredLock);
+  EpochEntry_t** ppEntry = &gRetired;
+  while (*ppEntry != NULL) {
+    EpochEntry_t* pEntry = *ppEntry;
+    if (pEntry->epoch + 2 <= epoch) {
+      *ppEntry = pEntry->pNext;
+      pEntry->pNext = pReclaim;
+      pReclaim = pEntry;
+      gRetiredCount -= 1;
+    } else {
+      ppEntry = &pEntry->pNext;
+    }
+  }
+  pthread_mutex_unlock(&gRetiredLock);
+
+  // Outside the lock as reclaim may retire more
+  uint32_t count = 0;
+  while (pReclaim != NULL) {
+    EpochEntry_t* pEntry = pReclaim;
+    pReclaim = pEntry->pNext;
+    pEntry->reclaim(pEntry);
+    count += 1;
+  }
+  return count;
+}
+
+/**
+ * @see epoch.h
+ */
+uint32_t Epoch_reclaim_all(void) {
+  uint32_t count = 0;
+  while (true) {
+    count += Epoch_reclaim();
+    if (Epoch_pending() == 0) {
+      break;
+    }
+    sched_yield();
+  }
+  return count;
+}
+
+/**
+ * @see epoch.h
+ */
+uint32_t Epoch_pending(void) {
+  pthread_mutex_lock(&gRetiredLock);
+  uint32_t count = gRetiredCount;
+  pthread_mutex_unlock(&gRetiredLock);
+  return count;
+}
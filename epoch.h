@@ -0,0 +1,85 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Epoch based reclamation. A thread reads pointers to objects which
+ * may be destroyed between Epoch_enter and Epoch_exit, the object's
+ * owner unlinks it so no new reader can find it and calls
+ * Epoch_retire. Its reclaim function runs once the global epoch has
+ * advanced twice, by then every thread that might have read the
+ * pointer has left its critical section.
+ *
+ * Threads register on their first Epoch_enter and are released when
+ * they exit, at most EPOCH_MAX_THREADS at a time. The retired list
+ * is protected by a mutex, retiring is expected to be much less
+ * frequent than entering.
+ */
+
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include "mpscfifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EPOCH_MAX_THREADS 512
+
+// Epoch_retire calls Epoch_reclaim when this many are waiting
+#define EPOCH_RECLAIM_THRESHOLD 32
+
+typedef struct EpochEntry_t EpochEntry_t;
+
+typedef struct EpochEntry_t {
+  EpochEntry_t* pNext;
+  uint64_t epoch;                     // Global epoch when retired
+  void (*reclaim)(EpochEntry_t* pEntry);
+} EpochEntry_t;
+
+/**
+ * Enter a critical section, may be nested.
+ */
+void Epoch_enter(void);
+
+/**
+ * Leave a critical section.
+ */
+void Epoch_exit(void);
+
+/**
+ * Retire pEntry, which is typically embedded in the object, reclaim
+ * is called with pEntry when no thread can still be using it. The
+ * object must already be unreachable by new readers.
+ */
+void Epoch_retire(EpochEntry_t* pEntry, void (*reclaim)(EpochEntry_t* pEntry));
+
+/**
+ * Try to advance the global epoch and reclaim what is safe to. Must
+ * not be called in a critical section.
+ *
+ * @return number reclaimed
+ */
+uint32_t Epoch_reclaim(void);
+
+/**
+ * Reclaim everything retired so far, waiting for the threads in
+ * critical sections to leave. Must not be called in a critical
+ * section.
+ *
+ * @return number reclaimed
+ */
+uint32_t Epoch_reclaim_all(void);
+
+/**
+ * Return the number of retired entries not yet reclaimed.
+ */
+uint32_t Epoch_pending(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
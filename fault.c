@@ -0,0 +1,173 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "fault.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+_Atomic(uint32_t) gFaultEnabled = 0;
+
+typedef struct FaultPoint_t {
+  uint32_t rate_ppm;
+  uint32_t kind;
+  uint64_t delay_ns;
+  _Atomic(uint64_t) injected;
+} FaultPoint_t;
+
+static FaultPoint_t gPoints[FAULT_POINT_COUNT];
+static __thread uint64_t tRng = 0;
+
+static const char* point_names[FAULT_POINT_COUNT] = { "add_link", "rmv_stall", "ret_msg" };
+static const char* kind_names[FAULT_KIND_COUNT] = { "yield", "spin", "sleep" };
+
+/**
+ * Return the next pseudo random number of the calling thread
+ */
+static inline uint64_t next_rand(void) {
+  uint64_t x = tRng;
+  if (__builtin_expect(x == 0, 0)) {
+    x = (uint64_t)pthread_self() ^ ticks() ^ 0x9e3779b97f4a7c15ull;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  tRng = x;
+  return x;
+}
+
+/**
+ * @see fault.h
+ */
+bool fault_set(uint32_t point, uint32_t rate_ppm, uint32_t kind, uint64_t delay_ns) {
+  if ((point >= FAULT_POINT_COUNT) || (kind >= FAULT_KIND_COUNT) || (rate_ppm > 1000000)) {
+    printf("fault_set: ERROR point=%u kind=%u rate_ppm=%u\n", point, kind, rate_ppm);
+    return true;
+  }
+  FaultPoint_t* p = &gPoints[point];
+  p->kind = kind;
+  p->delay_ns = delay_ns;
+  __atomic_store_n(&p->rate_ppm, rate_ppm, __ATOMIC_RELEASE);
+  return false;
+}
+
+/**
+ * Return the index of name in names or count if it isn't one
+ */
+static uint32_t lookup(const char* name, size_t len, const char** names, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if ((strlen(names[i]) == len) && (strncmp(name, names[i], len) == 0)) {
+      return i;
+    }
+  }
+  return count;
+}
+
+/**
+ * @see fault.h
+ */
+bool fault_parse(const char* spec) {
+  const char* colon = strchr(spec, ':');
+  if (colon == NULL) {
+    goto error;
+  }
+  uint32_t point = lookup(spec, (size_t)(colon - spec), point_names, FAULT_POINT_COUNT);
+
+  char* end;
+  unsigned long rate_ppm = strtoul(colon + 1, &end, 10);
+  if (*end != ':') {
+    goto error;
+  }
+  const char* kind_name = end + 1;
+  colon = strchr(kind_name, ':');
+  size_t kind_len = colon != NULL ? (size_t)(colon - kind_name) : strlen(kind_name);
+  uint32_t kind = lookup(kind_name, kind_len, kind_names, FAULT_KIND_COUNT);
+
+  uint64_t delay_ns = 0;
+  if (colon != NULL) {
+    delay_ns = strtoull(colon + 1, &end, 10);
+    if (*end != 0) {
+      goto error;
+    }
+  }
+  if ((point < FAULT_POINT_COUNT) && (kind < FAULT_KIND_COUNT)) {
+    return fault_set(point, (uint32_t)rate_ppm, kind, delay_ns);
+  }
+
+error:
+  printf("fault_parse: ERROR invalid spec %s, expected point:rate_ppm:kind[:delay_ns]\n", spec);
+  return true;
+}
+
+/**
+ * @see fault.h
+ */
+void fault_enable(bool enable) {
+  __atomic_store_n(&gFaultEnabled, enable ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @see fault.h
+ */
+const char* fault_point_name(uint32_t point) {
+  return point < FAULT_POINT_COUNT ? point_names[point] : "unknown";
+}
+
+/**
+ * @see fault.h
+ */
+const char* fault_kind_name(uint32_t kind) {
+  return kind < FAULT_KIND_COUNT ? kind_names[kind] : "unknown";
+}
+
+/**
+ * @see fault.h
+ */
+uint64_t fault_injected(uint32_t point) {
+  return __atomic_load_n(&gPoints[point].injected, __ATOMIC_RELAXED);
+}
+
+/**
+ * @see fault.h
+ */
+void fault_inject(uint32_t point) {
+  FaultPoint_t* p = &gPoints[point];
+  uint32_t rate_ppm = __atomic_load_n(&p->rate_ppm, __ATOMIC_ACQUIRE);
+  if ((rate_ppm == 0) || ((next_rand() % 1000000) >= rate_ppm)) {
+    return;
+  }
+  __atomic_fetch_add(&p->injected, 1, __ATOMIC_RELAXED);
+  switch (p->kind) {
+    case FAULT_YIELD: {
+      sched_yield();
+      break;
+    }
+    case FAULT_SPIN: {
+      spin_ns(p->delay_ns);
+      break;
+    }
+    case FAULT_SLEEP: {
+      struct timespec ts = {
+        .tv_sec = (time_t)(p->delay_ns / 1000000000ull),
+        .tv_nsec = (long)(p->delay_ns % 1000000000ull)
+      };
+      nanosleep(&ts, NULL);
+      break;
+    }
+  }
+}
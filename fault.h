@@ -0,0 +1,96 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Fault injection at the points where a preempted thread holds up
+ * others, to measure how the consumers' tail latency degrades.
+ *
+ * At each FAULT point a thread, with the point's probability, yields,
+ * spins or sleeps for the point's duration. The points are between
+ * the exchange of pHead and the link in add, in rmv's loop waiting
+ * for such a producer and in ret_msg. Fault injection is compiled in
+ * when USE_FAULT is 1 and enabled at runtime with fault_enable().
+ */
+
+#ifndef _FAULT_H
+#define _FAULT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef USE_FAULT
+#define USE_FAULT 1
+#endif
+
+#define FAULT_ADD_LINK    0   // Between the exchange and link in add
+#define FAULT_RMV_STALL   1   // Each time around rmv's stall loop
+#define FAULT_RET_MSG     2   // In ret_msg before adding to the pool
+#define FAULT_POINT_COUNT 3
+
+#define FAULT_YIELD 0         // sched_yield
+#define FAULT_SPIN  1         // Spin for delay_ns
+#define FAULT_SLEEP 2         // Sleep for delay_ns
+#define FAULT_KIND_COUNT 3
+
+extern _Atomic(uint32_t) gFaultEnabled;
+
+/**
+ * Inject kind at point in rate_ppm of the passes, per million,
+ * delay_ns is ignored for FAULT_YIELD.
+ *
+ * @return true if point or kind is unknown.
+ */
+bool fault_set(uint32_t point, uint32_t rate_ppm, uint32_t kind, uint64_t delay_ns);
+
+/**
+ * Set a point from spec, "point:rate_ppm:kind[:delay_ns]" with the
+ * point and kind named as by fault_point_name and fault_kind_name,
+ * i.e. "add_link:1000:sleep:50000".
+ *
+ * @return true if spec is invalid.
+ */
+bool fault_parse(const char* spec);
+
+/**
+ * Enable or disable injecting at the points which are set.
+ */
+void fault_enable(bool enable);
+
+/**
+ * Return the name of point
+ */
+const char* fault_point_name(uint32_t point);
+
+/**
+ * Return the name of kind
+ */
+const char* fault_kind_name(uint32_t kind);
+
+/**
+ * Return the number of faults injected at point.
+ */
+uint64_t fault_injected(uint32_t point);
+
+/**
+ * Maybe inject a fault at point, use FAULT.
+ */
+void fault_inject(uint32_t point);
+
+#if USE_FAULT
+#define FAULT(point) do { \
+  if (__builtin_expect(__atomic_load_n(&gFaultEnabled, __ATOMIC_RELAXED), 0)) { \
+    fault_inject(point); \
+  } \
+} while (0)
+#else
+#define FAULT(point) ((void)(0))
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
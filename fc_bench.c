@@ -0,0 +1,200 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Find the producer count at which flat combining, see combine.h,
+ * beats plain add into one consumer's fifo.
+ *
+ * For 1, 2, 4 .. producer_max producers and each of plain, combine
+ * and adaptive every producer sends msg_count msgs, at most window
+ * outstanding, and the consumer checks each producer's are in order.
+ * The crossover is the first producer count where combining took
+ * less time per msg than plain add.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "combine.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POLICY_COUNT 3
+static const char* policy_names[POLICY_COUNT] = { "plain", "combine", "adaptive" };
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Producer {
+  pthread_t thread;
+  CombFifo_t* cf;
+  MsgPool_t pool;
+  uint32_t idx;
+  uint64_t msg_count;
+} Producer;
+
+static void* producer(void* p) {
+  Producer* prod = (Producer*)p;
+
+  for (uint64_t i = 0; i < prod->msg_count; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&prod->pool)) == NULL) {
+      sched_yield();
+    }
+    msg->arg1 = prod->idx;
+    msg->arg2 = i + 1;
+    CombFifo_add(prod->cf, msg);
+  }
+  return NULL;
+}
+
+/**
+ * Run producer_count producers with policy, returning the ns per msg
+ * in *pNsPerMsg
+ */
+bool run(uint32_t policy, uint32_t producer_count, uint64_t msg_count, uint32_t window,
+    uint64_t contended_ns, double* pNsPerMsg) {
+  bool error = false;
+  MsgPool_t stubs;
+  CombFifo_t* cf;
+
+  Producer* producers = calloc(producer_count, sizeof(Producer));
+  uint64_t* last_seq = calloc(producer_count, sizeof(uint64_t));
+  if ((producers == NULL) || (last_seq == NULL)
+      || (posix_memalign((void**)&cf, 64, sizeof(CombFifo_t)) != 0)) {
+    printf(LDR "run: ERROR unable to allocate\n", ldr());
+    return true;
+  }
+  if (MsgPool_init(&stubs, 1)) {
+    printf(LDR "run: ERROR unable to create stubs pool\n", ldr());
+    return true;
+  }
+  CombFifo_init(cf, MsgPool_get_msg(&stubs), policy, contended_ns);
+
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < producer_count; i++) {
+    Producer* prod = &producers[i];
+    // One more as the last msg received is left as the fifo's stub
+    if (MsgPool_init(&prod->pool, window + 1)) {
+      printf(LDR "run: ERROR unable to create producer pool\n", ldr());
+      return true;
+    }
+    prod->cf = cf;
+    prod->idx = i;
+    prod->msg_count = msg_count;
+    pthread_create(&prod->thread, NULL, producer, prod);
+  }
+
+  uint64_t expected = msg_count * producer_count;
+  uint64_t received = 0;
+  uint64_t out_of_order = 0;
+  while (received < expected) {
+    Msg_t* msg = rmv(&cf->fifo);
+    if (msg == NULL) {
+      sched_yield();
+      continue;
+    }
+    if (msg->arg2 != last_seq[msg->arg1] + 1) {
+      out_of_order += 1;
+    }
+    last_seq[msg->arg1] = msg->arg2;
+    received += 1;
+    ret_msg(msg);
+  }
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+  }
+  uint64_t time_stop = ticks_serialized();
+
+  CombStats_t stats;
+  CombFifo_get_stats(cf, &stats);
+  CombFifo_deinit(cf);
+  for (uint32_t i = 0; i < producer_count; i++) {
+    MsgPool_deinit(&producers[i].pool);
+  }
+  MsgPool_deinit(&stubs);
+
+  if (out_of_order != 0) {
+    printf(LDR "run: ERROR %s out_of_order=%lu\n", ldr(), policy_names[policy], out_of_order);
+    error = true;
+  }
+
+  *pNsPerMsg = diff_ticks_ns(time_stop, time_start) / (double)received;
+  printf("%-8s producers=%-3u ns_per_msg=%.2f avg_batch=%.2f to_combine=%lu to_plain=%lu\n",
+      policy_names[policy], producer_count, *pNsPerMsg,
+      stats.passes != 0 ? (double)stats.combined / (double)stats.passes : 0.0,
+      stats.to_combine, stats.to_plain);
+
+  free(cf);
+  free(last_seq);
+  free(producers);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 5) {
+    printf("Usage:\n");
+    printf(" %s producer_max msg_count window contended_ns\n", argv[0]);
+    printf("  compares plain, combine and adaptive for 1, 2, 4 .. producer_max producers,\n");
+    printf("  each sends msg_count msgs with at most window outstanding and adaptive\n");
+    printf("  combines when the timed adds average contended_ns\n");
+    return 1;
+  }
+
+  u_int32_t producer_max;
+  sscanf(argv[1], "%u", &producer_max);
+  u_int64_t msg_count;
+  sscanf(argv[2], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[3], "%u", &window);
+  u_int64_t contended_ns;
+  sscanf(argv[4], "%lu", &contended_ns);
+  printf("fc_bench producer_max=%u msg_count=%lu window=%u contended_ns=%lu\n",
+      producer_max, msg_count, window, contended_ns);
+
+  if ((producer_max == 0) || (producer_max > COMB_MAX_THREADS) || (msg_count == 0)
+      || (window == 0)) {
+    printf("producer_max must be 1 .. %u, msg_count and window > 0\n", COMB_MAX_THREADS);
+    return 1;
+  }
+
+  error |= timing_init();
+  uint32_t crossover = 0;
+  for (uint32_t n = 1; n <= producer_max; n = n < producer_max && n * 2 > producer_max
+      ? producer_max : n * 2) {
+    double ns_per_msg[POLICY_COUNT];
+    for (uint32_t policy = 0; policy < POLICY_COUNT; policy++) {
+      error |= run(policy, n, msg_count, window, contended_ns, &ns_per_msg[policy]);
+    }
+    if ((crossover == 0) && (ns_per_msg[COMB_COMBINE] < ns_per_msg[COMB_PLAIN])) {
+      crossover = n;
+    }
+    if (n == producer_max) {
+      break;
+    }
+  }
+  if (crossover != 0) {
+    printf("crossover producers=%u\n", crossover);
+  } else {
+    printf("crossover none up to producers=%u\n", producer_max);
+  }
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
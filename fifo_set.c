@@ -0,0 +1,203 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "fifo_set.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Set the ready bit for idx, post the consumer if we set it and
+ * it's waiting.
+ */
+static inline void mark_ready(FifoSet_t* set, uint32_t idx) {
+  ATOMIC(uint64_t)* pWord = &set->ready[idx / 64];
+  uint64_t bit = 1ull << (idx % 64);
+
+  // The fence orders the add before the load of the ready word so
+  // either we see the consumer cleared the bit or it sees our msg
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if ((__atomic_load_n(pWord, __ATOMIC_RELAXED) & bit) != 0) {
+    return;
+  }
+  uint64_t prev = __atomic_fetch_or(pWord, bit, __ATOMIC_SEQ_CST);
+  if (((prev & bit) == 0) && set->wakeup
+      && (__atomic_load_n(&set->waiting, __ATOMIC_SEQ_CST) != 0)) {
+    sem_post(&set->sem);
+  }
+}
+
+/**
+ * Find and clear the next ready bit at or after set->next.
+ *
+ * @return index of the fifo or FIFO_SET_NONE
+ */
+static uint32_t take_ready(FifoSet_t* set) {
+  uint32_t word_idx = set->next / 64;
+  uint64_t mask = ~0ull << (set->next % 64);
+
+  // One extra iteration to wrap around to the bits below next
+  for (uint32_t i = 0; i <= set->word_count; i++) {
+    uint64_t word = __atomic_load_n(&set->ready[word_idx], __ATOMIC_RELAXED) & mask;
+    while (word != 0) {
+      uint32_t bit_idx = (uint32_t)__builtin_ctzll(word);
+      uint64_t bit = 1ull << bit_idx;
+      uint64_t prev = __atomic_fetch_and(&set->ready[word_idx], ~bit, __ATOMIC_SEQ_CST);
+      if ((prev & bit) != 0) {
+        return (word_idx * 64) + bit_idx;
+      }
+      word &= ~bit;
+    }
+    mask = ~0ull;
+    word_idx += 1;
+    if (word_idx >= set->word_count) {
+      word_idx = 0;
+    }
+  }
+  return FIFO_SET_NONE;
+}
+
+/**
+ * @see fifo_set.h
+ */
+bool FifoSet_init(FifoSet_t* set, uint32_t fifo_count, uint32_t batch, bool wakeup) {
+  bool error = false;
+
+  DPF(LDR "FifoSet_init:+set=%p fifo_count=%u batch=%u wakeup=%u\n",
+      ldr(), set, fifo_count, batch, wakeup);
+
+  set->fifo_count = fifo_count;
+  set->word_count = (fifo_count + 63) / 64;
+  set->batch = batch != 0 ? batch : 1;
+  set->next = 0;
+  set->cur = FIFO_SET_NONE;
+  set->budget = 0;
+  set->visits = 0;
+  set->empty_visits = 0;
+  set->wakeup = wakeup;
+  set->waiting = 0;
+  set->ready = NULL;
+  set->fifos = calloc(fifo_count, sizeof(MpscFifo_t*));
+  if ((set->fifos == NULL) || (set->word_count == 0)
+      || (posix_memalign((void**)&set->ready, 64, sizeof(uint64_t) * set->word_count) != 0)) {
+    printf(LDR "FifoSet_init: ERROR set=%p unable to allocate fifo_count=%u\n",
+        ldr(), set, fifo_count);
+    free(set->fifos);
+    set->fifos = NULL;
+    set->ready = NULL;
+    error = true;
+    goto done;
+  }
+  memset((void*)set->ready, 0, sizeof(uint64_t) * set->word_count);
+  if (wakeup) {
+    sem_init(&set->sem, 0, 0);
+  }
+
+done:
+  DPF(LDR "FifoSet_init:-set=%p error=%u\n", ldr(), set, error);
+  return error;
+}
+
+/**
+ * @see fifo_set.h
+ */
+void FifoSet_deinit(FifoSet_t* set) {
+  if (set->wakeup) {
+    sem_destroy(&set->sem);
+  }
+  free(set->fifos);
+  free((void*)set->ready);
+  set->fifos = NULL;
+  set->ready = NULL;
+  set->fifo_count = 0;
+  set->word_count = 0;
+}
+
+/**
+ * @see fifo_set.h
+ */
+void FifoSet_set_fifo(FifoSet_t* set, uint32_t idx, MpscFifo_t* pQ) {
+  set->fifos[idx] = pQ;
+}
+
+/**
+ * @see fifo_set.h
+ */
+void FifoSet_add(FifoSet_t* set, uint32_t idx, Msg_t* pMsg) {
+  add(set->fifos[idx], pMsg);
+  mark_ready(set, idx);
+}
+
+/**
+ * @see fifo_set.h
+ */
+Msg_t* FifoSet_rmv(FifoSet_t* set, uint32_t* pIdx) {
+  while (true) {
+    if (set->cur != FIFO_SET_NONE) {
+      MpscFifo_t* pQ = set->fifos[set->cur];
+      if (set->budget > 0) {
+        Msg_t* msg = rmv_non_stalling(pQ);
+        if (msg != NULL) {
+          set->budget -= 1;
+          *pIdx = set->cur;
+          return msg;
+        }
+      }
+
+      // Visit is over, if the budget ran out or a producer is at
+      // the critical spot the fifo isn't empty so mark it again
+      if (pQ->pTail != MPSC_LOAD(&pQ->pHead, __ATOMIC_SEQ_CST)) {
+        mark_ready(set, set->cur);
+        set->cur = FIFO_SET_NONE;
+        if (set->budget == set->batch) {
+          // Nothing removed, the producer was preempted, don't spin
+          // taking the fifo straight back
+          return NULL;
+        }
+        continue;
+      } else if (set->budget == set->batch) {
+        set->empty_visits += 1;
+      }
+      set->cur = FIFO_SET_NONE;
+    }
+
+    uint32_t idx = take_ready(set);
+    if (idx == FIFO_SET_NONE) {
+      return NULL;
+    }
+    set->cur = idx;
+    set->budget = set->batch;
+    set->next = (idx + 1) < set->fifo_count ? idx + 1 : 0;
+    set->visits += 1;
+  }
+}
+
+/**
+ * @see fifo_set.h
+ */
+void FifoSet_wait(FifoSet_t* set) {
+  __atomic_store_n(&set->waiting, 1, __ATOMIC_SEQ_CST);
+  for (uint32_t i = 0; i < set->word_count; i++) {
+    if (__atomic_load_n(&set->ready[i], __ATOMIC_SEQ_CST) != 0) {
+      __atomic_store_n(&set->waiting, 0, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  sem_wait(&set->sem);
+  __atomic_store_n(&set->waiting, 0, __ATOMIC_RELAXED);
+}
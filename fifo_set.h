@@ -0,0 +1,92 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A FifoSet_t lets one consumer service many MpscFifo_t's without
+ * polling each of them. Producers add with FifoSet_add which marks
+ * the fifo in a ready bitmap when it wasn't already marked, the
+ * consumer visits only the marked fifos in round robin order taking
+ * at most batch msgs per visit.
+ *
+ * If the set is created with wakeup the consumer may block in
+ * FifoSet_wait and the producer which marks a fifo posts it.
+ */
+
+#ifndef _FIFO_SET_H
+#define _FIFO_SET_H
+
+#include "mpscfifo.h"
+
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FIFO_SET_NONE UINT32_MAX
+
+typedef struct FifoSet_t {
+  ATOMIC(uint64_t)* ready;  // Bit per fifo, word_count words
+  MpscFifo_t** fifos;
+  uint32_t fifo_count;
+  uint32_t word_count;
+  uint32_t batch;
+
+  // Only used by the consumer
+  uint32_t next;            // Round robin position
+  uint32_t cur;             // Fifo being visited or FIFO_SET_NONE
+  uint32_t budget;          // Msgs remaining for this visit
+  uint64_t visits;
+  uint64_t empty_visits;
+
+  bool wakeup;
+  ATOMIC(uint32_t) waiting;
+  sem_t sem;
+} FifoSet_t;
+
+/**
+ * Initialize a set of fifo_count fifos, each visit removes at most
+ * batch msgs. If wakeup the consumer may use FifoSet_wait.
+ *
+ * @return true if an error.
+ */
+bool FifoSet_init(FifoSet_t* set, uint32_t fifo_count, uint32_t batch, bool wakeup);
+
+/**
+ * Free the set, the fifos are not deinitialized.
+ */
+void FifoSet_deinit(FifoSet_t* set);
+
+/**
+ * Make pQ fifo idx of the set, must be done before any FifoSet_add
+ * or FifoSet_rmv.
+ */
+void FifoSet_set_fifo(FifoSet_t* set, uint32_t idx, MpscFifo_t* pQ);
+
+/**
+ * Add pMsg to fifo idx and mark it ready, any thread.
+ */
+void FifoSet_add(FifoSet_t* set, uint32_t idx, Msg_t* pMsg);
+
+/**
+ * Remove the next msg from the ready fifos, only the consumer.
+ * *pIdx is set to the index of the fifo it came from.
+ *
+ * @return NULL if no fifo is ready, or the one visited held no msg
+ * as its producer was preempted at the critical spot, it's left
+ * ready so call again later.
+ */
+Msg_t* FifoSet_rmv(FifoSet_t* set, uint32_t* pIdx);
+
+/**
+ * Block until a fifo may be ready, only the consumer and only
+ * if the set was initialized with wakeup. May return spuriously.
+ */
+void FifoSet_wait(FifoSet_t* set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
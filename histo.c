@@ -0,0 +1,88 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "histo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Return the largest value in bucket
+ */
+static uint64_t bucket_max(uint32_t bucket) {
+  if (bucket < HISTO_SUB_COUNT) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> HISTO_SUB_BITS) - 1;
+  uint64_t sub = bucket & (HISTO_SUB_COUNT - 1);
+  uint64_t base = (HISTO_SUB_COUNT | sub) << shift;
+  return base + ((1ull << shift) - 1);
+}
+
+/**
+ * @see histo.h
+ */
+void Histo_clear(Histo_t* h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+/**
+ * @see histo.h
+ */
+void Histo_merge(Histo_t* dst, const Histo_t* src) {
+  for (uint32_t i = 0; i < HISTO_BUCKET_COUNT; i++) {
+    dst->buckets[i] += src->buckets[i];
+  }
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min) {
+    dst->min = src->min;
+  }
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+/**
+ * @see histo.h
+ */
+uint64_t Histo_percentile(const Histo_t* h, double percentile) {
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t target = (uint64_t)(((double)h->count * percentile) / 100.0);
+  if (target >= h->count) {
+    target = h->count - 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTO_BUCKET_COUNT; i++) {
+    seen += h->buckets[i];
+    if (seen > target) {
+      uint64_t value = bucket_max(i);
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
+
+/**
+ * @see histo.h
+ */
+void Histo_print(const Histo_t* h, const char* name, double scale) {
+  printf("%s: count=%lu mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+      name, h->count,
+      h->count != 0 ? (h->sum / (double)h->count) * scale : 0.0,
+      (double)Histo_percentile(h, 50.0) * scale,
+      (double)Histo_percentile(h, 90.0) * scale,
+      (double)Histo_percentile(h, 99.0) * scale,
+      (double)Histo_percentile(h, 99.9) * scale,
+      (double)h->max * scale);
+}
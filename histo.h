@@ -0,0 +1,87 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Log linear latency histogram. Values below HISTO_SUB_COUNT are
+ * exact, above that each power of two is split into HISTO_SUB_COUNT
+ * buckets so the error is at most 1/HISTO_SUB_COUNT. Recording is
+ * a few instructions and each thread keeps its own Histo_t which
+ * are merged for reporting.
+ */
+
+#ifndef _HISTO_H
+#define _HISTO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HISTO_SUB_BITS 4
+#define HISTO_SUB_COUNT (1 << HISTO_SUB_BITS)
+#define HISTO_BUCKET_COUNT ((64 - HISTO_SUB_BITS + 1) * HISTO_SUB_COUNT)
+
+typedef struct Histo_t {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+  uint64_t buckets[HISTO_BUCKET_COUNT];
+} Histo_t;
+
+/**
+ * Clear the histogram
+ */
+void Histo_clear(Histo_t* h);
+
+/**
+ * Return the bucket for value
+ */
+static inline uint32_t Histo_bucket(uint64_t value) {
+  if (value < HISTO_SUB_COUNT) {
+    return (uint32_t)value;
+  }
+  uint32_t msb = 63 - (uint32_t)__builtin_clzll(value);
+  uint32_t shift = msb - HISTO_SUB_BITS;
+  uint32_t sub = (uint32_t)(value >> shift) & (HISTO_SUB_COUNT - 1);
+  return ((shift + 1) << HISTO_SUB_BITS) + sub;
+}
+
+/**
+ * Record a value
+ */
+static inline void Histo_record(Histo_t* h, uint64_t value) {
+  h->buckets[Histo_bucket(value)] += 1;
+  h->count += 1;
+  h->sum += (double)value;
+  if (value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+/**
+ * Add src to dst
+ */
+void Histo_merge(Histo_t* dst, const Histo_t* src);
+
+/**
+ * Return the value at percentile, 0.0 .. 100.0, the upper bound of
+ * the bucket it's in but never more than max.
+ */
+uint64_t Histo_percentile(const Histo_t* h, double percentile);
+
+/**
+ * Print count, mean, p50, p90, p99, p99.9 and max with the values
+ * multiplied by scale, i.e. gTiming.ns_per_tick if they're ticks.
+ */
+void Histo_print(const Histo_t* h, const char* name, double scale);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,212 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Measure the MPSCFIFO_LAYOUT this is compiled with, see mpscfifo.h,
+ * for three kinds of traffic:
+ *
+ *  1:1         one producer sends msg_count msgs to one consumer
+ *  N:1         thread_count producers each send msg_count msgs to one consumer
+ *  all-to-all  thread_count threads each send msg_count msgs round
+ *              robin to the others and consume their own fifo
+ *
+ * Each sender has at most window msgs outstanding, the ns per msg is
+ * the elapsed time divided by the msgs received. Build one binary
+ * per layout with `make layouts`.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Peer {
+  MpscFifo_t fifo;
+  pthread_t thread;
+  MsgPool_t stubs;          // Only for the stub
+  MsgPool_t pool;
+  uint32_t idx;
+  MpscFifo_t** targets;
+  uint32_t target_count;
+  uint64_t send_count;
+  uint64_t expected;        // Msgs this peer will receive
+  uint64_t received;
+  uint64_t out_of_order;
+  uint64_t* last_seq;       // Per sender, to check the order
+} Peer;
+
+static void* peer(void* p) {
+  Peer* pr = (Peer*)p;
+  uint64_t sent = 0;
+
+  while ((sent < pr->send_count) || (pr->received < pr->expected)) {
+    bool idle = true;
+    if (sent < pr->send_count) {
+      Msg_t* msg = MsgPool_get_msg(&pr->pool);
+      if (msg != NULL) {
+        msg->arg1 = pr->idx;
+        msg->arg2 = sent + 1;
+        add(pr->targets[sent % pr->target_count], msg);
+        sent += 1;
+        idle = false;
+      }
+    }
+    Msg_t* msg;
+    while ((msg = rmv(&pr->fifo)) != NULL) {
+      if (msg->arg2 <= pr->last_seq[msg->arg1]) {
+        pr->out_of_order += 1;
+      }
+      pr->last_seq[msg->arg1] = msg->arg2;
+      pr->received += 1;
+      ret_msg(msg);
+      idle = false;
+    }
+    if (idle) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Run one kind of traffic, peer 0 is the consumer for 1:1 and N:1
+ */
+bool run(const char* name, uint32_t peer_count, bool all_to_all,
+    uint64_t msg_count, uint32_t window) {
+  bool error = false;
+
+  Peer* peers;
+  if (posix_memalign((void**)&peers, 64, peer_count * sizeof(Peer)) != 0) {
+    printf(LDR "run: ERROR unable to allocate\n", ldr());
+    return true;
+  }
+  memset(peers, 0, peer_count * sizeof(Peer));
+
+  for (uint32_t i = 0; i < peer_count; i++) {
+    Peer* pr = &peers[i];
+    pr->idx = i;
+    pr->last_seq = calloc(peer_count, sizeof(uint64_t));
+    pr->targets = calloc(peer_count, sizeof(MpscFifo_t*));
+    if ((pr->last_seq == NULL) || (pr->targets == NULL)) {
+      printf(LDR "run: ERROR unable to allocate\n", ldr());
+      return true;
+    }
+    // A msg may be left as the stub of each target so the pool
+    // has one more per target than the window
+    uint32_t target_count = all_to_all ? peer_count - 1 : 1;
+    if (MsgPool_init(&pr->stubs, 1) || MsgPool_init(&pr->pool, window + target_count)) {
+      printf(LDR "run: ERROR unable to create pools\n", ldr());
+      return true;
+    }
+    initMpscFifo(&pr->fifo, MsgPool_get_msg(&pr->stubs));
+  }
+
+  for (uint32_t i = 0; i < peer_count; i++) {
+    Peer* pr = &peers[i];
+    if (all_to_all) {
+      pr->target_count = peer_count - 1;
+      for (uint32_t j = 0; j < pr->target_count; j++) {
+        Peer* dst = &peers[(i + 1 + j) % peer_count];
+        pr->targets[j] = &dst->fifo;
+        dst->expected += (msg_count / pr->target_count)
+          + (j < (msg_count % pr->target_count) ? 1 : 0);
+      }
+      pr->send_count = msg_count;
+    } else if (i != 0) {
+      pr->target_count = 1;
+      pr->targets[0] = &peers[0].fifo;
+      pr->send_count = msg_count;
+      peers[0].expected += msg_count;
+    }
+  }
+
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < peer_count; i++) {
+    pthread_create(&peers[i].thread, NULL, peer, &peers[i]);
+  }
+  uint64_t received = 0;
+  uint64_t out_of_order = 0;
+  for (uint32_t i = 0; i < peer_count; i++) {
+    pthread_join(peers[i].thread, NULL);
+    received += peers[i].received;
+    out_of_order += peers[i].out_of_order;
+  }
+  uint64_t time_stop = ticks_serialized();
+
+  // The fifos first as their stubs may belong to any pool
+  for (uint32_t i = 0; i < peer_count; i++) {
+    deinitMpscFifo(&peers[i].fifo, NULL);
+  }
+  for (uint32_t i = 0; i < peer_count; i++) {
+    MsgPool_deinit(&peers[i].pool);
+    MsgPool_deinit(&peers[i].stubs);
+    free(peers[i].last_seq);
+    free(peers[i].targets);
+  }
+
+  uint64_t expected = msg_count * (all_to_all ? peer_count : peer_count - 1);
+  if ((received != expected) || (out_of_order != 0)) {
+    printf(LDR "run: ERROR %s received=%lu expected=%lu out_of_order=%lu\n",
+        ldr(), name, received, expected, out_of_order);
+    error = true;
+  }
+
+  printf("%-7s %-10s threads=%-3u ns_per_msg=%.2f\n", MPSCFIFO_LAYOUT_NAME, name,
+      peer_count, received != 0 ? diff_ticks_ns(time_stop, time_start) / received : 0.0);
+
+  free(peers);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 4) {
+    printf("Usage:\n");
+    printf(" %s thread_count msg_count window\n", argv[0]);
+    printf("  times 1:1, thread_count:1 and all-to-all traffic between thread_count\n");
+    printf("  threads, each sending msg_count msgs with at most window outstanding\n");
+    return 1;
+  }
+
+  u_int32_t thread_count;
+  sscanf(argv[1], "%u", &thread_count);
+  u_int64_t msg_count;
+  sscanf(argv[2], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[3], "%u", &window);
+  printf("layout_bench layout=%s sizeof(Msg_t)=%lu sizeof(MpscFifo_t)=%lu "
+      "thread_count=%u msg_count=%lu window=%u\n", MPSCFIFO_LAYOUT_NAME,
+      sizeof(Msg_t), sizeof(MpscFifo_t), thread_count, msg_count, window);
+
+  if ((thread_count < 2) || (msg_count == 0) || (window == 0)) {
+    printf("thread_count must be >= 2, msg_count and window > 0\n");
+    return 1;
+  }
+
+  error |= timing_init();
+  error |= run("1:1", 2, false, msg_count, window);
+  error |= run("N:1", thread_count + 1, false, msg_count, window);
+  error |= run("all-to-all", thread_count, true, msg_count, window);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Litmus style stress test of the MPSCFIFO_ORDERING in use.
+ *
+ * Each producer sends msgs from its own pool with arg1 its index
+ * and arg2 a sequence number. The consumer checks that every
+ * producer's messages arrive exactly once and in order, if an
+ * ordering is too weak the consumer sees a stale arg1/arg2 left
+ * in a reused msg, a lost link or a corrupted list.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define POOL_MSG_COUNT 1000
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Producer {
+  pthread_t thread;
+  uint32_t idx;
+  uint64_t msg_count;
+  MpscFifo_t* pQ;
+  uint64_t no_msgs;
+} Producer;
+
+static void* producer(void* p) {
+  Producer* prod = (Producer*)p;
+  MsgPool_t pool;
+
+  if (MsgPool_init(&pool, POOL_MSG_COUNT)) {
+    printf(LDR "producer: ERROR idx=%u unable to create pool\n", ldr(), prod->idx);
+    return NULL;
+  }
+
+  for (uint64_t seq = 0; seq < prod->msg_count; seq++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&pool)) == NULL) {
+      prod->no_msgs += 1;
+      sched_yield();
+    }
+    msg->arg1 = prod->idx;
+    msg->arg2 = seq;
+    add(prod->pQ, msg);
+  }
+
+  // Waits for the consumer to return all of the msgs
+  MsgPool_deinit(&pool);
+  return NULL;
+}
+
+bool litmus(const uint32_t producer_count, const uint64_t msg_count) {
+  bool error = false;
+  MpscFifo_t fifo;
+  MsgPool_t pool;
+  Producer* producers = NULL;
+  uint64_t* next_seq = NULL;
+  uint32_t producers_created = 0;
+  uint64_t received = 0;
+  uint64_t stalled_rmvs = 0;
+
+  printf(LDR "litmus:+ordering=%s producer_count=%u msg_count=%lu\n",
+      ldr(), MPSCFIFO_ORDERING_NAME, producer_count, msg_count);
+
+  if (MsgPool_init(&pool, 1)) {
+    printf(LDR "litmus: ERROR unable to create pool\n", ldr());
+    return true;
+  }
+  initMpscFifo(&fifo, MsgPool_get_msg(&pool));
+
+  producers = calloc(producer_count, sizeof(Producer));
+  next_seq = calloc(producer_count, sizeof(uint64_t));
+  if ((producers == NULL) || (next_seq == NULL)) {
+    printf(LDR "litmus: ERROR unable to allocate producers\n", ldr());
+    error = true;
+    goto done;
+  }
+
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < producer_count; i++, producers_created++) {
+    Producer* prod = &producers[i];
+    prod->idx = i;
+    prod->msg_count = msg_count;
+    prod->pQ = &fifo;
+    if (pthread_create(&prod->thread, NULL, producer, prod) != 0) {
+      printf(LDR "litmus: ERROR unable to create producer %u\n", ldr(), i);
+      error = true;
+      goto done;
+    }
+  }
+
+  // Alternate rmv and rmv_non_stalling so both are checked
+  uint64_t expected = msg_count * producer_count;
+  while (received < expected) {
+    Msg_t* msg = (received & 1) ? rmv_non_stalling(&fifo) : rmv(&fifo);
+    if (msg == NULL) {
+      if ((received & 1) && (fifo.pTail != MPSC_LOAD(&fifo.pHead, __ATOMIC_ACQUIRE))) {
+        // Not empty, a producer was preempted at the critical spot
+        stalled_rmvs += 1;
+      }
+      sched_yield();
+      continue;
+    }
+    if (msg->arg1 >= producer_count) {
+      printf(LDR "litmus: ERROR msg=%p arg1=%lu isn't a producer\n", ldr(), msg, msg->arg1);
+      error = true;
+      ret_msg(msg);
+      break;
+    }
+    if (msg->arg2 != next_seq[msg->arg1]) {
+      printf(LDR "litmus: ERROR producer=%lu arg2=%lu expected seq=%lu\n",
+          ldr(), msg->arg1, msg->arg2, next_seq[msg->arg1]);
+      error = true;
+      ret_msg(msg);
+      break;
+    }
+    next_seq[msg->arg1] += 1;
+    received += 1;
+    ret_msg(msg);
+  }
+  uint64_t time_stop = ticks_serialized();
+
+  double processing_ns = diff_ticks_ns(time_stop, time_start);
+  printf(LDR "litmus: received=%lu stalled_rmvs=%lu\n", ldr(), received, stalled_rmvs);
+  printf(LDR "litmus: ns_per_msg=%.1fns\n", ldr(), processing_ns / (double)received);
+
+  // The stub now belongs to one of the producers pools so return
+  // it before joining as the producers wait for all their msgs
+  deinitMpscFifo(&fifo, NULL);
+
+done:
+  for (uint32_t i = 0; i < producers_created; i++) {
+    if (error) {
+      // Producers may be blocked in MsgPool_deinit
+      pthread_detach(producers[i].thread);
+    } else {
+      pthread_join(producers[i].thread, NULL);
+    }
+  }
+  if (!error) {
+    MsgPool_deinit(&pool);
+    free(producers);
+    free(next_seq);
+  }
+
+  printf(LDR "litmus:-error=%u\n\n", ldr(), error);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 3) {
+    printf("Usage:\n");
+    printf(" %s producer_count msg_count\n", argv[0]);
+    return 1;
+  }
+
+  u_int32_t producer_count;
+  sscanf(argv[1], "%u", &producer_count);
+  u_int64_t msg_count;
+  sscanf(argv[2], "%lu", &msg_count);
+
+  error |= timing_init();
+  error |= litmus(producer_count, msg_count);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Compare consumer_count consumers sharing one fifo with rmv_mc
+ * against each consumer having its own fifo with the producers
+ * picking one at random.
+ *
+ * Each producer sends msg_count msgs, at most window outstanding,
+ * with arg1 a sequence number and arg2 the tick it was sent. The
+ * consumers spin work_ns per msg and record the latency, the sum of
+ * the sequence numbers received checks no msg was lost or repeated.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "dispatch.h"
+#include "histo.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MODE_MPMC 0
+#define MODE_MPSC 1
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Consumer {
+  pthread_t thread;
+  MpscFifo_t* pQ;
+  bool mc;
+  uint64_t work_ns;
+  _Atomic(uint32_t) stop;
+  uint64_t received;
+  uint64_t seq_sum;
+  Histo_t histo;
+} Consumer;
+
+typedef struct Producer {
+  pthread_t thread;
+  MsgPool_t pool;
+  uint32_t idx;
+  uint64_t msg_count;
+  MpscFifo_t* fifos;
+  uint32_t fifo_count;
+  uint64_t no_msgs;
+} Producer;
+
+static void* consumer(void* p) {
+  Consumer* c = (Consumer*)p;
+
+  while (true) {
+    Msg_t* msg = c->mc ? rmv_mc(c->pQ) : rmv(c->pQ);
+    if (msg == NULL) {
+      if (__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE) != 0) {
+        // Check again as the msgs may have been added before stop
+        if ((msg = c->mc ? rmv_mc(c->pQ) : rmv(c->pQ)) == NULL) {
+          break;
+        }
+      } else {
+        sched_yield();
+        continue;
+      }
+    }
+    Histo_record(&c->histo, ticks() - msg->arg2);
+    c->received += 1;
+    c->seq_sum += msg->arg1;
+    spin_ns(c->work_ns);
+    ret_msg(msg);
+  }
+  return NULL;
+}
+
+static void* producer(void* p) {
+  Producer* prod = (Producer*)p;
+  Dispatch_t d;
+
+  Dispatch_init(&d, prod->idx + 1);
+  for (uint64_t i = 0; i < prod->msg_count; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&prod->pool)) == NULL) {
+      prod->no_msgs += 1;
+      sched_yield();
+    }
+    uint32_t idx = prod->fifo_count > 1 ? Dispatch_pick_random(&d, prod->fifo_count) : 0;
+    msg->arg1 = i;
+    msg->arg2 = ticks();
+    add(&prod->fifos[idx], msg);
+  }
+  return NULL;
+}
+
+bool run(uint32_t mode, uint32_t consumer_count, uint32_t producer_count,
+    uint64_t msg_count, uint32_t window, uint64_t work_ns) {
+  bool error = false;
+  const char* mode_name = mode == MODE_MPMC ? "mpmc" : "mpsc";
+  uint32_t fifo_count = mode == MODE_MPMC ? 1 : consumer_count;
+
+  Consumer* consumers = calloc(consumer_count, sizeof(Consumer));
+  Producer* producers = calloc(producer_count, sizeof(Producer));
+  MpscFifo_t* fifos = calloc(fifo_count, sizeof(MpscFifo_t));
+  MsgPool_t stubs;
+  if ((consumers == NULL) || (producers == NULL) || (fifos == NULL)
+      || MsgPool_init(&stubs, fifo_count)) {
+    printf(LDR "run: ERROR unable to allocate\n", ldr());
+    return true;
+  }
+
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    initMpscFifo(&fifos[i], MsgPool_get_msg(&stubs));
+  }
+  for (uint32_t i = 0; i < consumer_count; i++) {
+    Consumer* c = &consumers[i];
+    c->mc = mode == MODE_MPMC;
+    c->pQ = &fifos[c->mc ? 0 : i];
+    c->work_ns = work_ns;
+    Histo_clear(&c->histo);
+    pthread_create(&c->thread, NULL, consumer, c);
+  }
+
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < producer_count; i++) {
+    Producer* prod = &producers[i];
+    if (MsgPool_init(&prod->pool, window)) {
+      printf(LDR "run: ERROR unable to create producer pool\n", ldr());
+      return true;
+    }
+    prod->idx = i;
+    prod->msg_count = msg_count;
+    prod->fifos = fifos;
+    prod->fifo_count = fifo_count;
+    pthread_create(&prod->thread, NULL, producer, prod);
+  }
+
+  // Producers are done sending, then the consumers are stopped and
+  // the fifos deinitialized as their stubs may belong to a producer pool
+  uint64_t no_msgs = 0;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+    no_msgs += producers[i].no_msgs;
+  }
+  for (uint32_t i = 0; i < consumer_count; i++) {
+    __atomic_store_n(&consumers[i].stop, 1, __ATOMIC_RELEASE);
+  }
+  Histo_t histo;
+  Histo_clear(&histo);
+  uint64_t received = 0;
+  uint64_t seq_sum = 0;
+  for (uint32_t i = 0; i < consumer_count; i++) {
+    pthread_join(consumers[i].thread, NULL);
+    Histo_merge(&histo, &consumers[i].histo);
+    received += consumers[i].received;
+    seq_sum += consumers[i].seq_sum;
+  }
+  uint64_t time_stop = ticks_serialized();
+
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    deinitMpscFifo(&fifos[i], NULL);
+  }
+  for (uint32_t i = 0; i < producer_count; i++) {
+    MsgPool_deinit(&producers[i].pool);
+  }
+  MsgPool_deinit(&stubs);
+
+  uint64_t expected = msg_count * producer_count;
+  uint64_t expected_sum = ((msg_count * (msg_count - 1)) / 2) * producer_count;
+  if ((received != expected) || (seq_sum != expected_sum)) {
+    printf(LDR "run: ERROR %s received=%lu expected=%lu seq_sum=%lu expected_sum=%lu\n",
+        ldr(), mode_name, received, expected, seq_sum, expected_sum);
+    error = true;
+  }
+
+  printf("%-4s msgs_per_sec=%.0f no_msgs=%lu\n", mode_name,
+      (double)received * ns_flt / diff_ticks_ns(time_stop, time_start), no_msgs);
+  char name[32];
+  snprintf(name, sizeof(name), "%-4s latency_ns", mode_name);
+  Histo_print(&histo, name, gTiming.ns_per_tick);
+
+  free(fifos);
+  free(producers);
+  free(consumers);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 6) {
+    printf("Usage:\n");
+    printf(" %s consumer_count producer_count msg_count window work_ns\n", argv[0]);
+    printf("  each producer sends msg_count msgs with at most window outstanding,\n");
+    printf("  the consumers spin work_ns per msg\n");
+    return 1;
+  }
+
+  u_int32_t consumer_count;
+  sscanf(argv[1], "%u", &consumer_count);
+  u_int32_t producer_count;
+  sscanf(argv[2], "%u", &producer_count);
+  u_int64_t msg_count;
+  sscanf(argv[3], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[4], "%u", &window);
+  u_int64_t work_ns;
+  sscanf(argv[5], "%lu", &work_ns);
+  printf("mpmc_bench consumer_count=%u producer_count=%u msg_count=%lu window=%u work_ns=%lu\n",
+      consumer_count, producer_count, msg_count, window, work_ns);
+
+  if ((consumer_count == 0) || (producer_count == 0) || (window == 0)) {
+    printf("consumer_count, producer_count and window must be > 0\n");
+    return 1;
+  }
+
+  error |= timing_init();
+  error |= run(MODE_MPMC, consumer_count, producer_count, msg_count, window, work_ns);
+  error |= run(MODE_MPSC, consumer_count, producer_count, msg_count, window, work_ns);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
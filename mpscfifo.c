@@ -23,9 +23,10 @@
 
 #define _DEFAULT_SOURCE
 
-#define DELAY 0
-
 #include "mpscfifo.h"
+#include "trace.h"
+#include "capture.h"
+#include "fault.h"
 #include "dpf.h"
 
 #include <sys/types.h>
@@ -37,8 +38,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-#include <unistd.h>
+ATOMIC(uint64_t) gMpscStalls = 0;
+ATOMIC(uint64_t) gMpscStallYields = 0;
 
 /**
  * @see mpscfifo.h
@@ -49,8 +52,12 @@ MpscFifo_t *initMpscFifo(MpscFifo_t *pQ, Msg_t *pStub) {
   pStub->pNext = NULL;
   pQ->pHead = pStub;
   pQ->pTail = pStub;
+  pQ->tail_tag = 0;
   pQ->count = 0;
+  pQ->enq_seq = 0;
   pQ->msgs_processed = 0;
+  pQ->msgs_expired = 0;
+  pQ->pRetCounters = NULL;
   return pQ;
 }
 
@@ -87,176 +94,316 @@ uint64_t deinitMpscFifo(MpscFifo_t *pQ, Msg_t**ppStub) {
 }
 
 /**
- * @see mpscifo.h
+ * Add without capturing, used directly when returning msgs to pools
  */
-#if USE_ATOMIC_TYPES
-
-void add(MpscFifo_t *pQ, Msg_t *pMsg) {
-  DPF(LDR "add:+pQ=%p count=%d msg=%p pool=%p arg1=%lu arg2=%lu\n", ldr(), pQ, pQ->count, pMsg, pMsg->pPool, pMsg->arg1, pMsg->arg2);
-  DPF(LDR "add: pQ=%p count=%d pHead=%p pHead->pNext=%p pTail=%p pTail->pNext=%p\n", ldr(), pQ, pQ->count, pQ->pHead, pQ->pHead->pNext, pQ->pTail, pQ->pTail->pNext);
-  pMsg->pNext = NULL;
-  Msg_t* pPrev = __atomic_exchange_n((Msg_t**)&pQ->pHead, pMsg, __ATOMIC_ACQ_REL);
+static inline void add_msg(MpscFifo_t *pQ, Msg_t *pMsg) {
+  TRACE(TRACE_ADD, pQ, pMsg, pMsg->arg1, pMsg->arg2);
+  MPSC_STORE(&pMsg->pNext, NULL, MPSC_ORD_CLR_NEXT);
+  Msg_t* pPrev = MPSC_XCHG(&pQ->pHead, pMsg, MPSC_ORD_XCHG_HEAD);
   // rmv will stall spinning if preempted at this critical spot
-
-#if DELAY != 0
-  usleep(DELAY);
-#endif
-
-  pPrev->pNext = pMsg;
-  DPF("%ld  add:-pQ=%p msg=%p arg1=%lu arg2=%lu\n",
-        pthread_self(), pQ, pMsg, pMsg->arg1, pMsg->arg2);
-
-  DPF(LDR "add: pQ=%p count=%d pPrev=%p pPrev->pNext=%p\n", ldr(), pQ, pQ->count, pPrev, pPrev->pNext);
-  DPF(LDR "add: pQ=%p count=%d pHead=%p pHead->pNext=%p pTail=%p pTail->pNext=%p\n", ldr(), pQ, pQ->count, pQ->pHead, pQ->pHead->pNext, pQ->pTail, pQ->pTail->pNext);
-  DPF(LDR "add:-pQ=%p count=%d msg=%p pool=%p arg1=%lu arg2=%lu\n", ldr(), pQ, pQ->count, pMsg, pMsg->pPool, pMsg->arg1, pMsg->arg2);
+  FAULT(FAULT_ADD_LINK);
+  MPSC_STORE(&pPrev->pNext, pMsg, MPSC_ORD_LINK);
 }
 
-#else
-
+/**
+ * @see mpscifo.h
+ */
 void add(MpscFifo_t *pQ, Msg_t *pMsg) {
-  pMsg->pNext = NULL;
-  Msg_t* pPrev = __atomic_exchange_n(&pQ->pHead, pMsg, __ATOMIC_ACQ_REL);
-  // rmv will stall spinning if preempted at this critical spot
-  __atomic_store_n(&pPrev->pNext, pMsg, __ATOMIC_RELEASE); //SEQ_CST);
+  CAPTURE(pQ, pMsg);
+  add_msg(pQ, pMsg);
 }
 
-#endif
-
 /**
  * @see mpscifo.h
  */
-#if USE_ATOMIC_TYPES
+uint64_t mpsc_coarse_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
 
-Msg_t *rmv_non_stalling(MpscFifo_t *pQ) {
-  Msg_t* pTail = pQ->pTail;
-  Msg_t* pNext = pTail->pNext;
-  DPF(LDR "rmv_non_stalling:0+pQ=%p count=%d pTail=%p pNext=%p\n", ldr(), pQ, pQ->count, pTail, pNext);
-  if (pNext != NULL) {
-    pTail->pRspQ = pNext->pRspQ;
-    pTail->arg1 = pNext->arg1;
-    pTail->arg2 = pNext->arg2;
-    pQ->pTail = pNext;
-    DPF(LDR "rmv_non_stalling:1-is EMPTY pQ=%p count=%d msg=NULL\n", ldr(), pQ, pQ->count);
-    pQ->msgs_processed += 1;
-    return pTail;
-  } else {
-    DPF("%ld  rmv_non_stalling:2-'empty' pQ=%p msg=NULL\n", pthread_self(), pQ);
-    return NULL;
-  }
+/**
+ * @see mpscifo.h
+ */
+void add_ttl(MpscFifo_t *pQ, Msg_t *pMsg, uint64_t ttl_ns) {
+  pMsg->deadline = mpsc_coarse_ns() + ttl_ns;
+  add(pQ, pMsg);
 }
 
-#else
+/**
+ * @see mpscifo.h
+ */
+void add_chain(MpscFifo_t *pQ, Msg_t *pFirst, Msg_t *pLast) {
+  TRACE(TRACE_ADD, pQ, pFirst, pFirst->arg1, pFirst->arg2);
+  MPSC_STORE(&pLast->pNext, NULL, MPSC_ORD_CLR_NEXT);
+  Msg_t* pPrev = MPSC_XCHG(&pQ->pHead, pLast, MPSC_ORD_XCHG_HEAD);
+  // rmv will stall spinning if preempted at this critical spot
+  FAULT(FAULT_ADD_LINK);
+  MPSC_STORE(&pPrev->pNext, pFirst, MPSC_ORD_LINK);
+}
 
+/**
+ * @see mpscifo.h
+ */
 Msg_t *rmv_non_stalling(MpscFifo_t *pQ) {
   Msg_t* pTail = pQ->pTail;
-  Msg_t* pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE);
+  Msg_t* pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT);
   if (pNext != NULL) {
     pTail->pRspQ = pNext->pRspQ;
     pTail->arg1 = pNext->arg1;
     pTail->arg2 = pNext->arg2;
+    pTail->deadline = pNext->deadline;
     pQ->pTail = pNext;
-    pQ->msgs_processed += 1;
+    __atomic_store_n(&pQ->msgs_processed, pQ->msgs_processed + 1, __ATOMIC_RELAXED);
+    TRACE(TRACE_RMV, pQ, pTail, pTail->arg1, pTail->arg2);
     return pTail;
   } else {
+    TRACE(TRACE_RMV_EMPTY, pQ, NULL, 0, 0);
     return NULL;
   }
 }
 
-#endif
-
 /**
  * @see mpscifo.h
  */
-#if USE_ATOMIC_TYPES
-
 Msg_t *rmv(MpscFifo_t *pQ) {
   Msg_t* pTail = pQ->pTail;
-  Msg_t* pNext = pTail->pNext;
-  DPF(LDR "rmv:0+pQ=%p count=%d pHead=%p pHead->pNext=%p pTail=%p pTail->pNext=%p\n", ldr(), pQ, pQ->count, pQ->pHead, pQ->pHead->pNext, pQ->pTail, pQ->pTail->pNext);
-  if ((pNext == NULL) && (pTail == pQ->pHead)) {
-    // Q is empty
-    DPF(LDR "rmv:1-empty pQ=%p pNext=%p pTail=%p == pHead=%p\n", ldr(), pQ, pNext, pTail, pQ->pHead);
+  Msg_t* pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT);
+  if ((pNext == NULL) && (pTail == MPSC_LOAD(&pQ->pHead, MPSC_ORD_LOAD_HEAD))) {
+    TRACE(TRACE_RMV_EMPTY, pQ, NULL, 0, 0);
     return NULL;
   } else {
     if (pNext == NULL) {
       // Q is NOT empty but producer was preempted at the critical spot
-      DPF(LDR "rmv:2 stalling pQ=%p count=%d pNext=NULL\n", ldr(), pQ, pQ->count);
-      for (uint32_t i = 0; (pNext = pTail->pNext) == NULL; i++) {
+      uint64_t yields = 0;
+      while ((pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT)) == NULL) {
+        FAULT(FAULT_RMV_STALL);
         sched_yield();
+        yields += 1;
       }
-      DPF(LDR "rmv:3 stalling %i times pQ=%p count=%d pNext=%p\n", ldr(), i pQ, pQ->count, pNext);
+      __atomic_fetch_add(&gMpscStalls, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&gMpscStallYields, yields, __ATOMIC_RELAXED);
+      TRACE(TRACE_RMV_STALL, pQ, pNext, yields, 0);
     }
     pTail->pRspQ = pNext->pRspQ;
     pTail->arg1 = pNext->arg1;
     pTail->arg2 = pNext->arg2;
+    pTail->deadline = pNext->deadline;
     pQ->pTail = pNext;
-    DPF(LDR "rmv:4-got msg pQ=%p msg=%p arg1=%lu arg2=%lu\n", ldr(), pQ, pTail, pTail->arg1, pTail->arg2);
-    pQ->processed += 1;
+    __atomic_store_n(&pQ->msgs_processed, pQ->msgs_processed + 1, __ATOMIC_RELAXED);
+    TRACE(TRACE_RMV, pQ, pTail, pTail->arg1, pTail->arg2);
     return pTail;
   }
 }
 
+_Static_assert((offsetof(MpscFifo_t, tail_tag) == offsetof(MpscFifo_t, pTail) + 8)
+    && ((offsetof(MpscFifo_t, pTail) % 16) == 0), "pTail and tail_tag must be one aligned pair");
+
+/**
+ * If pQ->pTail is still pTail with tag make it pNext and bump the tag.
+ *
+ * @return true if swapped
+ */
+static inline bool cas_tail(MpscFifo_t *pQ, Msg_t* pTail, uint64_t tag, Msg_t* pNext) {
+#if defined(__x86_64__)
+  // Inline so -mcx16 isn't needed and it's never a libatomic lock
+  bool swapped;
+  uint64_t new_tag = tag + 1;
+  __asm__ __volatile__ ("lock cmpxchg16b (%3)\n\tsete %0"
+      : "=q" (swapped), "+a" (pTail), "+d" (tag)
+      : "r" (&pQ->pTail), "b" (pNext), "c" (new_tag)
+      : "memory", "cc");
+  return swapped;
 #else
+  // Other architectures use the builtin, which may need -latomic
+  struct { Msg_t* pTail; uint64_t tag; } expected = { pTail, tag }, desired = { pNext, tag + 1 };
+  return __atomic_compare_exchange(
+      (__typeof__(expected)*)&pQ->pTail, &expected, &desired,
+      false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
 
-Msg_t *rmv(MpscFifo_t *pQ) {
-  Msg_t* pTail = pQ->pTail;
-  Msg_t* pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_SEQ_CST);
-  if ((pNext == NULL) && (pTail == __atomic_load_n(&pQ->pHead, __ATOMIC_ACQUIRE))) {
-    return NULL;
-  } else {
+/**
+ * @see mpscifo.h
+ */
+Msg_t *rmv_mc(MpscFifo_t *pQ) {
+  while (true) {
+    // Read the tag first, if pTail changes after this the cas fails
+    uint64_t tag = __atomic_load_n(&pQ->tail_tag, __ATOMIC_ACQUIRE);
+    Msg_t* pTail = __atomic_load_n(&pQ->pTail, __ATOMIC_ACQUIRE);
+    Msg_t* pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT);
     if (pNext == NULL) {
-      while ((pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE)) == NULL) {
-        sched_yield();
+      if (tag != __atomic_load_n(&pQ->tail_tag, __ATOMIC_ACQUIRE)) {
+        // Another consumer removed pTail
+        continue;
       }
+      if (pTail == MPSC_LOAD(&pQ->pHead, MPSC_ORD_LOAD_HEAD)) {
+        TRACE(TRACE_RMV_EMPTY, pQ, NULL, 0, 0);
+        return NULL;
+      }
+      // Q is NOT empty but producer was preempted at the critical spot
+      sched_yield();
+      continue;
+    }
+
+    // Copy before claiming, once claimed another consumer may take pNext
+    MpscFifo_t* pRspQ = pNext->pRspQ;
+    uint64_t arg1 = pNext->arg1;
+    uint64_t arg2 = pNext->arg2;
+    uint64_t deadline = pNext->deadline;
+    if (cas_tail(pQ, pTail, tag, pNext)) {
+      pTail->pRspQ = pRspQ;
+      pTail->arg1 = arg1;
+      pTail->arg2 = arg2;
+      pTail->deadline = deadline;
+      __atomic_fetch_add(&pQ->msgs_processed, 1, __ATOMIC_RELAXED);
+      TRACE(TRACE_RMV, pQ, pTail, pTail->arg1, pTail->arg2);
+      return pTail;
     }
-    pTail->pRspQ = pNext->pRspQ;
-    pTail->arg1 = pNext->arg1;
-    pTail->arg2 = pNext->arg2;
-    pQ->pTail = pNext;
-    pQ->msgs_processed += 1;
-    return pTail;
   }
 }
 
-#endif
-
 /**
  * @see mpscifo.h
  */
-#if USE_ATOMIC_TYPES
-
 Msg_t *rmv_no_dbg_on_empty(MpscFifo_t *pQ) {
   Msg_t* pTail = pQ->pTail;
-  Msg_t* pNext = pTail->pNext;
-  if ((pNext == NULL) && (pTail == pQ->pHead)) {
-    // Q is "empty"
+  Msg_t* pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT);
+  if ((pNext == NULL) && (pTail == MPSC_LOAD(&pQ->pHead, MPSC_ORD_LOAD_HEAD))) {
     return NULL;
   } else {
     return rmv(pQ);
   }
 }
 
-#else
+static uint32_t gNextRetShard = 0;
+static __thread uint32_t tRetShard = MPSC_RET_SHARDS;
 
-Msg_t *rmv_no_dbg_on_empty(MpscFifo_t *pQ) {
+/**
+ * Count msgs returned to pPool. This is done after they've been
+ * added so a thread which sees every msg counted may free the pool.
+ */
+static inline void count_ret(MpscFifo_t* pPool, uint64_t count) {
+  if (pPool->pRetCounters != NULL) {
+    uint32_t shard = tRetShard;
+    if (__builtin_expect(shard >= MPSC_RET_SHARDS, 0)) {
+      shard = tRetShard =
+        __atomic_fetch_add(&gNextRetShard, 1, __ATOMIC_RELAXED) % MPSC_RET_SHARDS;
+    }
+    __atomic_fetch_add(&pPool->pRetCounters[shard].count, count, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @see mpscfifo.h
+ */
+uint32_t drain(MpscFifo_t *pQ) {
+  uint32_t count = 0;
+  Msg_t* pFirst = NULL;
+  Msg_t* pLast = NULL;
+  uint32_t run = 0;
+
+  // Every msg but the last is removed, the last becomes the stub
   Msg_t* pTail = pQ->pTail;
-  Msg_t* pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE);
-  if ((pNext == NULL) && (pTail == __atomic_load_n(&pQ->pHead, __ATOMIC_ACQUIRE))) {
-    return NULL;
-  } else {
-    return rmv(pQ);
+  while (true) {
+    Msg_t* pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT);
+    if (pNext == NULL) {
+      if (pTail == MPSC_LOAD(&pQ->pHead, MPSC_ORD_LOAD_HEAD)) {
+        break;
+      }
+      // Producer was preempted at the critical spot
+      sched_yield();
+      continue;
+    }
+    pQ->pTail = pNext;
+    __atomic_store_n(&pQ->msgs_processed, pQ->msgs_processed + 1, __ATOMIC_RELAXED);
+    count += 1;
+
+    // Collect runs of msgs from the same pool
+    if ((pFirst != NULL) && (pTail->pPool != pFirst->pPool)) {
+      add_chain(pFirst->pPool, pFirst, pLast);
+      count_ret(pFirst->pPool, run);
+      pFirst = NULL;
+    }
+    if (pTail->pPool != NULL) {
+      if (pFirst == NULL) {
+        pFirst = pTail;
+        run = 0;
+      } else {
+        pLast->pNext = pTail;
+      }
+      pLast = pTail;
+      run += 1;
+    }
+    pTail = pNext;
+  }
+  if (pFirst != NULL) {
+    add_chain(pFirst->pPool, pFirst, pLast);
+    count_ret(pFirst->pPool, run);
   }
+  DPF(LDR "drain: pQ=%p count=%u\n", ldr(), pQ, count);
+  return count;
 }
 
-#endif
+/**
+ * @see mpscfifo.h
+ */
+Msg_t *rmv_live(MpscFifo_t *pQ, MpscFifo_t *pExpired) {
+  Msg_t* pMsg = rmv(pQ);
+  if ((pMsg == NULL) || (pMsg->deadline == 0)) {
+    return pMsg;
+  }
+  uint64_t now = mpsc_coarse_ns();
+  Msg_t* pFirst = NULL;
+  Msg_t* pLast = NULL;
+  uint64_t run = 0;
+  uint64_t expired = 0;
+  while ((pMsg != NULL) && (pMsg->deadline != 0) && (pMsg->deadline <= now)) {
+    TRACE(TRACE_RMV_EXPIRED, pQ, pMsg, pMsg->arg1, pMsg->deadline);
+    expired += 1;
+    if ((pExpired == NULL) && (pFirst != NULL) && (pMsg->pPool != pFirst->pPool)) {
+      add_chain(pFirst->pPool, pFirst, pLast);
+      count_ret(pFirst->pPool, run);
+      pFirst = NULL;
+    }
+    if ((pExpired != NULL) || (pMsg->pPool != NULL)) {
+      if (pFirst == NULL) {
+        pFirst = pMsg;
+        run = 0;
+      } else {
+        pLast->pNext = pMsg;
+      }
+      pLast = pMsg;
+      run += 1;
+    }
+    pMsg = rmv(pQ);
+  }
+  if (pFirst != NULL) {
+    if (pExpired != NULL) {
+      add_chain(pExpired, pFirst, pLast);
+    } else {
+      add_chain(pFirst->pPool, pFirst, pLast);
+      count_ret(pFirst->pPool, run);
+    }
+  }
+  if (expired != 0) {
+    __atomic_store_n(&pQ->msgs_expired, pQ->msgs_expired + expired, __ATOMIC_RELAXED);
+    DPF(LDR "rmv_live: pQ=%p expired=%lu\n", ldr(), pQ, expired);
+  }
+  return pMsg;
+}
 
 /**
  * @see mpscfifo.h
  */
 void ret_msg(Msg_t* pMsg) {
   if ((pMsg != NULL) && (pMsg->pPool != NULL)) {
+    TRACE(TRACE_RET_MSG, pMsg->pPool, pMsg, pMsg->arg1, pMsg->arg2);
     DPF(LDR "ret_msg: pool=%p msg=%p arg1=%lu arg2=%lu\n", ldr(), pMsg->pPool, pMsg, pMsg->arg1, pMsg->arg2);
-    add(pMsg->pPool, pMsg);
+    MpscFifo_t* pPool = pMsg->pPool;
+    FAULT(FAULT_RET_MSG);
+    add_msg(pPool, pMsg);
+    count_ret(pPool, 1);
   } else {
     if (pMsg == NULL) {
       DPF(LDR "ret:#No msg msg=%p\n", ldr(), pMsg);
@@ -275,6 +422,8 @@ void send_rsp_or_ret(Msg_t* msg, uint64_t arg1) {
     MpscFifo_t* pRspQ = msg->pRspQ;
     msg->pRspQ = NULL;
     msg->arg1 = arg1;
+    msg->deadline = 0;
+    TRACE(TRACE_SEND_RSP, pRspQ, msg, msg->arg1, msg->arg2);
     DPF(LDR "send_rsp_or_ret: send pRspQ=%p msg=%p pool=%p arg1=%lu arg2=%lu\n",
         ldr(), pRspQ, msg, msg->pPool, msg->arg1, msg->arg2);
     add(pRspQ, msg);
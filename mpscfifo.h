@@ -24,38 +24,164 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+// C++ has no _Atomic, the fields keep the same layout and
+// are only accessed using the __atomic builtins.
+#define ATOMIC(T) T
+extern "C" {
+#else
+#define ATOMIC(T) _Atomic(T)
+#endif
+
 typedef struct MpscFifo_t MpscFifo_t;
 typedef struct Msg_t Msg_t;
 
 #define VOLATILE volatile
 
-#define USE_ATOMIC_TYPES 0
+/**
+ * Memory ordering policies for add and rmv, selected at compile
+ * time by defining MPSCFIFO_ORDERING.
+ *
+ * ACQ_REL is the minimal correct set. The XCHG of pHead must be
+ * ACQ_REL so a producer's pMsg->pNext = NULL happens before the
+ * next producer links to it, the link is a RELEASE which the
+ * consumer's ACQUIRE load of pNext pairs with. Clearing pNext and
+ * the consumer's empty check of pHead are RELAXED.
+ *
+ * SEQ_CST makes every access SEQ_CST, for debugging.
+ *
+ * C11 declares pNext and pHead _Atomic and uses stdatomic with
+ * the ACQ_REL orderings.
+ */
+#define MPSCFIFO_ORDERING_ACQ_REL 0
+#define MPSCFIFO_ORDERING_SEQ_CST 1
+#define MPSCFIFO_ORDERING_C11     2
 
-typedef struct Msg_t {
-#if USE_ATOMIC_TYPES
-  _Atomic(Msg_t*) VOLATILE pNext __attribute__ (( aligned (64) )); // Next message
+#ifndef MPSCFIFO_ORDERING
+#define MPSCFIFO_ORDERING MPSCFIFO_ORDERING_ACQ_REL
+#endif
+
+#if MPSCFIFO_ORDERING == MPSCFIFO_ORDERING_ACQ_REL
+#define MPSCFIFO_ORDERING_NAME "acq_rel"
+#elif MPSCFIFO_ORDERING == MPSCFIFO_ORDERING_SEQ_CST
+#define MPSCFIFO_ORDERING_NAME "seq_cst"
+#elif MPSCFIFO_ORDERING == MPSCFIFO_ORDERING_C11
+#define MPSCFIFO_ORDERING_NAME "c11"
+#else
+#error "Unknown MPSCFIFO_ORDERING"
+#endif
+
+#if MPSCFIFO_ORDERING == MPSCFIFO_ORDERING_SEQ_CST
+#define MPSC_ORD_CLR_NEXT  __ATOMIC_SEQ_CST
+#define MPSC_ORD_XCHG_HEAD __ATOMIC_SEQ_CST
+#define MPSC_ORD_LINK      __ATOMIC_SEQ_CST
+#define MPSC_ORD_LOAD_NEXT __ATOMIC_SEQ_CST
+#define MPSC_ORD_LOAD_HEAD __ATOMIC_SEQ_CST
+#else
+#define MPSC_ORD_CLR_NEXT  __ATOMIC_RELAXED
+#define MPSC_ORD_XCHG_HEAD __ATOMIC_ACQ_REL
+#define MPSC_ORD_LINK      __ATOMIC_RELEASE
+#define MPSC_ORD_LOAD_NEXT __ATOMIC_ACQUIRE
+#define MPSC_ORD_LOAD_HEAD __ATOMIC_RELAXED
+#endif
+
+#if (MPSCFIFO_ORDERING == MPSCFIFO_ORDERING_C11) && !defined(__cplusplus)
+#include <stdatomic.h>
+#define MPSC_PTR(T) _Atomic(T)
+#define MPSC_XCHG(p, v, mo)  atomic_exchange_explicit((p), (v), (mo))
+#define MPSC_LOAD(p, mo)     atomic_load_explicit((p), (mo))
+#define MPSC_STORE(p, v, mo) atomic_store_explicit((p), (v), (mo))
 #else
-  Msg_t* pNext __attribute__ (( aligned (64) )); // Next message
+#define MPSC_PTR(T) T
+#define MPSC_XCHG(p, v, mo)  __atomic_exchange_n((p), (v), (mo))
+#define MPSC_LOAD(p, mo)     __atomic_load_n((p), (mo))
+#define MPSC_STORE(p, v, mo) __atomic_store_n((p), (v), (mo))
 #endif
+
+/**
+ * Cache line layouts of Msg_t and MpscFifo_t, selected at compile
+ * time by defining MPSCFIFO_LAYOUT.
+ *
+ * PADDED pads each Msg_t to a cache line and puts pHead and pTail
+ * on their own lines, count and msgs_processed share pTail's line.
+ *
+ * PACKED doesn't pad, a Msg_t is 48 bytes and the fifo's fields are
+ * adjacent, for msgs and fifos mostly used by one core at a time.
+ * pTail stays 16 byte aligned for rmv_mc.
+ *
+ * SPLIT is PADDED with count, msgs_processed and pRetCounters on a
+ * line of their own so producers reading the depth don't take the
+ * consumer's pTail line.
+ */
+#define MPSCFIFO_LAYOUT_PADDED 0
+#define MPSCFIFO_LAYOUT_PACKED 1
+#define MPSCFIFO_LAYOUT_SPLIT  2
+
+#ifndef MPSCFIFO_LAYOUT
+#define MPSCFIFO_LAYOUT MPSCFIFO_LAYOUT_PADDED
+#endif
+
+#if MPSCFIFO_LAYOUT == MPSCFIFO_LAYOUT_PADDED
+#define MPSCFIFO_LAYOUT_NAME "padded"
+#define MPSC_MSG_ALIGN  64
+#define MPSC_HEAD_ALIGN 64
+#define MPSC_TAIL_ALIGN 64
+#define MPSC_CTR_ALIGN  4
+#elif MPSCFIFO_LAYOUT == MPSCFIFO_LAYOUT_PACKED
+#define MPSCFIFO_LAYOUT_NAME "packed"
+#define MPSC_MSG_ALIGN  8
+#define MPSC_HEAD_ALIGN 8
+#define MPSC_TAIL_ALIGN 16
+#define MPSC_CTR_ALIGN  4
+#elif MPSCFIFO_LAYOUT == MPSCFIFO_LAYOUT_SPLIT
+#define MPSCFIFO_LAYOUT_NAME "split"
+#define MPSC_MSG_ALIGN  64
+#define MPSC_HEAD_ALIGN 64
+#define MPSC_TAIL_ALIGN 64
+#define MPSC_CTR_ALIGN  64
+#else
+#error "Unknown MPSCFIFO_LAYOUT"
+#endif
+
+typedef struct Msg_t {
+  MPSC_PTR(Msg_t*) pNext __attribute__ (( aligned (MPSC_MSG_ALIGN) )); // Next message
   MpscFifo_t* pPool;
   MpscFifo_t* pRspQ;
   uint64_t arg1;
   uint64_t arg2;
+  uint64_t deadline;              // mpsc_coarse_ns() it expires at, 0 never, see add_ttl
 } Msg_t;
 
+/**
+ * Number of msgs returned to a pool, ret_msg increments one of
+ * MPSC_RET_SHARDS per pool chosen by the calling thread so the
+ * returning threads don't share a cache line.
+ */
+#define MPSC_RET_SHARDS 16
+
+typedef struct MpscRetCounter_t {
+  ATOMIC(uint64_t) count __attribute__(( aligned (64) ));
+} MpscRetCounter_t;
+
 typedef struct MpscFifo_t {
-#if USE_ATOMIC_TYPES
-  _Atomic(Msg_t*) VOLATILE pHead __attribute__(( aligned (64) ));
-  Msg_t* pTail __attribute__(( aligned (64) ));
-#else
-  Msg_t* pHead __attribute__(( aligned (64) ));
-  Msg_t* pTail __attribute__(( aligned (64) ));
-#endif
-  VOLATILE _Atomic(uint32_t) count;
-  uint64_t msgs_processed;
+  MPSC_PTR(Msg_t*) pHead __attribute__(( aligned (MPSC_HEAD_ALIGN) ));
+  ATOMIC(uint64_t) enq_seq;       // Msgs sent with Dispatch_add, see spill.h
+  Msg_t* pTail __attribute__(( aligned (MPSC_TAIL_ALIGN) ));
+  uint64_t tail_tag;              // Bumped with pTail by rmv_mc so a recycled pTail isn't mistaken
+  VOLATILE ATOMIC(uint32_t) count __attribute__(( aligned (MPSC_CTR_ALIGN) ));
+  uint64_t msgs_processed;        // Written by the consumers, relaxed so others may read it
+  uint64_t msgs_expired;          // Dropped by rmv_live, written by the consumer
+  MpscRetCounter_t* pRetCounters; // NULL unless this is a pool which counts returns
 } MpscFifo_t;
 
-extern _Atomic(uint64_t) gTick;
+extern ATOMIC(uint64_t) gTick;
+
+/**
+ * Across all fifos, the times rmv found a producer preempted between
+ * the exchange and the link, and the yields it waited for them.
+ */
+extern ATOMIC(uint64_t) gMpscStalls;
+extern ATOMIC(uint64_t) gMpscStallYields;
 
 #define LDR "%6ld %lx  "
 #define ldr() ++gTick, pthread_self()
@@ -85,6 +211,40 @@ extern uint64_t deinitMpscFifo(MpscFifo_t *pQ, Msg_t**ppStub);
  */
 extern void add(MpscFifo_t *pQ, Msg_t *pMsg);
 
+/**
+ * Add a chain of Msg_t's, linked by pNext from pFirst to pLast,
+ * to the Queue with a single exchange. pLast->pNext need not be
+ * NULL. Like add this is wait free and may be used by multiple
+ * entities.
+ */
+extern void add_chain(MpscFifo_t *pQ, Msg_t *pFirst, Msg_t *pLast);
+
+/**
+ * Return CLOCK_MONOTONIC_COARSE in nano seconds, the clock of
+ * Msg_t.deadline. It's cheap to read but only advances every
+ * jiffy, 1 to 10ms, so TTLs should be well above that.
+ */
+extern uint64_t mpsc_coarse_ns(void);
+
+/**
+ * Add a Msg_t to the Queue, as add, which expires ttl_ns from now.
+ * A consumer using rmv_live drops it, without handling it, if it's
+ * removed after its deadline. Msgs from MsgPool_get_msg have no
+ * deadline and send_rsp_or_ret clears it. Spilled msgs, see spill.h,
+ * lose their deadline.
+ */
+extern void add_ttl(MpscFifo_t *pQ, Msg_t *pMsg, uint64_t ttl_ns);
+
+/**
+ * Remove a Msg_t from the Queue, as rmv, skipping msgs whose deadline
+ * has passed. The clock is read once per call and only if a msg has
+ * a deadline. The expired msgs are added to pExpired with one
+ * add_chain or, if pExpired is NULL, returned to their pools with one
+ * add_chain per run from the same pool, and counted in msgs_expired.
+ * This maybe used only by a single thread and may stall like rmv.
+ */
+extern Msg_t *rmv_live(MpscFifo_t *pQ, MpscFifo_t *pExpired);
+
 /**
  * Remove a Msg_t from the Queue. This maybe used only by
  * a single thread and returns NULL if empty or would
@@ -100,6 +260,18 @@ extern Msg_t *rmv_non_stalling(MpscFifo_t *pQ);
  */
 extern Msg_t *rmv(MpscFifo_t *pQ);
 
+/**
+ * Remove a Msg_t from the Queue, this maybe used by multiple
+ * consumers at once and returns NULL if empty. A consumer claims
+ * the tail by swinging pTail and tail_tag with one double width
+ * compare and swap, so add is unchanged and still wait free. A
+ * consumer may read a msg another consumer has already returned
+ * and the failed compare and swap discards what it read, so the
+ * msgs must not be freed, i.e. MsgPool_trim, while consumers are
+ * active. Don't mix with the single consumer rmv's on one fifo.
+ */
+extern Msg_t *rmv_mc(MpscFifo_t *pQ);
+
 /**
  * Remove a Msg_t from the Queue DO NOT PRINT DBG output if empty.
  * This maybe used only by a single thread and returns NULL if empty.
@@ -108,6 +280,16 @@ extern Msg_t *rmv(MpscFifo_t *pQ);
  */
 extern Msg_t *rmv_no_dbg_on_empty(MpscFifo_t *pQ);
 
+/**
+ * Remove all of the Msg_t's from the Queue and return them to their
+ * pools, consecutive msgs of the same pool are returned with one
+ * add_chain. This maybe used only by a single thread and may stall
+ * like rmv.
+ *
+ * @return number of messages returned.
+ */
+extern uint32_t drain(MpscFifo_t *pQ);
+
 /**
  * Return the message to its pool.
  */
@@ -118,4 +300,8 @@ extern void ret_msg(Msg_t* pMsg);
  */
 extern void send_rsp_or_ret(Msg_t* msg, uint64_t arg1);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
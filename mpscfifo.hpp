@@ -0,0 +1,304 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Header only C++ layer over MpscFifo_t with typed payloads.
+ *
+ * A Node<T> is a Msg_t followed by a T so the queues use the C
+ * memory layout, C producers may add() a Node<T> obtained from a
+ * MsgPool<T> to MpscFifo<T>::c_fifo() and a C++ producer may push
+ * to a queue initialized by initMpscFifo. Because rmv only moves
+ * pRspQ, arg1 and arg2 the consumer of an MpscFifo<T> must use
+ * try_pop so the payload is moved too.
+ *
+ * push and try_pop are inline and use the same MPSCFIFO_ORDERING
+ * as add and rmv in mpscfifo.c.
+ */
+
+#ifndef COM_SAVILLE_MPSCFIFO_HPP
+#define COM_SAVILLE_MPSCFIFO_HPP
+
+#include "mpscfifo.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace mpscfifo {
+
+template <typename T> class MsgPool;
+template <typename T> class MpscFifo;
+
+/** How long ~MsgPool waits for outstanding nodes */
+static const uint64_t kPoolDeinitTimeoutNs = 1000000000ull;
+
+static inline uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * A message, msg must be first so a Node<T>* is a Msg_t*.
+ */
+template <typename T>
+struct Node {
+  Msg_t msg;
+  T payload;
+};
+
+/**
+ * Add pMsg to pQ, identical to add() but inlinable.
+ */
+static inline void push_msg(MpscFifo_t* pQ, Msg_t* pMsg) {
+  MPSC_STORE(&pMsg->pNext, (Msg_t*)nullptr, MPSC_ORD_CLR_NEXT);
+  Msg_t* pPrev = MPSC_XCHG(&pQ->pHead, pMsg, MPSC_ORD_XCHG_HEAD);
+  // A consumer will stall spinning if preempted at this critical spot
+  MPSC_STORE(&pPrev->pNext, pMsg, MPSC_ORD_LINK);
+}
+
+/**
+ * Remove the next node leaving pNext in ppNext so the caller can
+ * move the payload, NULL if empty. If stall is false returns NULL
+ * when a producer was preempted at the critical spot.
+ */
+static inline Msg_t* pop_msg(MpscFifo_t* pQ, Msg_t** ppNext, bool stall) {
+  Msg_t* pTail = pQ->pTail;
+  Msg_t* pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT);
+  if (pNext == nullptr) {
+    if (!stall || (pTail == MPSC_LOAD(&pQ->pHead, MPSC_ORD_LOAD_HEAD))) {
+      return nullptr;
+    }
+    while ((pNext = MPSC_LOAD(&pTail->pNext, MPSC_ORD_LOAD_NEXT)) == nullptr) {
+      sched_yield();
+    }
+  }
+  pTail->pRspQ = pNext->pRspQ;
+  pTail->arg1 = pNext->arg1;
+  pTail->arg2 = pNext->arg2;
+  pTail->deadline = pNext->deadline;
+  pQ->pTail = pNext;
+  __atomic_store_n(&pQ->msgs_processed, pQ->msgs_processed + 1, __ATOMIC_RELAXED);
+  *ppNext = pNext;
+  return pTail;
+}
+
+/**
+ * A move only handle to a Node<T>, when destroyed the node is
+ * returned to its pool.
+ */
+template <typename T>
+class MsgHandle {
+ public:
+  MsgHandle() : pNode_(nullptr) {}
+  explicit MsgHandle(Node<T>* pNode) : pNode_(pNode) {}
+  MsgHandle(MsgHandle&& other) : pNode_(other.release()) {}
+  MsgHandle& operator=(MsgHandle&& other) {
+    if (this != &other) {
+      reset(other.release());
+    }
+    return *this;
+  }
+  MsgHandle(const MsgHandle&) = delete;
+  MsgHandle& operator=(const MsgHandle&) = delete;
+  ~MsgHandle() { reset(nullptr); }
+
+  explicit operator bool() const { return pNode_ != nullptr; }
+  T& operator*() const { return pNode_->payload; }
+  T* operator->() const { return &pNode_->payload; }
+
+  /** The C message, for pRspQ, arg1 and arg2 */
+  Msg_t* msg() const { return &pNode_->msg; }
+
+  /** Give up ownership without returning the node */
+  Node<T>* release() {
+    Node<T>* pNode = pNode_;
+    pNode_ = nullptr;
+    return pNode;
+  }
+
+  /** Return the current node to its pool and take pNode */
+  void reset(Node<T>* pNode) {
+    Node<T>* pOld = pNode_;
+    pNode_ = pNode;
+    if ((pOld != nullptr) && (pOld->msg.pPool != nullptr)) {
+      push_msg(pOld->msg.pPool, &pOld->msg);
+    }
+  }
+
+ private:
+  Node<T>* pNode_;
+};
+
+/**
+ * A pool of Node<T>, the free nodes are kept in a MpscFifo_t so
+ * any thread may return a node but only one thread may get them.
+ */
+template <typename T>
+class MsgPool {
+  static_assert(std::is_default_constructible<T>::value, "T must be default constructible");
+  static_assert(std::is_nothrow_move_assignable<T>::value, "T must be nothrow move assignable");
+
+ public:
+  explicit MsgPool(uint32_t msg_count) : pNodes_(nullptr), msg_count_(0) {
+    void* p;
+    if (posix_memalign(&p, alignof(Node<T>), sizeof(Node<T>) * (msg_count + 1)) != 0) {
+      return;
+    }
+    pNodes_ = static_cast<Node<T>*>(p);
+
+    // Construct and pre-link the nodes in one pass then add them
+    // with a single add_chain, node 0 is the stub
+    for (uint32_t i = 0; i <= msg_count; i++) {
+      Node<T>* pNode = new (&pNodes_[i]) Node<T>();
+      pNode->msg.pPool = &fifo_;
+      pNode->msg.pNext = (i + 1) <= msg_count ? &pNodes_[i + 1].msg : nullptr;
+    }
+    initMpscFifo(&fifo_, &pNodes_[0].msg);
+    if (msg_count > 0) {
+      add_chain(&fifo_, &pNodes_[1].msg, &pNodes_[msg_count].msg);
+    }
+    msg_count_ = msg_count;
+  }
+
+  /**
+   * All nodes must have been returned, waits up to
+   * kPoolDeinitTimeoutNs for them. If some are still out the
+   * nodes are leaked rather than freed under their holders.
+   */
+  ~MsgPool() {
+    if (pNodes_ == nullptr) {
+      return;
+    }
+    uint64_t deadline = monotonic_ns() + kPoolDeinitTimeoutNs;
+    for (uint32_t i = 0; i < msg_count_; i++) {
+      Msg_t* pNext;
+      while (pop_msg(&fifo_, &pNext, true) == nullptr) {
+        if (monotonic_ns() >= deadline) {
+          printf("~MsgPool: ERROR pool=%p %u of %u nodes not returned, leaking them\n",
+              (void*)this, msg_count_ - i, msg_count_);
+          return;
+        }
+        sched_yield();
+      }
+    }
+    for (uint32_t i = 0; i <= msg_count_; i++) {
+      pNodes_[i].~Node<T>();
+    }
+    free(pNodes_);
+  }
+
+  MsgPool(const MsgPool&) = delete;
+  MsgPool& operator=(const MsgPool&) = delete;
+
+  bool ok() const { return pNodes_ != nullptr; }
+  uint32_t msg_count() const { return msg_count_; }
+
+  /** Get a node, the handle is empty if there are none */
+  MsgHandle<T> get() {
+    Msg_t* pNext;
+    Msg_t* pMsg = pop_msg(&fifo_, &pNext, true);
+    if (pMsg == nullptr) {
+      return MsgHandle<T>();
+    }
+    pMsg->pRspQ = nullptr;
+    pMsg->arg1 = 0;
+    pMsg->arg2 = 0;
+    pMsg->deadline = 0;
+    return MsgHandle<T>(reinterpret_cast<Node<T>*>(pMsg));
+  }
+
+ private:
+  friend class MpscFifo<T>;
+
+  MpscFifo_t fifo_;
+  Node<T>* pNodes_;
+  uint32_t msg_count_;
+};
+
+/**
+ * A multi producer single consumer fifo of Node<T>.
+ */
+template <typename T>
+class MpscFifo {
+ public:
+  /**
+   * The stub is taken from pool, if it's empty the fifo isn't
+   * usable and ok() is false.
+   */
+  explicit MpscFifo(MsgPool<T>& pool) {
+    Node<T>* pStub = pool.get().release();
+    if (pStub != nullptr) {
+      initMpscFifo(&q_, &pStub->msg);
+    } else {
+      q_.pHead = nullptr;
+      q_.pTail = nullptr;
+    }
+  }
+
+  /** Remaining nodes and the stub are returned to their pools */
+  ~MpscFifo() {
+    if (!ok()) {
+      return;
+    }
+    while (try_pop()) {
+    }
+    deinitMpscFifo(&q_, nullptr);
+  }
+
+  bool ok() const { return q_.pTail != nullptr; }
+
+  MpscFifo(const MpscFifo&) = delete;
+  MpscFifo& operator=(const MpscFifo&) = delete;
+
+  /** The underlying C fifo */
+  MpscFifo_t* c_fifo() { return &q_; }
+
+  /** Add a message, any thread */
+  void push(MsgHandle<T>&& h) {
+    Node<T>* pNode = h.release();
+    if (pNode != nullptr) {
+      push_msg(&q_, &pNode->msg);
+    }
+  }
+
+  /**
+   * Remove a message, only the consumer thread. The handle is
+   * empty if the fifo is empty, this may stall if a producer
+   * was preempted at the critical spot.
+   */
+  MsgHandle<T> try_pop() {
+    return pop(true);
+  }
+
+  /**
+   * Remove a message, only the consumer thread. The handle is
+   * empty if the fifo is empty or would have stalled.
+   */
+  MsgHandle<T> try_pop_non_stalling() {
+    return pop(false);
+  }
+
+ private:
+  MsgHandle<T> pop(bool stall) {
+    Msg_t* pNext;
+    Msg_t* pMsg = pop_msg(&q_, &pNext, stall);
+    if (pMsg == nullptr) {
+      return MsgHandle<T>();
+    }
+    Node<T>* pNode = reinterpret_cast<Node<T>*>(pMsg);
+    pNode->payload = std::move(reinterpret_cast<Node<T>*>(pNext)->payload);
+    return MsgHandle<T>(pNode);
+  }
+
+  MpscFifo_t q_;
+};
+
+} // namespace mpscfifo
+
+#endif
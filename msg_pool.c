@@ -15,6 +15,8 @@
 
 #include "mpscfifo.h"
 #include "msg_pool.h"
+#include "diff_timespec.h"
+#include "trace.h"
 #include "dpf.h"
 
 #include <sys/types.h>
@@ -25,6 +27,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 bool MsgPool_init(MsgPool_t* pool, uint32_t msg_count) {
   bool error;
@@ -33,9 +36,10 @@ bool MsgPool_init(MsgPool_t* pool, uint32_t msg_count) {
   DPF(LDR "MsgPool_init:+pool=%p msg_count=%u\n",
       ldr(), pool, msg_count);
 
-  // Allocate messages
-  msgs = malloc(sizeof(Msg_t) * (msg_count + 1));
-  if (msgs == NULL) {
+  // Allocate messages aligned as MPSCFIFO_LAYOUT requires
+  size_t align = MPSC_MSG_ALIGN < sizeof(void*) ? sizeof(void*) : MPSC_MSG_ALIGN;
+  if (posix_memalign((void**)&msgs, align, sizeof(Msg_t) * (msg_count + 1)) != 0) {
+    msgs = NULL;
     printf(LDR "MsgPool_init:-pool=%p ERROR unable to allocate messages, aborting msg_count=%u\n",
         ldr(), pool, msg_count);
     error = true;
@@ -46,19 +50,12 @@ bool MsgPool_init(MsgPool_t* pool, uint32_t msg_count) {
   DPF(LDR "MsgPool_init: pool=%p &msgs[0]=%p &msgs[1]=%p sizeof(Msg_t)=%lu(0x%lx)\n",
       ldr(), pool, &msgs[0], &msgs[1], sizeof(Msg_t), sizeof(Msg_t));
 
-  // Create pool first message will be stub
-  for (uint32_t i = 0; i <= msg_count; i++) {
-    Msg_t* msg = &msgs[i];
-    DPF(LDR "MsgPool_init: add %u msg=%p%s\n", ldr(), i, msg, i == 0 ? " stub" : "");
-    msg->pPool = &pool->fifo;
-    if (i == 0) {
-      // Use first msg to init pool
-      initMpscFifo(&pool->fifo, msg);
-    } else {
-      // Add remaining msgw to pool
-      add(&pool->fifo, msg);
-    }
-  }
+  // Use first msg to init pool, the remaining msgs aren't touched
+  // until MsgPool_get_msg hands them out so this is O(1)
+  msgs[0].pPool = &pool->fifo;
+  initMpscFifo(&pool->fifo, &msgs[0]);
+  memset(pool->ret_counters, 0, sizeof(pool->ret_counters));
+  pool->fifo.pRetCounters = pool->ret_counters;
 
   DPF(LDR "MsgPool_init: pool=%p, pHead=%p, pTail=%p sizeof(*pool)=%lu(0x%lx)\n",
       ldr(), pool, pool->fifo.pHead, pool->fifo.pTail, sizeof(*pool), sizeof(*pool));
@@ -69,10 +66,25 @@ done:
     free(msgs);
     pool->msgs = NULL;
     pool->msg_count = 0;
+    pool->pUnused = NULL;
+    pool->pUnusedEnd = NULL;
   } else {
     pool->msgs = msgs;
     pool->msg_count = msg_count;
+    pool->pUnused = &msgs[1];
+    pool->pUnusedEnd = &msgs[msg_count + 1];
   }
+  pool->slab_msg_count = 0;
+  pool->low_watermark = 0;
+  pool->max_msg_count = 0;
+  pool->slabs = NULL;
+  pool->pScan = error ? NULL : pool->fifo.pTail;
+  pool->avail = 0;
+  pool->slab_count = 0;
+  pool->peak_msg_count = pool->msg_count;
+  pool->grow_count = 0;
+  pool->trim_count = 0;
+  pool->get_count = 0;
 
   DPF(LDR "MsgPool_init:-pool=%p msg_count=%u error=%u\n",
       ldr(), pool, msg_count, error);
@@ -80,51 +92,317 @@ done:
   return error;
 }
 
+/**
+ * Free the msgs and slabs, the pool must be quiescent.
+ */
+static uint64_t release(MsgPool_t* pool) {
+  DPF(LDR "release: pool=%p deinitMpscFifo fifo=%p\n", ldr(), pool, &pool->fifo);
+  uint64_t msgs_processed = deinitMpscFifo(&pool->fifo, NULL);
+
+  DPF(LDR "release: pool=%p free msgs=%p\n", ldr(), pool, pool->msgs);
+  free(pool->msgs);
+  pool->msgs = NULL;
+  pool->msg_count = 0;
+  pool->pUnused = NULL;
+  pool->pUnusedEnd = NULL;
+
+  while (pool->slabs != NULL) {
+    MsgPoolSlab_t* slab = pool->slabs;
+    pool->slabs = slab->pNext;
+    free(slab);
+  }
+  pool->slab_count = 0;
+  return msgs_processed;
+}
+
 uint64_t MsgPool_deinit(MsgPool_t* pool) {
   DPF(LDR "MsgPool_deinit:+pool=%p msgs=%p\n", ldr(), pool, pool->msgs);
   uint64_t msgs_processed = 0;
   if (pool->msgs != NULL) {
-    // Empty the pool
-    DPF(LDR "MsgPool_deinit: pool=%p pool->msg_count=%u\n", ldr(), pool, pool->msg_count);
-    for (uint32_t i = 0; i < pool->msg_count; i++) {
-      Msg_t* msg;
-
-      // Wait until this is returned
-      // TODO: Bug it may never be returned!
-      bool once = false;
-      while ((msg = RMV(&pool->fifo)) == NULL) {
-        if (!once) {
-          once = true;
-          printf(LDR "MsgPool_deinit: waiting for %u\n", ldr(), i);
-        }
-        sched_yield();
+    // Wait until every msg handed out is returned
+    bool once = false;
+    while (MsgPool_outstanding(pool) != 0) {
+      if (!once) {
+        once = true;
+        printf(LDR "MsgPool_deinit: waiting for %lu\n", ldr(), MsgPool_outstanding(pool));
       }
+      sched_yield();
+    }
+    msgs_processed = release(pool);
+  }
+  DPF(LDR "MsgPool_deinit:-pool=%p msgs_processed=%lu\n", ldr(), pool, msgs_processed);
+  return msgs_processed;
+}
 
-      DPF(LDR "MsgPool_deinit: removed %u msg=%p\n", ldr(), i, msg);
+/**
+ * @see msg_pool.h
+ */
+bool MsgPool_try_deinit(MsgPool_t* pool, uint64_t timeout_ns, uint64_t* pMsgsProcessed) {
+  if (pool->msgs != NULL) {
+    if (MsgPool_wait_quiescent(pool, timeout_ns)) {
+      return true;
+    }
+    uint64_t msgs_processed = release(pool);
+    if (pMsgsProcessed != NULL) {
+      *pMsgsProcessed = msgs_processed;
     }
+  }
+  return false;
+}
 
-    DPF(LDR "MsgPool_deinit: pool=%p deinitMpscFifo fifo=%p\n", ldr(), pool, &pool->fifo);
-    msgs_processed = deinitMpscFifo(&pool->fifo, NULL);
+/**
+ * @see msg_pool.h
+ */
+uint64_t MsgPool_outstanding(MsgPool_t* pool) {
+  uint64_t returned = 0;
+  for (uint32_t i = 0; i < MPSC_RET_SHARDS; i++) {
+    returned += __atomic_load_n(&pool->ret_counters[i].count, __ATOMIC_ACQUIRE);
+  }
+  return pool->get_count - returned;
+}
 
-    DPF(LDR "MsgPool_deinit: pool=%p free msgs=%p\n", ldr(), pool, pool->msgs);
-    free(pool->msgs);
-    pool->msgs = NULL;
-    pool->msg_count = 0;
+/**
+ * @see msg_pool.h
+ */
+bool MsgPool_wait_quiescent(MsgPool_t* pool, uint64_t timeout_ns) {
+  uint64_t time_start = ticks();
+  while (MsgPool_outstanding(pool) != 0) {
+    if (diff_ticks_ns(ticks(), time_start) >= (double)timeout_ns) {
+      DPF(LDR "MsgPool_wait_quiescent: pool=%p timed out outstanding=%lu\n",
+          ldr(), pool, MsgPool_outstanding(pool));
+      return true;
+    }
+    sched_yield();
+  }
+  return false;
+}
+
+/**
+ * @see msg_pool.h
+ */
+uint64_t MsgPool_find_holders(MsgPool_t* pool, MpscFifo_t** fifos, uint32_t fifo_count) {
+  uint64_t found = 0;
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    uint64_t held = 0;
+    for (Msg_t* msg = fifos[i]->pTail; msg != NULL;
+        msg = MPSC_LOAD(&msg->pNext, MPSC_ORD_LOAD_NEXT)) {
+      if (msg->pPool == &pool->fifo) {
+        held += 1;
+      }
+    }
+    if (held != 0) {
+      printf(LDR "MsgPool_find_holders: pool=%p fifo[%u]=%p holds %lu msgs\n",
+          ldr(), pool, i, fifos[i], held);
+    }
+    found += held;
+  }
+  return found;
+}
+
+/**
+ * Add a slab of slab_msg_count msgs to the pool with a single
+ * add_chain, only called by the thread getting msgs.
+ *
+ * @return true if the pool grew.
+ */
+static bool grow(MsgPool_t* pool) {
+  uint32_t count = pool->slab_msg_count;
+  if ((pool->max_msg_count != 0) && ((pool->msg_count + count) > pool->max_msg_count)) {
+    if (pool->msg_count >= pool->max_msg_count) {
+      return false;
+    }
+    count = pool->max_msg_count - pool->msg_count;
+  }
+
+  // The slab header is followed by the msgs aligned as MPSCFIFO_LAYOUT requires
+  size_t align = MPSC_MSG_ALIGN < sizeof(void*) ? sizeof(void*) : MPSC_MSG_ALIGN;
+  size_t hdr_size = (sizeof(MsgPoolSlab_t) + align - 1) & ~(align - 1);
+  MsgPoolSlab_t* slab;
+  if (posix_memalign((void**)&slab, align, hdr_size + (sizeof(Msg_t) * count)) != 0) {
+    DPF(LDR "grow: pool=%p unable to allocate slab of %u msgs\n", ldr(), pool, count);
+    return false;
+  }
+  slab->msgs = (Msg_t*)((uint8_t*)slab + hdr_size);
+  slab->msg_count = count;
+  slab->home = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    Msg_t* msg = &slab->msgs[i];
+    msg->pPool = &pool->fifo;
+    msg->pNext = (i + 1) < count ? &slab->msgs[i + 1] : NULL;
+  }
+  add_chain(&pool->fifo, &slab->msgs[0], &slab->msgs[count - 1]);
+
+  slab->pNext = pool->slabs;
+  pool->slabs = slab;
+  uint32_t msg_count = pool->msg_count + count;
+  __atomic_store_n(&pool->msg_count, msg_count, __ATOMIC_RELAXED);
+  __atomic_store_n(&pool->slab_count, pool->slab_count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&pool->grow_count, pool->grow_count + 1, __ATOMIC_RELAXED);
+  if (msg_count > pool->peak_msg_count) {
+    __atomic_store_n(&pool->peak_msg_count, msg_count, __ATOMIC_RELAXED);
+  }
+  TRACE(TRACE_POOL_GROW, &pool->fifo, slab, count, msg_count);
+  DPF(LDR "grow: pool=%p added %u msgs msg_count=%u\n", ldr(), pool, count, msg_count);
+  return true;
+}
+
+/**
+ * Follow the links after pScan until at least low_watermark msgs
+ * are known to be free, if they aren't grow the pool. Each get
+ * consumes one known msg so this is amortized to one load.
+ */
+static void check_watermark(MsgPool_t* pool) {
+  Msg_t* pNext;
+  while ((pool->avail < pool->low_watermark)
+      && ((pNext = MPSC_LOAD(&pool->pScan->pNext, MPSC_ORD_LOAD_NEXT)) != NULL)) {
+    pool->pScan = pNext;
+    pool->avail += 1;
+  }
+  if (pool->avail < pool->low_watermark) {
+    grow(pool);
   }
-  DPF(LDR "MsgPool_deinit:-pool=%p msgs_processed=%lu\n", ldr(), pool, msgs_processed);
-  return msgs_processed;
 }
 
 Msg_t* MsgPool_get_msg(MsgPool_t* pool) {
   DPF(LDR "MsgPool_get_msg:+pool=%p\n", ldr(), pool);
-  Msg_t* msg = RMV(&pool->fifo);
+  Msg_t* msg;
+  if (pool->pUnused != pool->pUnusedEnd) {
+    // Hand out the never used msgs first
+    msg = pool->pUnused++;
+    msg->pPool = &pool->fifo;
+  } else if (pool->slab_msg_count == 0) {
+    msg = RMV(&pool->fifo);
+  } else {
+    check_watermark(pool);
+    msg = RMV(&pool->fifo);
+    if ((msg == NULL) && grow(pool)) {
+      msg = RMV(&pool->fifo);
+    }
+    if (msg != NULL) {
+      if (pool->avail > 0) {
+        pool->avail -= 1;
+      } else {
+        // msg was pScan, the next free msg is the new tail
+        pool->pScan = pool->fifo.pTail;
+      }
+    }
+  }
   if (msg != NULL) {
+    pool->get_count += 1;
     msg->pRspQ = NULL;
     msg->arg1 = 0;
     msg->arg2 = 0;
+    msg->deadline = 0;
     DPF(LDR "MsgPool_get_msg: pool=%p got msg=%p pool=%p\n", ldr(), pool, msg, msg->pPool);
   }
   DPF(LDR "MsgPool_get_msg:-pool=%p msg=%p\n", ldr(), pool, msg);
   return msg;
 }
 
+
+bool MsgPool_init_elastic(MsgPool_t* pool, uint32_t msg_count,
+    uint32_t slab_msg_count, uint32_t low_watermark, uint32_t max_msg_count) {
+  DPF(LDR "MsgPool_init_elastic:+pool=%p msg_count=%u slab_msg_count=%u low_watermark=%u "
+      "max_msg_count=%u\n", ldr(), pool, msg_count, slab_msg_count, low_watermark, max_msg_count);
+  bool error = MsgPool_init(pool, msg_count);
+  if (!error) {
+    pool->slab_msg_count = slab_msg_count;
+    pool->low_watermark = low_watermark;
+    pool->max_msg_count = max_msg_count;
+  }
+  return error;
+}
+
+uint32_t MsgPool_trim(MsgPool_t* pool) {
+  uint32_t slabs_freed = 0;
+  uint32_t msgs_freed = 0;
+  Msg_t* pFirst = NULL;
+  Msg_t* pLast = NULL;
+
+  if (pool->slabs == NULL) {
+    return 0;
+  }
+
+  // Remove the free msgs counting how many of each slab are home
+  Msg_t* msg;
+  while ((msg = rmv_non_stalling(&pool->fifo)) != NULL) {
+    for (MsgPoolSlab_t* slab = pool->slabs; slab != NULL; slab = slab->pNext) {
+      if ((msg >= slab->msgs) && (msg < &slab->msgs[slab->msg_count])) {
+        slab->home += 1;
+        break;
+      }
+    }
+    msg->pNext = pFirst;
+    pFirst = msg;
+    if (pLast == NULL) {
+      pLast = msg;
+    }
+  }
+
+  // Unlink the slabs which are completely home
+  MsgPoolSlab_t* freed = NULL;
+  for (MsgPoolSlab_t** ppSlab = &pool->slabs; *ppSlab != NULL; ) {
+    MsgPoolSlab_t* slab = *ppSlab;
+    if (slab->home == slab->msg_count) {
+      *ppSlab = slab->pNext;
+      slab->pNext = freed;
+      freed = slab;
+    } else {
+      slab->home = 0;
+      ppSlab = &slab->pNext;
+    }
+  }
+
+  // Return the msgs which aren't in a freed slab
+  Msg_t* pKeepFirst = NULL;
+  Msg_t* pKeepLast = NULL;
+  for (msg = pFirst; msg != NULL; ) {
+    Msg_t* pNext = msg->pNext;
+    bool keep = true;
+    for (MsgPoolSlab_t* slab = freed; slab != NULL; slab = slab->pNext) {
+      if ((msg >= slab->msgs) && (msg < &slab->msgs[slab->msg_count])) {
+        keep = false;
+        break;
+      }
+    }
+    if (keep) {
+      msg->pNext = pKeepFirst;
+      pKeepFirst = msg;
+      if (pKeepLast == NULL) {
+        pKeepLast = msg;
+      }
+    }
+    msg = pNext;
+  }
+  if (pKeepFirst != NULL) {
+    add_chain(&pool->fifo, pKeepFirst, pKeepLast);
+  }
+
+  while (freed != NULL) {
+    MsgPoolSlab_t* slab = freed;
+    freed = slab->pNext;
+    msgs_freed += slab->msg_count;
+    slabs_freed += 1;
+    free(slab);
+  }
+
+  pool->pScan = pool->fifo.pTail;
+  pool->avail = 0;
+  if (slabs_freed != 0) {
+    __atomic_store_n(&pool->msg_count, pool->msg_count - msgs_freed, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->slab_count, pool->slab_count - slabs_freed, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->trim_count, pool->trim_count + 1, __ATOMIC_RELAXED);
+    TRACE(TRACE_POOL_TRIM, &pool->fifo, NULL, msgs_freed, pool->msg_count);
+  }
+  DPF(LDR "MsgPool_trim: pool=%p freed %u slabs %u msgs\n", ldr(), pool, slabs_freed, msgs_freed);
+  return slabs_freed;
+}
+
+void MsgPool_get_stats(MsgPool_t* pool, MsgPoolStats_t* stats) {
+  stats->msg_count = __atomic_load_n(&pool->msg_count, __ATOMIC_RELAXED);
+  stats->slab_count = __atomic_load_n(&pool->slab_count, __ATOMIC_RELAXED);
+  stats->peak_msg_count = __atomic_load_n(&pool->peak_msg_count, __ATOMIC_RELAXED);
+  stats->grow_count = __atomic_load_n(&pool->grow_count, __ATOMIC_RELAXED);
+  stats->trim_count = __atomic_load_n(&pool->trim_count, __ATOMIC_RELAXED);
+}
@@ -1,5 +1,21 @@
 /**
  * This software is released into the public domain.
+ *
+ * A MsgPool_t is a fifo of free Msg_t's. Any thread may return a
+ * msg with ret_msg but only one thread may get them.
+ *
+ * The initial msgs aren't linked at init, MsgPool_get_msg bumps
+ * pUnused through them before it removes returned msgs from the
+ * fifo so MsgPool_init is O(1) and pages are touched on first use.
+ *
+ * ret_msg counts returns in sharded counters, the getter counts the
+ * msgs handed out so MsgPool_outstanding is cheap and teardown can
+ * wait with a deadline rather than removing every msg.
+ *
+ * An elastic pool, see MsgPool_init_elastic, grows by adding
+ * slabs of slab_msg_count msgs when fewer than low_watermark msgs
+ * are known to be free and MsgPool_trim frees grown slabs when all
+ * of their msgs are back in the pool.
  */
 
 #ifndef _MSG_POOL_H
@@ -11,14 +27,111 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MsgPoolSlab_t MsgPoolSlab_t;
+
+typedef struct MsgPoolSlab_t {
+  MsgPoolSlab_t* pNext;
+  Msg_t* msgs;
+  uint32_t msg_count;
+  uint32_t home;        // Used by MsgPool_trim
+} MsgPoolSlab_t;
+
+typedef struct MsgPoolStats_t {
+  uint32_t msg_count;   // Current number of msgs
+  uint32_t slab_count;  // Current number of grown slabs
+  uint32_t peak_msg_count;
+  uint64_t grow_count;
+  uint64_t trim_count;
+} MsgPoolStats_t;
+
 typedef struct MsgPool_t {
   Msg_t* msgs;
   uint32_t msg_count;
   MpscFifo_t fifo;
+  Msg_t* pUnused;           // Next never used msg
+  Msg_t* pUnusedEnd;
+
+  // Elastic growth, slab_msg_count == 0 for a fixed size pool.
+  // Only the thread getting msgs modifies these, the counts are
+  // atomic so MsgPool_get_stats may be called by any thread.
+  uint32_t slab_msg_count;
+  uint32_t low_watermark;
+  uint32_t max_msg_count;   // 0 is unlimited
+  MsgPoolSlab_t* slabs;
+  Msg_t* pScan;             // Last msg known to be linked after fifo.pTail
+  uint32_t avail;           // Number of msgs known to be linked after fifo.pTail
+  ATOMIC(uint32_t) slab_count;
+  ATOMIC(uint32_t) peak_msg_count;
+  ATOMIC(uint64_t) grow_count;
+  ATOMIC(uint64_t) trim_count;
+
+  uint64_t get_count;       // Only modified by the thread getting msgs
+  MpscRetCounter_t ret_counters[MPSC_RET_SHARDS];
 } MsgPool_t;
 
 bool MsgPool_init(MsgPool_t* pool, uint32_t msg_count);
 uint64_t MsgPool_deinit(MsgPool_t* pool);
 Msg_t* MsgPool_get_msg(MsgPool_t* pool);
 
+/**
+ * Deinit the pool if all msgs are returned within timeout_ns,
+ * *pMsgsProcessed, which may be NULL, is the pools msgs_processed.
+ *
+ * @return true if msgs are still outstanding and the pool is intact.
+ */
+bool MsgPool_try_deinit(MsgPool_t* pool, uint64_t timeout_ns, uint64_t* pMsgsProcessed);
+
+/**
+ * Return the number of msgs handed out which haven't been returned,
+ * only the thread getting msgs may call this.
+ */
+uint64_t MsgPool_outstanding(MsgPool_t* pool);
+
+/**
+ * Wait up to timeout_ns for every msg to be returned.
+ *
+ * @return true if timed out.
+ */
+bool MsgPool_wait_quiescent(MsgPool_t* pool, uint64_t timeout_ns);
+
+/**
+ * Walk the fifos printing how many of the pools msgs each holds,
+ * typically after MsgPool_wait_quiescent timed out. The fifos must
+ * not be modified while this runs.
+ *
+ * @return total number of the pools msgs found.
+ */
+uint64_t MsgPool_find_holders(MsgPool_t* pool, MpscFifo_t** fifos, uint32_t fifo_count);
+
+/**
+ * Initialize an elastic pool of msg_count msgs which grows by
+ * slab_msg_count msgs, up to max_msg_count, when fewer than
+ * low_watermark free msgs remain.
+ *
+ * @return true if an error.
+ */
+bool MsgPool_init_elastic(MsgPool_t* pool, uint32_t msg_count,
+    uint32_t slab_msg_count, uint32_t low_watermark, uint32_t max_msg_count);
+
+/**
+ * Free the grown slabs whose msgs are all in the pool, only the
+ * thread getting msgs may call this, typically when idle.
+ *
+ * @return number of slabs freed.
+ */
+uint32_t MsgPool_trim(MsgPool_t* pool);
+
+/**
+ * Return the pools statistics, may be called by any thread.
+ */
+void MsgPool_get_stats(MsgPool_t* pool, MsgPoolStats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,80 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "payload.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @see payload.h
+ */
+bool ByteRing_init(ByteRing_t* r, uint64_t capacity) {
+  if ((capacity < (2 * sizeof(PayloadHdr_t))) || (capacity > UINT32_MAX) || ((capacity & 7) != 0)) {
+    printf(LDR "ByteRing_init: ERROR r=%p capacity=%lu must be a multiple of 8, >= %lu and < 4G\n",
+        ldr(), r, capacity, 2 * sizeof(PayloadHdr_t));
+    return true;
+  }
+  if (posix_memalign((void**)&r->buf, 64, capacity) != 0) {
+    printf(LDR "ByteRing_init: ERROR r=%p unable to allocate capacity=%lu\n",
+        ldr(), r, capacity);
+    return true;
+  }
+  r->capacity = capacity;
+  r->head = 0;
+  r->tail_cache = 0;
+  r->tail = 0;
+  return false;
+}
+
+/**
+ * @see payload.h
+ */
+void ByteRing_deinit(ByteRing_t* r) {
+  free(r->buf);
+  r->buf = NULL;
+  r->capacity = 0;
+}
+
+/**
+ * @see payload.h
+ */
+void* ByteRing_reserve(ByteRing_t* r, uint32_t len) {
+  uint64_t need = sizeof(PayloadHdr_t) + (((uint64_t)len + 7) & ~7ull);
+  uint64_t offset = r->head % r->capacity;
+  uint64_t skip = 0;
+  if (offset + need > r->capacity) {
+    // Doesn't fit before the end, start at the beginning
+    skip = r->capacity - offset;
+    offset = 0;
+  }
+  uint64_t size = skip + need;
+  if (size > r->capacity) {
+    return NULL;
+  }
+  if (r->head + size - r->tail_cache > r->capacity) {
+    r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (r->head + size - r->tail_cache > r->capacity) {
+      return NULL;
+    }
+  }
+  PayloadHdr_t* hdr = (PayloadHdr_t*)(r->buf + offset);
+  hdr->ring = r;
+  hdr->len = len;
+  hdr->size = (uint32_t)size;
+  r->head += size;
+  return hdr + 1;
+}
@@ -0,0 +1,88 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Variable length payloads sent by reference without an allocator.
+ *
+ * Each producer has its own ByteRing_t. It reserves len bytes with
+ * ByteRing_reserve, writes them in place and sends a msg with the
+ * payload's address in arg2. The consumer reads the payload and
+ * calls ByteRing_release which finds the ring from the payload's
+ * header and advances its reclaim position.
+ *
+ * A reservation is always contiguous, like a bip buffer when it
+ * won't fit before the end of the ring the remainder is skipped and
+ * it starts at the beginning. Payloads must be released in the order
+ * they were reserved, which they are when a ring's payloads are sent
+ * to one fifo and its consumer releases each before the next.
+ */
+
+#ifndef _PAYLOAD_H
+#define _PAYLOAD_H
+
+#include "mpscfifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ByteRing_t ByteRing_t;
+
+typedef struct PayloadHdr_t {
+  ByteRing_t* ring;
+  uint32_t len;             // Bytes requested
+  uint32_t size;            // Bytes this payload and any skipped before it uses
+} PayloadHdr_t;
+
+typedef struct ByteRing_t {
+  uint8_t* buf;
+  uint64_t capacity;
+  uint64_t head;            // Next reserve, only the producer uses it
+  uint64_t tail_cache;      // The producer's last read of tail
+  ATOMIC(uint64_t) tail __attribute__(( aligned (64) ));  // Released up to, written by the consumer
+} ByteRing_t;
+
+/**
+ * Initialize r with capacity bytes, a multiple of 8 less than 4G.
+ *
+ * @return true if an error.
+ */
+bool ByteRing_init(ByteRing_t* r, uint64_t capacity);
+
+/**
+ * Deinitialize r, all of its payloads must have been released.
+ */
+void ByteRing_deinit(ByteRing_t* r);
+
+/**
+ * Reserve len bytes, 8 byte aligned, only the producer may reserve.
+ *
+ * @return the payload or NULL if there isn't room until the consumer
+ * releases more.
+ */
+void* ByteRing_reserve(ByteRing_t* r, uint32_t len);
+
+/**
+ * Return the len payload was reserved with.
+ */
+static inline uint32_t ByteRing_len(const void* payload) {
+  return ((const PayloadHdr_t*)payload - 1)->len;
+}
+
+/**
+ * Release payload back to its ring.
+ */
+static inline void ByteRing_release(void* payload) {
+  PayloadHdr_t* hdr = (PayloadHdr_t*)payload - 1;
+  ByteRing_t* r = hdr->ring;
+  __atomic_store_n(&r->tail, __atomic_load_n(&r->tail, __ATOMIC_RELAXED) + hdr->size,
+      __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
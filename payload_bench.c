@@ -0,0 +1,211 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Compare sending payloads from 64 B to 64 KB in malloc'd buffers,
+ * freed by the consumer, with sending them in each producer's
+ * ByteRing_t, see payload.h.
+ *
+ * Each producer fills msg_count payloads of a size and sends them
+ * to one consumer, at most window outstanding. The consumer checks
+ * the first and last 8 bytes and frees or releases each.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "payload.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MODE_MALLOC 0
+#define MODE_RING   1
+
+#define MIN_PAYLOAD 64
+#define MAX_PAYLOAD (64 * 1024)
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Producer {
+  pthread_t thread;
+  MpscFifo_t* fifo;
+  MsgPool_t pool;
+  ByteRing_t ring;
+  uint32_t idx;
+  uint32_t mode;
+  uint32_t len;
+  uint64_t msg_count;
+  uint64_t ring_full;
+} Producer;
+
+static void* producer(void* p) {
+  Producer* prod = (Producer*)p;
+
+  for (uint64_t i = 0; i < prod->msg_count; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&prod->pool)) == NULL) {
+      sched_yield();
+    }
+    uint8_t* payload;
+    if (prod->mode == MODE_RING) {
+      while ((payload = ByteRing_reserve(&prod->ring, prod->len)) == NULL) {
+        prod->ring_full += 1;
+        sched_yield();
+      }
+    } else {
+      payload = malloc(prod->len);
+    }
+    uint64_t stamp = ((uint64_t)prod->idx << 32) | (i & 0xffffffff);
+    memset(payload, (int)i, prod->len);
+    memcpy(payload, &stamp, sizeof(stamp));
+    memcpy(payload + prod->len - sizeof(stamp), &stamp, sizeof(stamp));
+    msg->arg1 = prod->len;
+    msg->arg2 = (uint64_t)payload;
+    add(prod->fifo, msg);
+  }
+  return NULL;
+}
+
+bool run(uint32_t mode, uint32_t producer_count, uint32_t len, uint64_t msg_count,
+    uint32_t window, uint64_t ring_bytes) {
+  bool error = false;
+  MsgPool_t stubs;
+  MpscFifo_t fifo;
+
+  Producer* producers = calloc(producer_count, sizeof(Producer));
+  if (producers == NULL) {
+    printf(LDR "run: ERROR unable to allocate\n", ldr());
+    return true;
+  }
+  if (MsgPool_init(&stubs, 1)) {
+    printf(LDR "run: ERROR unable to create stubs pool\n", ldr());
+    return true;
+  }
+  initMpscFifo(&fifo, MsgPool_get_msg(&stubs));
+
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < producer_count; i++) {
+    Producer* prod = &producers[i];
+    // One more as the last msg received is left as the fifo's stub
+    if (MsgPool_init(&prod->pool, window + 1)
+        || ((mode == MODE_RING) && ByteRing_init(&prod->ring, ring_bytes))) {
+      printf(LDR "run: ERROR unable to create producer pool or ring\n", ldr());
+      return true;
+    }
+    prod->fifo = &fifo;
+    prod->idx = i;
+    prod->mode = mode;
+    prod->len = len;
+    prod->msg_count = msg_count;
+    pthread_create(&prod->thread, NULL, producer, prod);
+  }
+
+  uint64_t expected = msg_count * producer_count;
+  uint64_t received = 0;
+  uint64_t bad = 0;
+  while (received < expected) {
+    Msg_t* msg = rmv(&fifo);
+    if (msg == NULL) {
+      sched_yield();
+      continue;
+    }
+    uint8_t* payload = (uint8_t*)msg->arg2;
+    uint64_t first;
+    uint64_t last;
+    memcpy(&first, payload, sizeof(first));
+    memcpy(&last, payload + msg->arg1 - sizeof(last), sizeof(last));
+    if (first != last) {
+      bad += 1;
+    }
+    if (mode == MODE_RING) {
+      ByteRing_release(payload);
+    } else {
+      free(payload);
+    }
+    received += 1;
+    ret_msg(msg);
+  }
+  uint64_t ring_full = 0;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+    ring_full += producers[i].ring_full;
+  }
+  uint64_t time_stop = ticks_serialized();
+
+  deinitMpscFifo(&fifo, NULL);
+  for (uint32_t i = 0; i < producer_count; i++) {
+    MsgPool_deinit(&producers[i].pool);
+    if (mode == MODE_RING) {
+      ByteRing_deinit(&producers[i].ring);
+    }
+  }
+  MsgPool_deinit(&stubs);
+
+  if (bad != 0) {
+    printf(LDR "run: ERROR len=%u bad=%lu\n", ldr(), len, bad);
+    error = true;
+  }
+
+  double ns = diff_ticks_ns(time_stop, time_start);
+  printf("%-6s len=%-6u msgs_per_sec=%.0f mb_per_sec=%.1f ring_full=%lu\n",
+      mode == MODE_RING ? "ring" : "malloc", len, (double)received * ns_flt / ns,
+      ((double)received * len * ns_flt / ns) / (1024.0 * 1024.0), ring_full);
+
+  free(producers);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 5) {
+    printf("Usage:\n");
+    printf(" %s producer_count msg_count window ring_kb\n", argv[0]);
+    printf("  each producer sends msg_count payloads of each size from %u to %u bytes,\n",
+        MIN_PAYLOAD, MAX_PAYLOAD);
+    printf("  malloc'd or from a ring_kb ring, with at most window outstanding\n");
+    return 1;
+  }
+
+  u_int32_t producer_count;
+  sscanf(argv[1], "%u", &producer_count);
+  u_int64_t msg_count;
+  sscanf(argv[2], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[3], "%u", &window);
+  u_int64_t ring_kb;
+  sscanf(argv[4], "%lu", &ring_kb);
+  printf("payload_bench producer_count=%u msg_count=%lu window=%u ring_kb=%lu\n",
+      producer_count, msg_count, window, ring_kb);
+
+  if ((producer_count == 0) || (msg_count == 0) || (window == 0)
+      || (ring_kb * 1024 < MAX_PAYLOAD + sizeof(PayloadHdr_t))) {
+    printf("producer_count, msg_count and window must be > 0 and ring_kb > %u\n",
+        MAX_PAYLOAD / 1024);
+    return 1;
+  }
+
+  error |= timing_init();
+  for (uint32_t len = MIN_PAYLOAD; len <= MAX_PAYLOAD; len *= 4) {
+    error |= run(MODE_MALLOC, producer_count, len, msg_count, window, ring_kb * 1024);
+    error |= run(MODE_RING, producer_count, len, msg_count, window, ring_kb * 1024);
+  }
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
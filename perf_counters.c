@@ -0,0 +1,187 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "perf_counters.h"
+#include "dpf.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char* names[PC_COUNT] = {
+  [PC_CYCLES] = "cycles",
+  [PC_INSTRUCTIONS] = "instructions",
+  [PC_LLC_MISSES] = "llc_misses",
+  [PC_HITM] = "hitm",
+  [PC_CTX_SWITCHES] = "ctx_switches",
+};
+
+static int perf_event_open(struct perf_event_attr* attr, pid_t tid, int group_fd) {
+  return (int)syscall(SYS_perf_event_open, attr, tid, -1, group_fd, 0);
+}
+
+/**
+ * Initialize attr for counter idx, returns false if there is
+ * no event for idx on this system.
+ */
+static bool init_attr(struct perf_event_attr* attr, uint32_t idx) {
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+  attr->read_format = PERF_FORMAT_GROUP
+      | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  switch (idx) {
+    case PC_CYCLES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      return true;
+    case PC_INSTRUCTIONS:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      return true;
+    case PC_LLC_MISSES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CACHE_MISSES;
+      return true;
+    case PC_HITM: {
+      // HITM isn't a generic event, allow the model specific raw
+      // encoding to be supplied otherwise count remote node misses.
+      const char* raw = getenv("PERF_HITM_RAW");
+      if (raw != NULL) {
+        attr->type = PERF_TYPE_RAW;
+        attr->config = strtoull(raw, NULL, 0);
+      } else {
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_NODE
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      }
+      return true;
+    }
+    case PC_CTX_SWITCHES:
+      // Switches happen in the kernel, excluding it counts nothing
+      attr->type = PERF_TYPE_SOFTWARE;
+      attr->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+      attr->exclude_kernel = 0;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * @see perf_counters.h
+ */
+bool PerfCounters_open(PerfCounters_t* pc, pid_t tid) {
+  pc->leader = -1;
+  pc->nr = 0;
+  for (uint32_t i = 0; i < PC_COUNT; i++) {
+    struct perf_event_attr attr;
+
+    pc->fds[i] = -1;
+    pc->pos[i] = 0;
+    if (!init_attr(&attr, i)) {
+      continue;
+    }
+    if (pc->leader == -1) {
+      // The group is created disabled and enabled once complete
+      attr.disabled = 1;
+    }
+    int fd = perf_event_open(&attr, tid, pc->leader);
+    if (fd == -1) {
+      DPF("PerfCounters_open: tid=%d %s not available errno=%d\n", tid, names[i], errno);
+      continue;
+    }
+    if (pc->leader == -1) {
+      pc->leader = fd;
+    }
+    pc->fds[i] = fd;
+    pc->pos[i] = pc->nr++;
+  }
+
+  if (pc->leader == -1) {
+    printf("PerfCounters_open: tid=%d ERROR no counters available\n", tid);
+    return true;
+  }
+  ioctl(pc->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(pc->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return false;
+}
+
+/**
+ * @see perf_counters.h
+ */
+bool PerfCounters_read(PerfCounters_t* pc, PerfSample_t* sample) {
+  // nr, time_enabled, time_running, values[nr]
+  uint64_t buf[3 + PC_COUNT];
+
+  if (pc->leader == -1) {
+    return true;
+  }
+  ssize_t len = read(pc->leader, buf, sizeof(buf));
+  if ((len < (ssize_t)(3 * sizeof(uint64_t))) || (buf[0] != pc->nr)) {
+    return true;
+  }
+
+  uint64_t enabled = buf[1];
+  uint64_t running = buf[2];
+  for (uint32_t i = 0; i < PC_COUNT; i++) {
+    if (pc->fds[i] != -1) {
+      uint64_t value = buf[3 + pc->pos[i]];
+      if ((running != 0) && (running < enabled)) {
+        // The group was multiplexed, scale to the enabled time
+        value = (uint64_t)((double)value * ((double)enabled / (double)running));
+      }
+      sample->valid[i] = true;
+      sample->values[i] += value;
+    }
+  }
+  return false;
+}
+
+/**
+ * @see perf_counters.h
+ */
+void PerfCounters_close(PerfCounters_t* pc) {
+  for (uint32_t i = 0; i < PC_COUNT; i++) {
+    if ((pc->fds[i] != -1) && (pc->fds[i] != pc->leader)) {
+      close(pc->fds[i]);
+    }
+    pc->fds[i] = -1;
+  }
+  if (pc->leader != -1) {
+    close(pc->leader);
+    pc->leader = -1;
+  }
+  pc->nr = 0;
+}
+
+/**
+ * @see perf_counters.h
+ */
+const char* PerfCounters_name(uint32_t idx) {
+  return idx < PC_COUNT ? names[idx] : "unknown";
+}
+
+/**
+ * @see perf_counters.h
+ */
+void PerfSample_clear(PerfSample_t* sample) {
+  memset(sample, 0, sizeof(*sample));
+}
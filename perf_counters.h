@@ -0,0 +1,67 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Per thread hardware performance counters via perf_event_open.
+ *
+ * A PerfCounters_t is a group of counters attached to one thread,
+ * counters the kernel or cpu doesn't support are skipped and are
+ * reported as not valid.
+ */
+
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PC_CYCLES        0
+#define PC_INSTRUCTIONS  1
+#define PC_LLC_MISSES    2
+#define PC_HITM          3 // Raw event from $PERF_HITM_RAW else remote node misses
+#define PC_CTX_SWITCHES  4
+#define PC_COUNT         5
+
+typedef struct PerfCounters_t {
+  int leader;           // fd of the group leader or -1
+  int fds[PC_COUNT];    // fd of each counter or -1
+  uint32_t nr;          // Number of counters opened
+  uint32_t pos[PC_COUNT]; // Position of each counter in a group read
+} PerfCounters_t;
+
+typedef struct PerfSample_t {
+  bool valid[PC_COUNT];
+  uint64_t values[PC_COUNT];
+} PerfSample_t;
+
+/**
+ * Open the counters for thread tid, 0 is the calling thread.
+ *
+ * @return true if an error, i.e. no counter could be opened.
+ */
+bool PerfCounters_open(PerfCounters_t* pc, pid_t tid);
+
+/**
+ * Read the counters scaling for any multiplexing and add the
+ * values to sample.
+ *
+ * @return true if an error.
+ */
+bool PerfCounters_read(PerfCounters_t* pc, PerfSample_t* sample);
+
+/**
+ * Close the counters.
+ */
+void PerfCounters_close(PerfCounters_t* pc);
+
+/**
+ * Return the name of counter idx.
+ */
+const char* PerfCounters_name(uint32_t idx);
+
+/**
+ * Clear a sample
+ */
+void PerfSample_clear(PerfSample_t* sample);
+
+#endif
@@ -0,0 +1,211 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "pipeline.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @see pipeline.h
+ */
+void Pipeline_init(Pipeline_t* p, uint32_t batch) {
+  memset(p, 0, sizeof(*p));
+  p->batch = batch != 0 ? batch : 1;
+}
+
+/**
+ * @see pipeline.h
+ */
+bool Pipeline_add_stage(Pipeline_t* p, const char* name, PipeHandler_t handler, void* ctx) {
+  if (p->stage_count >= PIPE_MAX_STAGES) {
+    printf(LDR "Pipeline_add_stage: ERROR p=%p more than PIPE_MAX_STAGES=%u\n",
+        ldr(), p, PIPE_MAX_STAGES);
+    return true;
+  }
+  PipeStage_t* s = &p->stages[p->stage_count++];
+  s->name = name;
+  s->handler = handler;
+  s->ctx = ctx;
+  s->msgs = 0;
+  s->ticks = 0;
+  return false;
+}
+
+/**
+ * @see pipeline.h
+ */
+double Pipeline_stage_ns(Pipeline_t* p, uint32_t stage) {
+  PipeStage_t* s = &p->stages[stage];
+  uint64_t msgs = __atomic_load_n(&s->msgs, __ATOMIC_RELAXED);
+  uint64_t ticks = __atomic_load_n(&s->ticks, __ATOMIC_RELAXED);
+  return msgs != 0 ? ticks_to_ns(ticks) / (double)msgs : 0.0;
+}
+
+/**
+ * @see pipeline.h
+ */
+void Pipeline_clear_stats(Pipeline_t* p) {
+  for (uint32_t i = 0; i < p->stage_count; i++) {
+    p->stages[i].msgs = 0;
+    p->stages[i].ticks = 0;
+  }
+}
+
+/**
+ * @see pipeline.h
+ */
+uint64_t Pipeline_plan(Pipeline_t* p, double hop_ns) {
+  uint64_t fuse = 0;
+  double thread_ns = Pipeline_stage_ns(p, 0);
+  for (uint32_t i = 1; i < p->stage_count; i++) {
+    double ns = Pipeline_stage_ns(p, i);
+    if ((ns < hop_ns) && (thread_ns + ns < hop_ns)) {
+      fuse |= 1ull << i;
+      thread_ns += ns;
+    } else {
+      thread_ns = ns;
+    }
+  }
+  return fuse;
+}
+
+/**
+ * Remove up to batch msgs, run them through this thread's stages
+ * then pass what's left on
+ */
+static void* stage_thread(void* param) {
+  PipeThread_t* t = (PipeThread_t*)param;
+  Pipeline_t* p = t->pipe;
+  PipeThread_t* next = t + 1 < &p->threads[p->thread_count] ? t + 1 : NULL;
+
+  while (true) {
+    uint32_t n = 0;
+    Msg_t* msg;
+    while ((n < p->batch) && ((msg = rmv(&t->fifo)) != NULL)) {
+      t->batch[n++] = msg;
+    }
+    if (n == 0) {
+      if (__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE) != 0) {
+        // Check again as the msgs may have been added before stop
+        if ((msg = rmv(&t->fifo)) == NULL) {
+          break;
+        }
+        t->batch[n++] = msg;
+      } else {
+        sched_yield();
+        continue;
+      }
+    }
+
+    for (uint32_t i = t->first; (i < t->first + t->count) && (n != 0); i++) {
+      PipeStage_t* s = &p->stages[i];
+      uint32_t kept = 0;
+      uint64_t start = ticks();
+      for (uint32_t j = 0; j < n; j++) {
+        if (s->handler(s->ctx, t->batch[j])) {
+          t->batch[kept++] = t->batch[j];
+        }
+      }
+      uint64_t stop = ticks();
+      __atomic_store_n(&s->ticks, s->ticks + (stop - start), __ATOMIC_RELAXED);
+      __atomic_store_n(&s->msgs, s->msgs + n, __ATOMIC_RELAXED);
+      n = kept;
+    }
+
+    if (n == 0) {
+      continue;
+    }
+    if (next != NULL) {
+      for (uint32_t j = 0; j + 1 < n; j++) {
+        MPSC_STORE(&t->batch[j]->pNext, t->batch[j + 1], __ATOMIC_RELAXED);
+      }
+      add_chain(&next->fifo, t->batch[0], t->batch[n - 1]);
+    } else {
+      for (uint32_t j = 0; j < n; j++) {
+        send_rsp_or_ret(t->batch[j], t->batch[j]->arg1);
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @see pipeline.h
+ */
+bool Pipeline_start(Pipeline_t* p, uint64_t fuse) {
+  if (p->stage_count == 0) {
+    printf(LDR "Pipeline_start: ERROR p=%p has no stages\n", ldr(), p);
+    return true;
+  }
+  uint32_t thread_count = 1;
+  for (uint32_t i = 1; i < p->stage_count; i++) {
+    thread_count += (fuse & (1ull << i)) != 0 ? 0 : 1;
+  }
+  if (posix_memalign((void**)&p->threads, 64, thread_count * sizeof(PipeThread_t)) != 0) {
+    printf(LDR "Pipeline_start: ERROR p=%p unable to allocate threads\n", ldr(), p);
+    return true;
+  }
+  memset(p->threads, 0, thread_count * sizeof(PipeThread_t));
+  p->thread_count = thread_count;
+
+  uint32_t stage = 0;
+  for (uint32_t i = 0; i < thread_count; i++) {
+    PipeThread_t* t = &p->threads[i];
+    t->pipe = p;
+    t->first = stage;
+    do {
+      stage += 1;
+    } while ((stage < p->stage_count) && ((fuse & (1ull << stage)) != 0));
+    t->count = stage - t->first;
+    t->batch = malloc(p->batch * sizeof(Msg_t*));
+    if ((t->batch == NULL) || MsgPool_init(&t->stubs, 1)) {
+      printf(LDR "Pipeline_start: ERROR p=%p unable to allocate thread %u\n", ldr(), p, i);
+      return true;
+    }
+    initMpscFifo(&t->fifo, MsgPool_get_msg(&t->stubs));
+  }
+  for (uint32_t i = 0; i < thread_count; i++) {
+    pthread_create(&p->threads[i].thread, NULL, stage_thread, &p->threads[i]);
+  }
+  return false;
+}
+
+/**
+ * @see pipeline.h
+ */
+void Pipeline_stop(Pipeline_t* p) {
+  // In order, each thread has passed on all of its msgs when it exits
+  for (uint32_t i = 0; i < p->thread_count; i++) {
+    __atomic_store_n(&p->threads[i].stop, 1, __ATOMIC_RELEASE);
+    pthread_join(p->threads[i].thread, NULL);
+  }
+
+  // The fifos first as their stubs may belong to any pool
+  for (uint32_t i = 0; i < p->thread_count; i++) {
+    deinitMpscFifo(&p->threads[i].fifo, NULL);
+  }
+  for (uint32_t i = 0; i < p->thread_count; i++) {
+    MsgPool_deinit(&p->threads[i].stubs);
+    free(p->threads[i].batch);
+  }
+  free(p->threads);
+  p->threads = NULL;
+  p->thread_count = 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A chain of stages, each a handler run on every msg, connected by
+ * MpscFifo_t's.
+ *
+ * Stages are added in order then Pipeline_start runs them, by
+ * default each on its own thread. A thread removes up to batch msgs,
+ * runs each of its stages over the whole batch and hands the msgs
+ * that are left to the next thread with one add_chain. Msgs leaving
+ * the last stage are sent with send_rsp_or_ret.
+ *
+ * The time each stage's handler takes is measured per batch. When it
+ * costs less than a hop between threads adjacent stages can be fused,
+ * run on one thread, Pipeline_plan chooses which from the measured
+ * costs and Pipeline_start takes the choice. The pipeline must be
+ * stopped to change it.
+ *
+ * As with any fifo, after rmv a thread's stub is the last msg it
+ * removed, so a pool sending msgs through the pipeline may have one
+ * msg per thread held until it's stopped.
+ */
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIPE_MAX_STAGES 32
+
+/**
+ * Handle msg, return true to pass it to the next stage or false if
+ * the handler has taken it, i.e. returned it to its pool.
+ */
+typedef bool (*PipeHandler_t)(void* ctx, Msg_t* msg);
+
+typedef struct PipeStage_t {
+  const char* name;
+  PipeHandler_t handler;
+  void* ctx;
+  uint64_t msgs;            // Handled, written by the stage's thread
+  uint64_t ticks;           // In the handler, written by the stage's thread
+} PipeStage_t;
+
+typedef struct Pipeline_t Pipeline_t;
+
+typedef struct PipeThread_t {
+  MpscFifo_t fifo;          // Input of the first stage on this thread
+  pthread_t thread;
+  Pipeline_t* pipe;
+  uint32_t first;           // Stages first .. first + count - 1 run on this thread
+  uint32_t count;
+  Msg_t** batch;
+  MsgPool_t stubs;          // Only for the fifo's stub
+  ATOMIC(uint32_t) stop;
+} PipeThread_t;
+
+typedef struct Pipeline_t {
+  PipeStage_t stages[PIPE_MAX_STAGES];
+  uint32_t stage_count;
+  uint32_t batch;
+  PipeThread_t* threads;
+  uint32_t thread_count;
+} Pipeline_t;
+
+/**
+ * Initialize an empty pipeline which passes up to batch msgs at once.
+ */
+void Pipeline_init(Pipeline_t* p, uint32_t batch);
+
+/**
+ * Add a stage which calls handler with ctx for each msg.
+ *
+ * @return true if there are already PIPE_MAX_STAGES.
+ */
+bool Pipeline_add_stage(Pipeline_t* p, const char* name, PipeHandler_t handler, void* ctx);
+
+/**
+ * Return a fuse mask, see Pipeline_start, fusing each stage with the
+ * one before while its measured cost per msg, and the total of the
+ * stages on that thread, is less than hop_ns.
+ */
+uint64_t Pipeline_plan(Pipeline_t* p, double hop_ns);
+
+/**
+ * Start a thread for each group of fused stages. Bit i of fuse set
+ * runs stage i on the same thread as stage i - 1, 0 runs every stage
+ * on its own thread.
+ *
+ * @return true if an error.
+ */
+bool Pipeline_start(Pipeline_t* p, uint64_t fuse);
+
+/**
+ * Send msg to the first stage, may be used by multiple producers.
+ */
+static inline void Pipeline_send(Pipeline_t* p, Msg_t* msg) {
+  add(&p->threads[0].fifo, msg);
+}
+
+/**
+ * Stop the threads after they've handled every msg already sent.
+ * Msgs the last stage sent to a response fifo must have been
+ * returned, they may belong to the pipeline's stub pools.
+ */
+void Pipeline_stop(Pipeline_t* p);
+
+/**
+ * Return the measured ns per msg of stage, 0 if it's handled none.
+ */
+double Pipeline_stage_ns(Pipeline_t* p, uint32_t stage);
+
+/**
+ * Clear the measured costs.
+ */
+void Pipeline_clear_stats(Pipeline_t* p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
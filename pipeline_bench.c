@@ -0,0 +1,190 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Compare running each stage of a pipeline, see pipeline.h, on its
+ * own thread with fusing them onto one and with Pipeline_plan, for
+ * chains of 2 to 8 stages.
+ *
+ * Each stage spins work_ns per msg and counts it in arg2, the last
+ * stage checks every msg passed each stage in the order sent. The hop
+ * cost given to Pipeline_plan is measured first as the difference per
+ * hop between an 8 stage chain of empty stages split and fused.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "pipeline.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_STAGES 2
+#define MAX_STAGES 8
+
+#define FUSE_NONE 0ull
+#define FUSE_ALL  (~0ull)
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct StageCtx {
+  uint64_t work_ns;
+  uint32_t idx;
+  bool last;
+  uint64_t next_seq;        // Only the last stage checks
+  uint64_t errors;
+} StageCtx;
+
+static bool stage(void* ctx, Msg_t* msg) {
+  StageCtx* c = (StageCtx*)ctx;
+  spin_ns(c->work_ns);
+  msg->arg2 += 1;
+  if (c->last) {
+    if ((msg->arg1 != c->next_seq) || (msg->arg2 != c->idx + 1)) {
+      c->errors += 1;
+    }
+    c->next_seq = msg->arg1 + 1;
+  }
+  return true;
+}
+
+/**
+ * Print which stages share a thread, i.e. 0+1|2
+ */
+static void print_groups(uint32_t stage_count, uint64_t fuse) {
+  for (uint32_t i = 0; i < stage_count; i++) {
+    if (i != 0) {
+      printf("%c", (fuse & (1ull << i)) != 0 ? '+' : '|');
+    }
+    printf("%u", i);
+  }
+}
+
+/**
+ * Run msg_count msgs through stage_count stages, fuse as for
+ * Pipeline_start, returning the ns per msg. If pPlan isn't NULL the
+ * plan for hop_ns from the measured costs is returned in it.
+ */
+bool run(const char* name, uint32_t stage_count, uint64_t fuse, uint64_t msg_count,
+    uint32_t window, uint32_t batch, uint64_t work_ns, double hop_ns, double* pNsPerMsg,
+    uint64_t* pPlan) {
+  bool error = false;
+  Pipeline_t p;
+  MsgPool_t pool;
+  StageCtx ctxs[MAX_STAGES];
+
+  Pipeline_init(&p, batch);
+  for (uint32_t i = 0; i < stage_count; i++) {
+    ctxs[i].work_ns = work_ns;
+    ctxs[i].idx = i;
+    ctxs[i].last = i == stage_count - 1;
+    ctxs[i].next_seq = 0;
+    ctxs[i].errors = 0;
+    Pipeline_add_stage(&p, "stage", stage, &ctxs[i]);
+  }
+  // More as each thread's stub may be one of the pool's msgs
+  if (MsgPool_init(&pool, window + stage_count) || Pipeline_start(&p, fuse)) {
+    printf(LDR "run: ERROR unable to create the pool or pipeline\n", ldr());
+    return true;
+  }
+
+  uint64_t time_start = ticks_serialized();
+  for (uint64_t i = 0; i < msg_count; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&pool)) == NULL) {
+      sched_yield();
+    }
+    msg->arg1 = i;
+    msg->arg2 = 0;
+    Pipeline_send(&p, msg);
+  }
+  Pipeline_stop(&p);
+  uint64_t time_stop = ticks_serialized();
+  MsgPool_deinit(&pool);
+
+  StageCtx* last = &ctxs[stage_count - 1];
+  if ((last->errors != 0) || (last->next_seq != msg_count)) {
+    printf(LDR "run: ERROR %s stages=%u errors=%lu received=%lu expected=%lu\n",
+        ldr(), name, stage_count, last->errors, last->next_seq, msg_count);
+    error = true;
+  }
+
+  *pNsPerMsg = diff_ticks_ns(time_stop, time_start) / (double)msg_count;
+  printf("%-7s stages=%u ns_per_msg=%.1f stage_ns=", name, stage_count, *pNsPerMsg);
+  for (uint32_t i = 0; i < stage_count; i++) {
+    printf("%s%.0f", i != 0 ? "," : "", Pipeline_stage_ns(&p, i));
+  }
+  printf(" threads=");
+  print_groups(stage_count, fuse);
+  printf("\n");
+  if (pPlan != NULL) {
+    *pPlan = Pipeline_plan(&p, hop_ns);
+  }
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 5) {
+    printf("Usage:\n");
+    printf(" %s msg_count window batch work_ns\n", argv[0]);
+    printf("  runs msg_count msgs, at most window outstanding, through %u to %u stages\n",
+        MIN_STAGES, MAX_STAGES);
+    printf("  passing batch at a time, each stage spins work_ns per msg\n");
+    return 1;
+  }
+
+  u_int64_t msg_count;
+  sscanf(argv[1], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[2], "%u", &window);
+  u_int32_t batch;
+  sscanf(argv[3], "%u", &batch);
+  u_int64_t work_ns;
+  sscanf(argv[4], "%lu", &work_ns);
+  printf("pipeline_bench msg_count=%lu window=%u batch=%u work_ns=%lu\n",
+      msg_count, window, batch, work_ns);
+
+  if ((msg_count == 0) || (window == 0) || (batch == 0)) {
+    printf("msg_count, window and batch must be > 0\n");
+    return 1;
+  }
+
+  error |= timing_init();
+
+  double split_ns;
+  double fused_ns;
+  error |= run("hop", MAX_STAGES, FUSE_NONE, msg_count, window, batch, 0, 0.0,
+      &split_ns, NULL);
+  error |= run("hop", MAX_STAGES, FUSE_ALL, msg_count, window, batch, 0, 0.0,
+      &fused_ns, NULL);
+  double hop_ns = split_ns > fused_ns ? (split_ns - fused_ns) / (MAX_STAGES - 1) : 0.0;
+  printf("hop_ns=%.1f\n", hop_ns);
+
+  for (uint32_t n = MIN_STAGES; n <= MAX_STAGES; n++) {
+    double ns;
+    uint64_t plan;
+    error |= run("split", n, FUSE_NONE, msg_count, window, batch, work_ns, hop_ns, &ns, &plan);
+    error |= run("fused", n, FUSE_ALL, msg_count, window, batch, work_ns, hop_ns, &ns, NULL);
+    error |= run("planned", n, plan, msg_count, window, batch, work_ns, hop_ns, &ns, NULL);
+  }
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
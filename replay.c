@@ -0,0 +1,359 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Replay a capture file, see capture.h, to reproduce its load.
+ *
+ * Each distinct destination fifo in the capture becomes a fifo here
+ * and each source thread's records are sent by replay thread
+ * src % thread_count at their original time divided by speed, or as
+ * fast as possible if speed is 0. thread_count consumers each service
+ * their share of the fifos with a FifoSet_t.
+ *
+ * The msgs carry the captured arg1 but arg2 is the record's index
+ * so the consumer measures latency from when the record should have
+ * been sent, a replay thread falling behind adds to the latency.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "fifo_set.h"
+#include "capture.h"
+#include "histo.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define POOL_MSG_COUNT 1024
+#define FIFO_SET_BATCH 16
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Replay {
+  const CaptureRecord_t* records;
+  uint64_t count;
+  uint32_t* fifo_idx;       // Dense index of each record's destination
+  uint32_t fifo_count;
+  uint32_t thread_count;
+  double speed;
+  double tick_scale;        // Ticks of this host per captured tick
+  uint64_t first_tick;      // Captured
+  uint64_t start;           // Of the replay
+  _Atomic(uint32_t) senders_done;
+} Replay;
+
+typedef struct Consumer {
+  pthread_t thread;
+  Replay* r;
+  FifoSet_t set;
+  MpscFifo_t* fifos;        // Fifos idx, idx + thread_count, ...
+  uint32_t fifo_count;
+  uint64_t received;
+  Histo_t histo;
+} Consumer;
+
+typedef struct Sender {
+  pthread_t thread;
+  Replay* r;
+  Consumer* consumers;
+  uint32_t idx;
+  MsgPool_t pool;
+  uint64_t sent;
+  uint64_t max_lag;         // Ticks behind schedule
+} Sender;
+
+/**
+ * Return the tick record idx should be sent at
+ */
+static inline uint64_t due(Replay* r, uint64_t idx) {
+  if (r->speed == 0.0) {
+    return r->start;
+  }
+  return r->start + (uint64_t)((double)(r->records[idx].tick - r->first_tick)
+      * r->tick_scale / r->speed);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**
+ * Number the distinct destinations densely.
+ *
+ * @return true if an error
+ */
+static bool map_fifos(Replay* r) {
+  uint64_t* dsts = malloc(r->count * sizeof(uint64_t));
+  r->fifo_idx = malloc(r->count * sizeof(uint32_t));
+  if ((dsts == NULL) || (r->fifo_idx == NULL)) {
+    free(dsts);
+    return true;
+  }
+  for (uint64_t i = 0; i < r->count; i++) {
+    dsts[i] = r->records[i].dst;
+  }
+  qsort(dsts, r->count, sizeof(uint64_t), cmp_u64);
+  uint64_t unique = 0;
+  for (uint64_t i = 0; i < r->count; i++) {
+    if ((unique == 0) || (dsts[unique - 1] != dsts[i])) {
+      dsts[unique++] = dsts[i];
+    }
+  }
+  for (uint64_t i = 0; i < r->count; i++) {
+    uint64_t* p = bsearch(&r->records[i].dst, dsts, unique, sizeof(uint64_t), cmp_u64);
+    r->fifo_idx[i] = (uint32_t)(p - dsts);
+  }
+  r->fifo_count = (uint32_t)unique;
+  free(dsts);
+  return false;
+}
+
+static void* sender(void* p) {
+  Sender* s = (Sender*)p;
+  Replay* r = s->r;
+
+  for (uint64_t i = 0; i < r->count; i++) {
+    if ((r->records[i].src % r->thread_count) != s->idx) {
+      continue;
+    }
+    uint64_t when = due(r, i);
+    uint64_t now = ticks();
+    while (now < when) {
+      sched_yield();
+      now = ticks();
+    }
+    if (now - when > s->max_lag) {
+      s->max_lag = now - when;
+    }
+    Msg_t* msg = MsgPool_get_msg(&s->pool);
+    if (msg == NULL) {
+      printf(LDR "sender: ERROR no msgs\n", ldr());
+      break;
+    }
+    msg->arg1 = r->records[i].arg1;
+    msg->arg2 = i;
+    uint32_t q = r->fifo_idx[i];
+    Consumer* c = &s->consumers[q % r->thread_count];
+    FifoSet_add(&c->set, q / r->thread_count, msg);
+    s->sent += 1;
+  }
+  __atomic_fetch_add(&r->senders_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void* consumer(void* p) {
+  Consumer* c = (Consumer*)p;
+  Replay* r = c->r;
+  uint32_t idx;
+
+  while (true) {
+    Msg_t* msg = FifoSet_rmv(&c->set, &idx);
+    if (msg == NULL) {
+      if (__atomic_load_n(&r->senders_done, __ATOMIC_ACQUIRE) == r->thread_count) {
+        // Check again as the msgs may have been added before done
+        if ((msg = FifoSet_rmv(&c->set, &idx)) == NULL) {
+          break;
+        }
+      } else {
+        sched_yield();
+        continue;
+      }
+    }
+    uint64_t now = ticks();
+    uint64_t when = due(r, msg->arg2);
+    Histo_record(&c->histo, now > when ? now - when : 0);
+    c->received += 1;
+    ret_msg(msg);
+  }
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+  double speed = 1.0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+      case 's':
+        sscanf(optarg, "%lf", &speed);
+        break;
+      default:
+        argc = 0; // Force usage
+        break;
+    }
+  }
+  if ((argc - optind) != 2) {
+    printf("Usage:\n");
+    printf(" %s [-s speed] capture_file thread_count\n", argv[0]);
+    printf("  -s replay at speed times the captured rate, 0 is as fast as possible\n");
+    return 1;
+  }
+  const char* path = argv[optind + 0];
+  u_int32_t thread_count;
+  sscanf(argv[optind + 1], "%u", &thread_count);
+  if (thread_count == 0) {
+    printf("thread_count must be > 0\n");
+    return 1;
+  }
+
+  error |= timing_init();
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if ((fd < 0) || (fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(CaptureFileHeader_t))) {
+    printf("replay: ERROR unable to open %s\n", path);
+    return 1;
+  }
+  void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    printf("replay: ERROR unable to map %s\n", path);
+    return 1;
+  }
+  const CaptureFileHeader_t* hdr = (const CaptureFileHeader_t*)map;
+  if ((hdr->magic != CAPTURE_MAGIC) || (hdr->record_size != sizeof(CaptureRecord_t))
+      || ((size_t)st.st_size < sizeof(*hdr) + (hdr->count * sizeof(CaptureRecord_t)))) {
+    printf("replay: ERROR %s is not a capture file\n", path);
+    return 1;
+  }
+
+  Replay r;
+  memset(&r, 0, sizeof(r));
+  r.records = (const CaptureRecord_t*)(hdr + 1);
+  r.count = hdr->count;
+  r.thread_count = thread_count;
+  r.speed = speed;
+  r.tick_scale = hdr->ns_per_tick / gTiming.ns_per_tick;
+  r.first_tick = r.count != 0 ? r.records[0].tick : 0;
+  for (uint64_t i = 1; i < r.count; i++) {
+    if (r.records[i].tick < r.first_tick) {
+      r.first_tick = r.records[i].tick;
+    }
+  }
+  if ((r.count == 0) || map_fifos(&r)) {
+    printf("replay: ERROR nothing to replay in %s\n", path);
+    return 1;
+  }
+  double captured_secs = 0.0;
+  for (uint64_t i = 0; i < r.count; i++) {
+    double secs = (double)(r.records[i].tick - r.first_tick) * hdr->ns_per_tick / ns_flt;
+    if (secs > captured_secs) {
+      captured_secs = secs;
+    }
+  }
+  printf("replay %s records=%lu dropped=%lu srcs=%u fifos=%u captured_secs=%.3f "
+      "thread_count=%u speed=%.2f\n", path, r.count, hdr->dropped, hdr->src_count,
+      r.fifo_count, captured_secs, thread_count, speed);
+
+  Consumer* consumers = calloc(thread_count, sizeof(Consumer));
+  Sender* senders = calloc(thread_count, sizeof(Sender));
+  MsgPool_t stubs;
+  if ((consumers == NULL) || (senders == NULL) || MsgPool_init(&stubs, r.fifo_count)) {
+    printf("replay: ERROR unable to allocate\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < thread_count; i++) {
+    Consumer* c = &consumers[i];
+    c->r = &r;
+    c->fifo_count = (r.fifo_count + thread_count - 1 - i) / thread_count;
+    c->fifos = calloc(c->fifo_count != 0 ? c->fifo_count : 1, sizeof(MpscFifo_t));
+    if ((c->fifos == NULL) || FifoSet_init(&c->set, c->fifo_count != 0 ? c->fifo_count : 1,
+          FIFO_SET_BATCH, false)) {
+      printf("replay: ERROR unable to create the fifos\n");
+      return 1;
+    }
+    for (uint32_t j = 0; j < c->fifo_count; j++) {
+      initMpscFifo(&c->fifos[j], MsgPool_get_msg(&stubs));
+      FifoSet_set_fifo(&c->set, j, &c->fifos[j]);
+    }
+    Histo_clear(&c->histo);
+  }
+  for (uint32_t i = 0; i < thread_count; i++) {
+    Sender* s = &senders[i];
+    s->r = &r;
+    s->consumers = consumers;
+    s->idx = i;
+    if (MsgPool_init_elastic(&s->pool, POOL_MSG_COUNT, POOL_MSG_COUNT, 16, 0)) {
+      printf("replay: ERROR unable to create sender pool\n");
+      return 1;
+    }
+  }
+
+  r.start = ticks_serialized();
+  for (uint32_t i = 0; i < thread_count; i++) {
+    pthread_create(&consumers[i].thread, NULL, consumer, &consumers[i]);
+  }
+  for (uint32_t i = 0; i < thread_count; i++) {
+    pthread_create(&senders[i].thread, NULL, sender, &senders[i]);
+  }
+
+  uint64_t sent = 0;
+  uint64_t max_lag = 0;
+  for (uint32_t i = 0; i < thread_count; i++) {
+    pthread_join(senders[i].thread, NULL);
+    sent += senders[i].sent;
+    if (senders[i].max_lag > max_lag) {
+      max_lag = senders[i].max_lag;
+    }
+  }
+  Histo_t histo;
+  Histo_clear(&histo);
+  uint64_t received = 0;
+  for (uint32_t i = 0; i < thread_count; i++) {
+    pthread_join(consumers[i].thread, NULL);
+    Histo_merge(&histo, &consumers[i].histo);
+    received += consumers[i].received;
+  }
+  uint64_t stop = ticks_serialized();
+
+  // The fifo stubs may belong to a sender pool
+  for (uint32_t i = 0; i < thread_count; i++) {
+    for (uint32_t j = 0; j < consumers[i].fifo_count; j++) {
+      deinitMpscFifo(&consumers[i].fifos[j], NULL);
+    }
+    FifoSet_deinit(&consumers[i].set);
+    free(consumers[i].fifos);
+  }
+  for (uint32_t i = 0; i < thread_count; i++) {
+    MsgPool_deinit(&senders[i].pool);
+  }
+  MsgPool_deinit(&stubs);
+
+  if ((sent != r.count) || (received != r.count)) {
+    printf("replay: ERROR sent=%lu received=%lu records=%lu\n", sent, received, r.count);
+    error = true;
+  }
+  double secs = diff_ticks_ns(stop, r.start) / ns_flt;
+  printf("replay secs=%.3f msgs_per_sec=%.0f max_lag_ns=%.0f\n",
+      secs, (double)received / secs, ticks_to_ns(max_lag));
+  Histo_print(&histo, "replay latency_ns", gTiming.ns_per_tick);
+
+  free(senders);
+  free(consumers);
+  munmap(map, (size_t)st.st_size);
+  close(fd);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "results.h"
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef RESULTS_FLAGS
+#define RESULTS_FLAGS "unknown"
+#endif
+
+#ifdef __VERSION__
+#define RESULTS_CC __VERSION__
+#else
+#define RESULTS_CC "unknown"
+#endif
+
+static char fingerprint[RESULTS_MAX_FINGERPRINT];
+
+/**
+ * Return the cpu model name in buf, tabs and newlines removed
+ */
+static void cpu_model(char* buf, size_t size) {
+  snprintf(buf, size, "unknown");
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) {
+    return;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "model name", 10) == 0) {
+      char* colon = strchr(line, ':');
+      if (colon != NULL) {
+        snprintf(buf, size, "%s", colon + 2);
+      }
+      break;
+    }
+  }
+  fclose(f);
+  buf[strcspn(buf, "\t\n")] = 0;
+}
+
+/**
+ * @see results.h
+ */
+const char* results_fingerprint(void) {
+  if (fingerprint[0] == 0) {
+    char host[64];
+    if (gethostname(host, sizeof(host)) != 0) {
+      snprintf(host, sizeof(host), "unknown");
+    }
+    host[sizeof(host) - 1] = 0;
+    char cpu[128];
+    cpu_model(cpu, sizeof(cpu));
+    snprintf(fingerprint, sizeof(fingerprint), "host=%s cpu=%s cpus=%ld cc=%s flags=%s",
+        host, cpu, sysconf(_SC_NPROCESSORS_ONLN), RESULTS_CC, RESULTS_FLAGS);
+  }
+  return fingerprint;
+}
+
+/**
+ * @see results.h
+ */
+bool results_save(const char* bench, const char* scenario, const char* metric, double value) {
+  const char* path = getenv(RESULTS_ENV);
+  if ((path == NULL) || (path[0] == 0)) {
+    return false;
+  }
+  FILE* f = fopen(path, "a");
+  if (f == NULL) {
+    printf("results_save: ERROR unable to open %s\n", path);
+    return true;
+  }
+  fprintf(f, "%s\t%s\t%s\t%.6g\t%s\n", bench, scenario, metric, value, results_fingerprint());
+  return fclose(f) != 0;
+}
+
+/**
+ * Copy the next tab or newline terminated field at *pLine to dst
+ */
+static bool next_field(char** pLine, char* dst, size_t size) {
+  char* s = *pLine;
+  size_t len = strcspn(s, "\t\n");
+  if ((len == 0) || (len >= size)) {
+    return true;
+  }
+  memcpy(dst, s, len);
+  dst[len] = 0;
+  *pLine = s[len] == '\t' ? s + len + 1 : s + len;
+  return false;
+}
+
+/**
+ * @see results.h
+ */
+bool results_load(const char* path, Result_t** pResults, uint32_t* pCount) {
+  *pResults = NULL;
+  *pCount = 0;
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return true;
+  }
+  uint32_t capacity = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if ((line[0] == '#') || (line[0] == '\n')) {
+      continue;
+    }
+    if (*pCount == capacity) {
+      capacity = capacity != 0 ? capacity * 2 : 64;
+      Result_t* results = realloc(*pResults, capacity * sizeof(Result_t));
+      if (results == NULL) {
+        break;
+      }
+      *pResults = results;
+    }
+    Result_t* r = &(*pResults)[*pCount];
+    char value[64];
+    char* s = line;
+    if (next_field(&s, r->bench, sizeof(r->bench)) ||
+        next_field(&s, r->scenario, sizeof(r->scenario)) ||
+        next_field(&s, r->metric, sizeof(r->metric)) ||
+        next_field(&s, value, sizeof(value)) ||
+        next_field(&s, r->fingerprint, sizeof(r->fingerprint))) {
+      printf("results_load: %s skipping malformed line %s", path, line);
+      continue;
+    }
+    r->value = strtod(value, NULL);
+    *pCount += 1;
+  }
+  fclose(f);
+  return false;
+}
+
+/**
+ * @see results.h
+ */
+bool results_higher_is_better(const char* metric) {
+  return strstr(metric, "per_sec") != NULL;
+}
@@ -0,0 +1,73 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A local store of benchmark results. When the environment variable
+ * RESULTS_ENV names a file, results_save appends one line per result
+ * to it, tab separated:
+ *
+ *   bench scenario metric value fingerprint
+ *
+ * The fingerprint, see results_fingerprint, identifies the host, the
+ * compiler and the flags so results are only compared with others
+ * from the same build on the same machine. Metrics whose name has
+ * "per_sec" are better higher, all others better lower.
+ *
+ * bench_compare runs a benchmark repeatedly, saving a baseline or
+ * comparing against it with a Mann-Whitney U test.
+ */
+
+#ifndef _RESULTS_H
+#define _RESULTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESULTS_ENV "MPSC_RESULTS"
+
+#define RESULTS_MAX_NAME 128
+#define RESULTS_MAX_FINGERPRINT 512
+
+typedef struct Result_t {
+  char bench[RESULTS_MAX_NAME];
+  char scenario[RESULTS_MAX_NAME];
+  char metric[RESULTS_MAX_NAME];
+  double value;
+  char fingerprint[RESULTS_MAX_FINGERPRINT];
+} Result_t;
+
+/**
+ * Return the fingerprint of this host and build, i.e.
+ * "host=h cpu=model cpus=n cc=version flags=CC_FLAGS".
+ */
+const char* results_fingerprint(void);
+
+/**
+ * Append a result to the file named by RESULTS_ENV, does nothing if
+ * it's not set.
+ *
+ * @return true if an error writing the file.
+ */
+bool results_save(const char* bench, const char* scenario, const char* metric, double value);
+
+/**
+ * Read the results in path into a malloc'd array returned in pResults
+ * with the count in pCount, free with free.
+ *
+ * @return true if path can't be read.
+ */
+bool results_load(const char* path, Result_t** pResults, uint32_t* pCount);
+
+/**
+ * Return true if metric is better when higher.
+ */
+bool results_higher_is_better(const char* metric);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "sendbuf.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @see sendbuf.h
+ */
+void SendBuf_init(SendBuf_t* sb, uint32_t max_msgs, uint64_t max_ns,
+    SendBufFlushed_t flushed, void* ctx) {
+  memset(sb, 0, sizeof(*sb));
+  sb->max_msgs = max_msgs != 0 ? max_msgs : 1;
+  sb->max_ticks = max_ns != 0 ? (uint64_t)((double)max_ns / gTiming.ns_per_tick) + 1 : 0;
+  sb->flushed = flushed;
+  sb->ctx = ctx;
+}
+
+/**
+ * Add the msgs of dests[i] to its fifo and remove it
+ */
+static uint32_t flush_dest(SendBuf_t* sb, uint32_t i) {
+  SendBufDest_t d = sb->dests[i];
+  sb->dest_count -= 1;
+  sb->dests[i] = sb->dests[sb->dest_count];
+
+  DPF(LDR "SendBuf flush_dest: sb=%p fifo=%p count=%u\n", ldr(), sb, d.fifo, d.count);
+  add_chain(d.fifo, d.pFirst, d.pLast);
+  sb->flushes += 1;
+  if (sb->flushed != NULL) {
+    sb->flushed(sb->ctx, d.fifo, d.count);
+  }
+  return d.count;
+}
+
+/**
+ * @see sendbuf.h
+ */
+void SendBuf_add(SendBuf_t* sb, MpscFifo_t* fifo, Msg_t* msg) {
+  sb->msgs += 1;
+
+  uint32_t i;
+  for (i = 0; i < sb->dest_count; i++) {
+    if (sb->dests[i].fifo == fifo) {
+      break;
+    }
+  }
+
+  uint64_t now = sb->max_ticks != 0 ? ticks() : 0;
+  if (i == sb->dest_count) {
+    if (sb->dest_count == SENDBUF_MAX_DESTS) {
+      // Full, make room by flushing the one waiting longest
+      uint32_t oldest = 0;
+      for (uint32_t j = 1; j < sb->dest_count; j++) {
+        if (sb->dests[j].first_tick < sb->dests[oldest].first_tick) {
+          oldest = j;
+        }
+      }
+      flush_dest(sb, oldest);
+    }
+    i = sb->dest_count++;
+    SendBufDest_t* d = &sb->dests[i];
+    d->fifo = fifo;
+    d->pFirst = msg;
+    d->count = 0;
+    d->first_tick = now;
+  } else {
+    MPSC_STORE(&sb->dests[i].pLast->pNext, msg, __ATOMIC_RELAXED);
+  }
+  SendBufDest_t* d = &sb->dests[i];
+  d->pLast = msg;
+  d->count += 1;
+
+  if ((d->count >= sb->max_msgs) ||
+      ((sb->max_ticks != 0) && (now - d->first_tick >= sb->max_ticks))) {
+    flush_dest(sb, i);
+  }
+}
+
+/**
+ * @see sendbuf.h
+ */
+void SendBuf_send_rsp_or_ret(SendBuf_t* sb, Msg_t* msg, uint64_t arg1) {
+  if (msg->pRspQ != NULL) {
+    MpscFifo_t* pRspQ = msg->pRspQ;
+    msg->pRspQ = NULL;
+    msg->arg1 = arg1;
+    msg->deadline = 0;
+    SendBuf_add(sb, pRspQ, msg);
+  } else {
+    ret_msg(msg);
+  }
+}
+
+/**
+ * @see sendbuf.h
+ */
+uint32_t SendBuf_poll(SendBuf_t* sb) {
+  if ((sb->max_ticks == 0) || (sb->dest_count == 0)) {
+    return 0;
+  }
+  uint32_t flushed = 0;
+  uint64_t now = ticks();
+  uint32_t i = 0;
+  while (i < sb->dest_count) {
+    if (now - sb->dests[i].first_tick >= sb->max_ticks) {
+      // flush_dest moves the last destination to i
+      flush_dest(sb, i);
+      flushed += 1;
+    } else {
+      i += 1;
+    }
+  }
+  return flushed;
+}
+
+/**
+ * @see sendbuf.h
+ */
+uint32_t SendBuf_flush_fifo(SendBuf_t* sb, MpscFifo_t* fifo) {
+  for (uint32_t i = 0; i < sb->dest_count; i++) {
+    if (sb->dests[i].fifo == fifo) {
+      return flush_dest(sb, i);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @see sendbuf.h
+ */
+uint32_t SendBuf_flush(SendBuf_t* sb) {
+  uint32_t count = 0;
+  while (sb->dest_count != 0) {
+    count += flush_dest(sb, sb->dest_count - 1);
+  }
+  return count;
+}
@@ -0,0 +1,107 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A producer local send buffer which stages outgoing msgs per
+ * destination fifo and publishes each destination's msgs with one
+ * add_chain, so a thread sending many msgs to the same fifo pays one
+ * exchange of pHead, and one wakeup, per batch instead of per msg.
+ *
+ * A destination is flushed when it holds max_msgs, when its oldest
+ * msg has waited max_ns, checked on each send and by SendBuf_poll,
+ * and by SendBuf_flush when the sender goes idle. SendBuf_flush_fifo
+ * flushes one destination at once for latency critical sends. The
+ * order of msgs to one destination is kept, between destinations it
+ * isn't.
+ *
+ * A SendBuf_t is used by a single thread, at most SENDBUF_MAX_DESTS
+ * destinations are staged at a time and sending to another flushes
+ * the one whose oldest msg has waited longest. Staged msgs are held
+ * by the sender, flush before waiting on a response to them.
+ */
+
+#ifndef _SENDBUF_H
+#define _SENDBUF_H
+
+#include "mpscfifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SENDBUF_MAX_DESTS 16
+
+/**
+ * Called after count msgs were added to fifo, i.e. to wake its
+ * consumer.
+ */
+typedef void (*SendBufFlushed_t)(void* ctx, MpscFifo_t* fifo, uint32_t count);
+
+typedef struct SendBufDest_t {
+  MpscFifo_t* fifo;
+  Msg_t* pFirst;
+  Msg_t* pLast;
+  uint32_t count;
+  uint64_t first_tick;      // When pFirst was staged
+} SendBufDest_t;
+
+typedef struct SendBuf_t {
+  SendBufDest_t dests[SENDBUF_MAX_DESTS];
+  uint32_t dest_count;
+  uint32_t max_msgs;
+  uint64_t max_ticks;       // 0 for no time budget
+  SendBufFlushed_t flushed;
+  void* ctx;
+  uint64_t msgs;            // Sent
+  uint64_t flushes;         // add_chain's
+} SendBuf_t;
+
+/**
+ * Initialize an empty send buffer flushing a destination when it
+ * has max_msgs or, if max_ns isn't 0, its oldest msg has waited
+ * max_ns. flushed, if not NULL, is called with ctx after each flush.
+ * Requires timing_init for max_ns.
+ */
+void SendBuf_init(SendBuf_t* sb, uint32_t max_msgs, uint64_t max_ns,
+    SendBufFlushed_t flushed, void* ctx);
+
+/**
+ * Stage msg to be added to fifo.
+ */
+void SendBuf_add(SendBuf_t* sb, MpscFifo_t* fifo, Msg_t* msg);
+
+/**
+ * As send_rsp_or_ret, staging the response. Msgs without a pRspQ are
+ * returned at once.
+ */
+void SendBuf_send_rsp_or_ret(SendBuf_t* sb, Msg_t* msg, uint64_t arg1);
+
+/**
+ * Flush the destinations whose oldest msg has waited max_ns, call
+ * periodically when sending sporadically.
+ *
+ * @return number of destinations flushed.
+ */
+uint32_t SendBuf_poll(SendBuf_t* sb);
+
+/**
+ * Flush the staged msgs for fifo.
+ *
+ * @return number of msgs flushed.
+ */
+uint32_t SendBuf_flush_fifo(SendBuf_t* sb, MpscFifo_t* fifo);
+
+/**
+ * Flush every destination, call before the sender goes idle.
+ *
+ * @return number of msgs flushed.
+ */
+uint32_t SendBuf_flush(SendBuf_t* sb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Compare sending each msg with add and a wakeup against staging
+ * them in a SendBuf_t, see sendbuf.h, with max_msgs of 4, 16 and 64.
+ *
+ * One producer sends bursts of burst msgs, each burst to the next of
+ * dest_count consumers, and goes idle, flushing, after every
+ * dest_count bursts. A consumer waits on a semaphore posted once per
+ * add or flush and records the latency from when each msg was sent.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "sendbuf.h"
+#include "histo.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DESTS SENDBUF_MAX_DESTS
+
+#define CmdData 0
+#define CmdStop 1
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Consumer {
+  MpscFifo_t fifo;
+  sem_t sem;
+  pthread_t thread;
+  uint64_t received;
+  uint64_t wakeups;
+  Histo_t latency;
+} Consumer;
+
+static void* consumer(void* param) {
+  Consumer* c = (Consumer*)param;
+  while (true) {
+    Msg_t* msg;
+    bool stop = false;
+    while ((msg = rmv(&c->fifo)) != NULL) {
+      if (msg->arg1 == CmdStop) {
+        stop = true;
+      } else {
+        Histo_record(&c->latency, ticks() - msg->arg2);
+        c->received += 1;
+      }
+      ret_msg(msg);
+    }
+    if (stop) {
+      break;
+    }
+    sem_wait(&c->sem);
+    c->wakeups += 1;
+  }
+  return NULL;
+}
+
+/**
+ * Wake the consumer of fifo
+ */
+static void wake(void* ctx, MpscFifo_t* fifo, uint32_t count) {
+  (void)ctx;
+  (void)count;
+  Consumer* c = (Consumer*)((char*)fifo - offsetof(Consumer, fifo));
+  sem_post(&c->sem);
+}
+
+/**
+ * Send msg_count msgs, max_msgs == 0 adds each directly
+ */
+bool run(uint32_t dest_count, uint64_t msg_count, uint32_t window, uint32_t burst,
+    uint32_t max_msgs, uint64_t max_ns) {
+  bool error = false;
+  MsgPool_t pool;
+  Consumer consumers[MAX_DESTS];
+  SendBuf_t sb;
+
+  // A stub and a CmdStop per consumer
+  if (MsgPool_init(&pool, window + (2 * dest_count))) {
+    printf(LDR "run: ERROR unable to create the pool\n", ldr());
+    return true;
+  }
+  for (uint32_t i = 0; i < dest_count; i++) {
+    Consumer* c = &consumers[i];
+    memset(c, 0, sizeof(*c));
+    initMpscFifo(&c->fifo, MsgPool_get_msg(&pool));
+    sem_init(&c->sem, 0, 0);
+    Histo_clear(&c->latency);
+    pthread_create(&c->thread, NULL, consumer, c);
+  }
+  SendBuf_init(&sb, max_msgs, max_ns, wake, NULL);
+
+  uint64_t time_start = ticks_serialized();
+  uint32_t dest = 0;
+  uint32_t in_burst = 0;
+  for (uint64_t i = 0; i < msg_count; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&pool)) == NULL) {
+      // Out of msgs is idle too
+      SendBuf_flush(&sb);
+      sched_yield();
+    }
+    msg->arg1 = CmdData;
+    msg->arg2 = ticks();
+    Consumer* c = &consumers[dest];
+    if (max_msgs == 0) {
+      add(&c->fifo, msg);
+      sem_post(&c->sem);
+    } else {
+      SendBuf_add(&sb, &c->fifo, msg);
+    }
+    if (++in_burst == burst) {
+      in_burst = 0;
+      if (++dest == dest_count) {
+        dest = 0;
+        SendBuf_flush(&sb);
+      } else {
+        SendBuf_poll(&sb);
+      }
+    }
+  }
+  SendBuf_flush(&sb);
+  for (uint32_t i = 0; i < dest_count; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&pool)) == NULL) {
+      sched_yield();
+    }
+    msg->arg1 = CmdStop;
+    add(&consumers[i].fifo, msg);
+    sem_post(&consumers[i].sem);
+  }
+
+  Histo_t latency;
+  Histo_clear(&latency);
+  uint64_t received = 0;
+  uint64_t wakeups = 0;
+  for (uint32_t i = 0; i < dest_count; i++) {
+    Consumer* c = &consumers[i];
+    pthread_join(c->thread, NULL);
+    received += c->received;
+    wakeups += c->wakeups;
+    Histo_merge(&latency, &c->latency);
+  }
+  uint64_t time_stop = ticks_serialized();
+
+  // The fifos first as their stubs may be any of the pool's msgs
+  for (uint32_t i = 0; i < dest_count; i++) {
+    deinitMpscFifo(&consumers[i].fifo, NULL);
+    sem_destroy(&consumers[i].sem);
+  }
+  MsgPool_deinit(&pool);
+
+  if (received != msg_count) {
+    printf(LDR "run: ERROR max_msgs=%u received=%lu expected=%lu\n",
+        ldr(), max_msgs, received, msg_count);
+    error = true;
+  }
+
+  double ns_per_msg = diff_ticks_ns(time_stop, time_start) / (double)msg_count;
+  uint64_t adds = max_msgs == 0 ? msg_count : sb.flushes;
+  if (max_msgs == 0) {
+    printf("direct      ");
+  } else {
+    printf("max_msgs=%-3u", max_msgs);
+  }
+  printf(" ns_per_msg=%.1f msgs_per_add=%.1f wakeups=%lu ",
+      ns_per_msg, adds != 0 ? (double)msg_count / (double)adds : 0.0, wakeups);
+  Histo_print(&latency, "latency_ns", gTiming.ns_per_tick);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 6) {
+    printf("Usage:\n");
+    printf(" %s dest_count msg_count window burst max_ns\n", argv[0]);
+    printf("  sends msg_count msgs, at most window outstanding, in bursts of burst\n");
+    printf("  msgs to each of dest_count consumers, directly and buffered flushing\n");
+    printf("  after max_ns, 0 for no time budget\n");
+    return 1;
+  }
+
+  u_int32_t dest_count;
+  sscanf(argv[1], "%u", &dest_count);
+  u_int64_t msg_count;
+  sscanf(argv[2], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[3], "%u", &window);
+  u_int32_t burst;
+  sscanf(argv[4], "%u", &burst);
+  u_int64_t max_ns;
+  sscanf(argv[5], "%lu", &max_ns);
+  printf("sendbuf_bench dest_count=%u msg_count=%lu window=%u burst=%u max_ns=%lu\n",
+      dest_count, msg_count, window, burst, max_ns);
+
+  if ((dest_count == 0) || (dest_count > MAX_DESTS) || (msg_count == 0) ||
+      (window == 0) || (burst == 0)) {
+    printf("dest_count must be 1 to %u, msg_count, window and burst must be > 0\n", MAX_DESTS);
+    return 1;
+  }
+
+  error |= timing_init();
+
+  static const uint32_t max_msgs[] = { 0, 4, 16, 64 };
+  for (uint32_t i = 0; i < sizeof(max_msgs) / sizeof(max_msgs[0]); i++) {
+    error |= run(dest_count, msg_count, window, burst, max_msgs[i], max_ns);
+  }
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
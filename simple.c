@@ -15,7 +15,10 @@
 
 #include "mpscfifo.h"
 #include "msg_pool.h"
+#include "fifo_set.h"
 #include "diff_timespec.h"
+#include "trace.h"
+#include "results.h"
 #include "dpf.h"
 
 #include <sys/types.h>
@@ -28,6 +31,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <semaphore.h>
+#include <unistd.h>
+
+#define RESULTS_BENCH "simple_" MPSCFIFO_ORDERING_NAME
 
 /**
  * We pass pointers in Msg_t.arg2 which is a uint64_t,
@@ -125,10 +131,65 @@ done:
   return error;
 }
 
+/**
+ * Check outstanding msg accounting, drain and a timed deinit
+ */
+bool teardown(void) {
+  bool error = false;
+  MpscFifo_t fifo;
+  MsgPool_t pool;
+  uint64_t outstanding;
+
+  printf(LDR "teardown:+\n", ldr());
+
+  if (MsgPool_init(&pool, 4)) {
+    printf(LDR "teardown: ERROR unable to create msgs for pool\n", ldr());
+    return true;
+  }
+  initMpscFifo(&fifo, MsgPool_get_msg(&pool));
+  add(&fifo, MsgPool_get_msg(&pool));
+  add(&fifo, MsgPool_get_msg(&pool));
+
+  outstanding = MsgPool_outstanding(&pool);
+  if (outstanding != 3) {
+    printf(LDR "teardown: ERROR outstanding=%lu expected 3\n", ldr(), outstanding);
+    error |= true;
+  }
+
+  MpscFifo_t* holders[] = { &fifo };
+  uint64_t held = MsgPool_find_holders(&pool, holders, 1);
+  if (held != 3) {
+    printf(LDR "teardown: ERROR held=%lu expected 3\n", ldr(), held);
+    error |= true;
+  }
+
+  if (!MsgPool_try_deinit(&pool, 1000000, NULL)) {
+    printf(LDR "teardown: ERROR expected try_deinit to time out\n", ldr());
+    return true;
+  }
+
+  uint32_t drained = drain(&fifo);
+  outstanding = MsgPool_outstanding(&pool);
+  if ((drained != 2) || (outstanding != 1)) {
+    printf(LDR "teardown: ERROR drained=%u outstanding=%lu expected 2 and 1\n",
+        ldr(), drained, outstanding);
+    error |= true;
+  }
+
+  deinitMpscFifo(&fifo, NULL);
+  if (MsgPool_try_deinit(&pool, 1000000, NULL)) {
+    printf(LDR "teardown: ERROR outstanding=%lu after stub returned\n",
+        ldr(), MsgPool_outstanding(&pool));
+    return true;
+  }
+
+  printf(LDR "teardown:-error=%u\n\n", ldr(), error);
+  return error;
+}
 
 bool perf(const uint64_t loops) {
-  struct timespec time_start;
-  struct timespec time_stop;
+  uint64_t time_start;
+  uint64_t time_stop;
   MpscFifo_t cmdFifo;
   MsgPool_t pool;
 
@@ -154,36 +215,52 @@ bool perf(const uint64_t loops) {
   }
 
   Msg_t* msg = MsgPool_get_msg(&pool);
-  clock_gettime(CLOCK_REALTIME, &time_start);
+  time_start = ticks_serialized();
   for (uint64_t i = 0; i < loops; i++) {
     add(&cmdFifo, msg);
     msg = rmv(&cmdFifo);
   }
-  clock_gettime(CLOCK_REALTIME, &time_stop);
+  time_stop = ticks_serialized();
   
-  double processing_ns = diff_timespec_ns(&time_stop, &time_start);
+  double processing_ns = diff_ticks_ns(time_stop, time_start);
   printf(LDR "perf: add_rmv from empty fifo  processing=%.3fs\n", ldr(), processing_ns / ns_flt);
   double ops_per_sec = (loops * ns_flt) / processing_ns;
   printf(LDR "perf: add rmv from empty fifo ops_per_sec=%.3f\n", ldr(), ops_per_sec);
   double ns_per_op = (float)processing_ns / (double)loops;
   printf(LDR "perf: add rmv from empty fifo   ns_per_op=%.1fns\n", ldr(), ns_per_op);
+  error |= results_save(RESULTS_BENCH, "add_rmv_empty", "ns_per_op", ns_per_op);
 
   Msg_t* msg2 = MsgPool_get_msg(&pool);
   add(&cmdFifo, msg2);
 
-  clock_gettime(CLOCK_REALTIME, &time_start);
+  time_start = ticks_serialized();
   for (uint64_t i = 0; i < loops; i++) {
     add(&cmdFifo, msg);
     msg = rmv(&cmdFifo);
   }
-  clock_gettime(CLOCK_REALTIME, &time_stop);
+  time_stop = ticks_serialized();
   
-  processing_ns = diff_timespec_ns(&time_stop, &time_start);
+  processing_ns = diff_ticks_ns(time_stop, time_start);
   printf(LDR "perf: add_rmv from non-empty fifo  processing=%.3fs\n", ldr(), processing_ns / ns_flt);
   ops_per_sec = (loops * ns_flt) / processing_ns;
   printf(LDR "perf: add rmv from non-empty fifo ops_per_sec=%.3f\n", ldr(), ops_per_sec);
   ns_per_op = (float)processing_ns / (double)loops;
   printf(LDR "perf: add rmv from non-empty fifo   ns_per_op=%.1fns\n", ldr(), ns_per_op);
+  error |= results_save(RESULTS_BENCH, "add_rmv_non_empty", "ns_per_op", ns_per_op);
+
+  trace_enable(true);
+  time_start = ticks_serialized();
+  for (uint64_t i = 0; i < loops; i++) {
+    add(&cmdFifo, msg);
+    msg = rmv(&cmdFifo);
+  }
+  time_stop = ticks_serialized();
+  trace_enable(false);
+
+  processing_ns = diff_ticks_ns(time_stop, time_start);
+  ns_per_op = (float)processing_ns / (double)loops;
+  printf(LDR "perf: add rmv traced non-empty fifo   ns_per_op=%.1fns\n", ldr(), ns_per_op);
+  error |= results_save(RESULTS_BENCH, "add_rmv_traced", "ns_per_op", ns_per_op);
 
 done:
   printf(LDR "perf:-error=%u\n\n", ldr(), error);
@@ -191,6 +268,231 @@ done:
   return error;
 }
 
+#define SET_FIFO_COUNT 130
+
+typedef struct SetProducer {
+  FifoSet_t* set;
+  MsgPool_t* pool;
+  uint32_t idx;
+} SetProducer;
+
+static void* set_producer(void* p) {
+  SetProducer* prod = (SetProducer*)p;
+  usleep(10000);
+  Msg_t* msg = MsgPool_get_msg(prod->pool);
+  msg->arg1 = 42;
+  FifoSet_add(prod->set, prod->idx, msg);
+  return NULL;
+}
+
+/**
+ * Create SET_FIFO_COUNT fifos in a set taking their stubs from pool
+ */
+static bool set_fifos_init(FifoSet_t* set, MpscFifo_t* fifos, MsgPool_t* pool,
+    uint32_t batch, bool wakeup) {
+  if (FifoSet_init(set, SET_FIFO_COUNT, batch, wakeup)) {
+    return true;
+  }
+  for (uint32_t i = 0; i < SET_FIFO_COUNT; i++) {
+    initMpscFifo(&fifos[i], MsgPool_get_msg(pool));
+    FifoSet_set_fifo(set, i, &fifos[i]);
+  }
+  return false;
+}
+
+static void set_fifos_deinit(FifoSet_t* set, MpscFifo_t* fifos) {
+  for (uint32_t i = 0; i < SET_FIFO_COUNT; i++) {
+    drain(&fifos[i]);
+    deinitMpscFifo(&fifos[i], NULL);
+  }
+  FifoSet_deinit(set);
+}
+
+/**
+ * Check FifoSet_t visits only ready fifos round robin with the
+ * batch budget and wakes a waiting consumer.
+ */
+bool fifo_set(void) {
+  bool error = false;
+  MsgPool_t pool;
+  FifoSet_t set;
+  MpscFifo_t fifos[SET_FIFO_COUNT];
+  uint32_t idx;
+  Msg_t* msg;
+
+  printf(LDR "fifo_set:+\n", ldr());
+
+  if (MsgPool_init(&pool, SET_FIFO_COUNT + 10)
+      || set_fifos_init(&set, fifos, &pool, 2, true)) {
+    printf(LDR "fifo_set: ERROR unable to create pool or set\n", ldr());
+    return true;
+  }
+
+  if (FifoSet_rmv(&set, &idx) != NULL) {
+    printf(LDR "fifo_set: ERROR expected empty set\n", ldr());
+    error |= true;
+  }
+
+  // Three to fifo 5 and one each to 64 and 129, with a batch of 2
+  // fifo 5 is visited again after the others
+  static const uint32_t add_idx[] = { 5, 5, 5, 64, 129 };
+  static const uint32_t expected_idx[] = { 5, 5, 64, 129, 5 };
+  static const uint64_t expected_arg1[] = { 0, 1, 3, 4, 2 };
+  for (uint32_t i = 0; i < 5; i++) {
+    msg = MsgPool_get_msg(&pool);
+    msg->arg1 = i;
+    FifoSet_add(&set, add_idx[i], msg);
+  }
+  for (uint32_t i = 0; i < 5; i++) {
+    msg = FifoSet_rmv(&set, &idx);
+    if ((msg == NULL) || (idx != expected_idx[i]) || (msg->arg1 != expected_arg1[i])) {
+      printf(LDR "fifo_set: ERROR %u msg=%p idx=%u expected idx=%u arg1=%lu\n",
+          ldr(), i, msg, idx, expected_idx[i], expected_arg1[i]);
+      error |= true;
+    }
+    ret_msg(msg);
+  }
+  if (FifoSet_rmv(&set, &idx) != NULL) {
+    printf(LDR "fifo_set: ERROR expected empty set after removing all\n", ldr());
+    error |= true;
+  }
+
+  // The consumer waits until a producer thread adds
+  pthread_t thread;
+  SetProducer prod = { .set = &set, .pool = &pool, .idx = 77 };
+  pthread_create(&thread, NULL, set_producer, &prod);
+  while ((msg = FifoSet_rmv(&set, &idx)) == NULL) {
+    FifoSet_wait(&set);
+  }
+  pthread_join(thread, NULL);
+  if ((idx != 77) || (msg->arg1 != 42)) {
+    printf(LDR "fifo_set: ERROR woken with idx=%u arg1=%lu expected 77 and 42\n",
+        ldr(), idx, msg->arg1);
+    error |= true;
+  }
+  ret_msg(msg);
+
+  set_fifos_deinit(&set, fifos);
+  MsgPool_deinit(&pool);
+
+  printf(LDR "fifo_set:-error=%u\n\n", ldr(), error);
+  return error;
+}
+
+/**
+ * Compare polling every fifo with a FifoSet_t when one msg at a
+ * time is sent to one of many fifos.
+ */
+bool perf_fifo_set(const uint64_t loops) {
+  bool error = false;
+  MsgPool_t pool;
+  FifoSet_t set;
+  MpscFifo_t fifos[SET_FIFO_COUNT];
+  uint32_t idx;
+
+  printf(LDR "perf_fifo_set:+loops=%lu fifo_count=%u\n", ldr(), loops, SET_FIFO_COUNT);
+
+  if (MsgPool_init(&pool, SET_FIFO_COUNT + 1)
+      || set_fifos_init(&set, fifos, &pool, 8, false)) {
+    printf(LDR "perf_fifo_set: ERROR unable to create pool or set\n", ldr());
+    return true;
+  }
+  Msg_t* msg = MsgPool_get_msg(&pool);
+
+  uint32_t poll_idx = 0;
+  uint64_t time_start = ticks_serialized();
+  for (uint64_t i = 0; i < loops; i++) {
+    FifoSet_add(&set, (i * 7919) % SET_FIFO_COUNT, msg);
+    while ((msg = rmv_non_stalling(&fifos[poll_idx])) == NULL) {
+      poll_idx = (poll_idx + 1) < SET_FIFO_COUNT ? poll_idx + 1 : 0;
+    }
+  }
+  uint64_t time_poll = ticks_serialized();
+
+  // Clear the marks left by the polling
+  while (FifoSet_rmv(&set, &idx) != NULL) {
+  }
+
+  uint64_t time_set_start = ticks_serialized();
+  for (uint64_t i = 0; i < loops; i++) {
+    FifoSet_add(&set, (i * 7919) % SET_FIFO_COUNT, msg);
+    msg = FifoSet_rmv(&set, &idx);
+    if (msg == NULL) {
+      printf(LDR "perf_fifo_set: ERROR expected a msg\n", ldr());
+      error = true;
+      break;
+    }
+  }
+  uint64_t time_set = ticks_serialized();
+
+  printf(LDR "perf_fifo_set: poll ns_per_msg=%.1fns set ns_per_msg=%.1fns "
+      "visits=%lu empty_visits=%lu\n", ldr(),
+      diff_ticks_ns(time_poll, time_start) / (double)loops,
+      diff_ticks_ns(time_set, time_set_start) / (double)loops,
+      set.visits, set.empty_visits);
+  error |= results_save(RESULTS_BENCH, "fifo_set_poll", "ns_per_msg",
+      diff_ticks_ns(time_poll, time_start) / (double)loops);
+  error |= results_save(RESULTS_BENCH, "fifo_set", "ns_per_msg",
+      diff_ticks_ns(time_set, time_set_start) / (double)loops);
+
+  ret_msg(msg);
+  set_fifos_deinit(&set, fifos);
+  MsgPool_deinit(&pool);
+
+  printf(LDR "perf_fifo_set:-error=%u\n\n", ldr(), error);
+  return error;
+}
+
+/**
+ * Time MsgPool_init and getting every msg of a large pool, init
+ * shouldn't scale with msg_count as msgs are handed out lazily.
+ */
+bool perf_pool_init(const uint32_t msg_count) {
+  bool error = false;
+  MsgPool_t pool;
+
+  printf(LDR "perf_pool_init:+msg_count=%u\n", ldr(), msg_count);
+
+  uint64_t time_start = ticks_serialized();
+  if (MsgPool_init(&pool, msg_count)) {
+    printf(LDR "perf_pool_init: ERROR unable to create msgs for pool\n", ldr());
+    return true;
+  }
+  uint64_t time_init = ticks_serialized();
+
+  Msg_t* msgs = NULL;
+  for (uint32_t i = 0; i < msg_count; i++) {
+    Msg_t* msg = MsgPool_get_msg(&pool);
+    if (msg == NULL) {
+      printf(LDR "perf_pool_init: ERROR got %u msgs expected %u\n", ldr(), i, msg_count);
+      error = true;
+      break;
+    }
+    msg->pRspQ = (MpscFifo_t*)msgs;
+    msgs = msg;
+  }
+  uint64_t time_get = ticks_serialized();
+  if (MsgPool_get_msg(&pool) != NULL) {
+    printf(LDR "perf_pool_init: ERROR expected pool to be empty\n", ldr());
+    error = true;
+  }
+
+  while (msgs != NULL) {
+    Msg_t* pNext = (Msg_t*)msgs->pRspQ;
+    ret_msg(msgs);
+    msgs = pNext;
+  }
+  MsgPool_deinit(&pool);
+
+  printf(LDR "perf_pool_init: init ns=%.1f get ns_per_msg=%.1fns\n", ldr(),
+      diff_ticks_ns(time_init, time_start),
+      diff_ticks_ns(time_get, time_init) / (double)msg_count);
+  error |= results_save(RESULTS_BENCH, "pool_get", "ns_per_msg",
+      diff_ticks_ns(time_get, time_init) / (double)msg_count);
+  printf(LDR "perf_pool_init:-error=%u\n\n", ldr(), error);
+  return error;
+}
+
 int main(int argc, char* argv[]) {
   bool error = false;
 
@@ -202,10 +504,18 @@ int main(int argc, char* argv[]) {
 
   u_int64_t loops;
   sscanf(argv[1], "%lu", &loops);
-  printf("test loops=%lu\n", loops);
+  printf("test loops=%lu ordering=%s\n", loops, MPSCFIFO_ORDERING_NAME);
+
+  error |= timing_init();
+  printf("timing use_tsc=%u ns_per_tick=%.6f overhead=%lu\n",
+      gTiming.use_tsc, gTiming.ns_per_tick, gTiming.overhead);
 
   error |= simple();
+  error |= teardown();
+  error |= fifo_set();
   error |= perf(loops);
+  error |= perf_pool_init(1000000);
+  error |= perf_fifo_set(loops);
 
   if (!error) {
     printf("Success\n");
@@ -0,0 +1,179 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Test the C++ layer in mpscfifo.hpp
+ */
+
+#define NDEBUG
+
+#include "mpscfifo.hpp"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <type_traits>
+
+using mpscfifo::MpscFifo;
+using mpscfifo::MsgHandle;
+using mpscfifo::MsgPool;
+
+static_assert(!std::is_copy_constructible<MsgHandle<int>>::value, "MsgHandle must be move only");
+static_assert(std::is_move_constructible<MsgHandle<int>>::value, "MsgHandle must be movable");
+
+uint64_t gTick = 0;
+
+struct Payload {
+  std::string name;
+  uint64_t value;
+};
+
+bool simple(void) {
+  bool error = false;
+
+  printf(LDR "simple:+\n", ldr());
+
+  MsgPool<Payload> pool(3); // One more for the fifo
+  if (!pool.ok()) {
+    printf(LDR "simple: ERROR unable to create msgs for pool\n", ldr());
+    return true;
+  }
+
+  {
+    MpscFifo<Payload> fifo(pool);
+    if (!fifo.ok()) {
+      printf(LDR "simple: ERROR unable to get a stub for the fifo\n", ldr());
+      return true;
+    }
+
+    printf(LDR "simple: pop from empty fifo\n", ldr());
+    if (fifo.try_pop()) {
+      printf(LDR "simple: ERROR expected empty\n", ldr());
+      error |= true;
+    }
+
+    printf(LDR "simple: push typed payload\n", ldr());
+    MsgHandle<Payload> h = pool.get();
+    h->name = "one";
+    h->value = 1;
+    fifo.push(std::move(h));
+    if (h) {
+      printf(LDR "simple: ERROR expected push to consume the handle\n", ldr());
+      error |= true;
+    }
+
+    printf(LDR "simple: add from C with arg1\n", ldr());
+    MsgHandle<Payload> h2 = pool.get();
+    h2->name = "two";
+    h2->value = 2;
+    h2.msg()->arg1 = 22;
+    add(fifo.c_fifo(), &h2.release()->msg);
+
+    MsgHandle<Payload> r = fifo.try_pop();
+    if (!r || (r->name != "one") || (r->value != 1)) {
+      printf(LDR "simple: ERROR expected payload one\n", ldr());
+      error |= true;
+    }
+
+    MsgHandle<Payload> r2 = fifo.try_pop();
+    if (!r2 || (r2->name != "two") || (r2->value != 2) || (r2.msg()->arg1 != 22)) {
+      printf(LDR "simple: ERROR expected payload two arg1=22\n", ldr());
+      error |= true;
+    }
+
+    printf(LDR "simple: pool is empty while handles are held\n", ldr());
+    if (pool.get()) {
+      printf(LDR "simple: ERROR expected pool to be empty\n", ldr());
+      error |= true;
+    }
+
+    r = MsgHandle<Payload>();
+    if (!pool.get()) {
+      printf(LDR "simple: ERROR expected reset handle to return to the pool\n", ldr());
+      error |= true;
+    }
+  }
+
+  printf(LDR "simple: fifo from an empty pool isn't ok\n", ldr());
+  {
+    MsgPool<Payload> empty(0);
+    MpscFifo<Payload> fifo(empty);
+    if (fifo.ok()) {
+      printf(LDR "simple: ERROR expected fifo without a stub to not be ok\n", ldr());
+      error |= true;
+    }
+  }
+
+  printf(LDR "simple:-error=%u\n\n", ldr(), error);
+  return error;
+}
+
+bool perf(const uint64_t loops) {
+  bool error = false;
+
+  printf(LDR "perf:+loops=%lu\n", ldr(), loops);
+
+  MsgPool<uint64_t> pool(3);
+  if (!pool.ok()) {
+    printf(LDR "perf: ERROR unable to create msgs for pool\n", ldr());
+    return true;
+  }
+
+  {
+    MpscFifo<uint64_t> fifo(pool);
+    if (!fifo.ok()) {
+      printf(LDR "perf: ERROR unable to get a stub for the fifo\n", ldr());
+      return true;
+    }
+    MsgHandle<uint64_t> h = pool.get();
+
+    uint64_t time_start = ticks_serialized();
+    for (uint64_t i = 0; i < loops; i++) {
+      *h = i;
+      fifo.push(std::move(h));
+      h = fifo.try_pop();
+    }
+    uint64_t time_stop = ticks_serialized();
+
+    if (!h || (*h != (loops - 1))) {
+      printf(LDR "perf: ERROR expected last payload\n", ldr());
+      error |= true;
+    }
+
+    double processing_ns = diff_ticks_ns(time_stop, time_start);
+    printf(LDR "perf: push try_pop from empty fifo   ns_per_op=%.1fns\n", ldr(),
+        processing_ns / (double)loops);
+  }
+
+  printf(LDR "perf:-error=%u\n\n", ldr(), error);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 2) {
+    printf("Usage:\n");
+    printf(" %s loops\n", argv[0]);
+    return 1;
+  }
+
+  u_int64_t loops;
+  sscanf(argv[1], "%lu", &loops);
+  printf("test loops=%lu\n", loops);
+
+  error |= timing_init();
+  error |= simple();
+  error |= perf(loops);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
@@ -0,0 +1,232 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "dispatch.h"
+#include "spill.h"
+#include "dpf.h"
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/**
+ * Create a segment file in dir, it's unlinked so it goes away
+ * when closed.
+ *
+ * @return NULL if an error
+ */
+static SpillSegment_t* segment_create(const char* dir, uint32_t capacity) {
+  SpillSegment_t* seg = calloc(1, sizeof(SpillSegment_t));
+  if (seg == NULL) {
+    return NULL;
+  }
+  char path[256];
+  snprintf(path, sizeof(path), "%s/mpscfifo_spill_XXXXXX", dir);
+  seg->fd = mkstemp(path);
+  if (seg->fd < 0) {
+    printf(LDR "segment_create: ERROR unable to create %s\n", ldr(), path);
+    goto error;
+  }
+  unlink(path);
+  size_t size = (size_t)capacity * sizeof(SpillRecord_t);
+  if (ftruncate(seg->fd, (off_t)size) != 0) {
+    printf(LDR "segment_create: ERROR unable to size %s to %lu\n", ldr(), path, size);
+    goto error;
+  }
+  seg->records = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+  if (seg->records == MAP_FAILED) {
+    printf(LDR "segment_create: ERROR unable to map %s\n", ldr(), path);
+    goto error;
+  }
+  seg->capacity = capacity;
+  return seg;
+
+error:
+  if (seg->fd >= 0) {
+    close(seg->fd);
+  }
+  free(seg);
+  return NULL;
+}
+
+static void segment_destroy(SpillSegment_t* seg) {
+  munmap(seg->records, (size_t)seg->capacity * sizeof(SpillRecord_t));
+  close(seg->fd);
+  free(seg);
+}
+
+/**
+ * Append pMsg to the spill, called with the lock held.
+ *
+ * @return true if no segment could be created
+ */
+static bool append(SpillFifo_t* sf, Msg_t* pMsg) {
+  SpillSegment_t* seg = sf->pWriteSeg;
+  if ((seg == NULL) || (seg->write >= seg->capacity)) {
+    SpillSegment_t* pNew = segment_create(sf->dir, sf->segment_records);
+    if (pNew == NULL) {
+      return true;
+    }
+    __atomic_fetch_add(&sf->segments, 1, __ATOMIC_RELAXED);
+    if (seg == NULL) {
+      sf->pReadSeg = pNew;
+    } else {
+      seg->pNext = pNew;
+    }
+    sf->pWriteSeg = seg = pNew;
+  }
+  uint32_t write = seg->write;
+  SpillRecord_t* rec = &seg->records[write];
+  rec->rsp_q = (uint64_t)(uintptr_t)pMsg->pRspQ;
+  rec->arg1 = pMsg->arg1;
+  rec->arg2 = pMsg->arg2;
+  __atomic_store_n(&seg->write, write + 1, __ATOMIC_RELEASE);
+  return false;
+}
+
+/**
+ * @see spill.h
+ */
+bool SpillFifo_init(SpillFifo_t* sf, Msg_t* pStub, uint32_t threshold,
+    uint32_t segment_records, const char* dir, uint32_t replay_msg_count) {
+  memset(sf, 0, sizeof(*sf));
+  if (MsgPool_init_elastic(&sf->replay_pool, replay_msg_count, replay_msg_count, 1, 0)) {
+    printf(LDR "SpillFifo_init: ERROR sf=%p unable to create replay pool\n", ldr(), sf);
+    return true;
+  }
+  initMpscFifo(&sf->fifo, pStub);
+  sf->threshold = threshold;
+  sf->segment_records = segment_records;
+  sf->dir = dir;
+  pthread_mutex_init(&sf->lock, NULL);
+  return false;
+}
+
+/**
+ * @see spill.h
+ */
+void SpillFifo_deinit(SpillFifo_t* sf) {
+  deinitMpscFifo(&sf->fifo, NULL);
+  SpillSegment_t* seg = sf->pReadSeg;
+  while (seg != NULL) {
+    SpillSegment_t* pNext = seg->pNext;
+    segment_destroy(seg);
+    seg = pNext;
+  }
+  sf->pReadSeg = sf->pWriteSeg = NULL;
+  pthread_mutex_destroy(&sf->lock);
+  MsgPool_deinit(&sf->replay_pool);
+}
+
+/**
+ * @see spill.h
+ */
+void SpillFifo_add(SpillFifo_t* sf, Msg_t* pMsg) {
+  if ((__atomic_load_n(&sf->spilling, __ATOMIC_ACQUIRE) == 0)
+      && (Dispatch_depth(&sf->fifo) < sf->threshold)) {
+    Dispatch_add(&sf->fifo, pMsg);
+    return;
+  }
+
+  pthread_mutex_lock(&sf->lock);
+  if ((sf->spilling == 0) && (Dispatch_depth(&sf->fifo) < sf->threshold)) {
+    // The consumer caught up
+    pthread_mutex_unlock(&sf->lock);
+    Dispatch_add(&sf->fifo, pMsg);
+    return;
+  }
+  __atomic_store_n(&sf->spilling, 1, __ATOMIC_RELEASE);
+  bool error = append(sf, pMsg);
+  pthread_mutex_unlock(&sf->lock);
+
+  if (error) {
+    // Out of order but better than losing it
+    __atomic_fetch_add(&sf->spill_errors, 1, __ATOMIC_RELAXED);
+    Dispatch_add(&sf->fifo, pMsg);
+  } else {
+    __atomic_fetch_add(&sf->spilled, 1, __ATOMIC_RELAXED);
+    ret_msg(pMsg);
+  }
+}
+
+/**
+ * @see spill.h
+ */
+Msg_t* SpillFifo_rmv(SpillFifo_t* sf) {
+  while (true) {
+    // Snapshot what's been spilled before removing from the fifo. A
+    // producer adds its msgs to the fifo before it spills any, so the
+    // ones it added before the records below write are visible to rmv
+    // and are returned first.
+    uint32_t spilling = __atomic_load_n(&sf->spilling, __ATOMIC_ACQUIRE);
+    SpillSegment_t* seg = spilling != 0 ? sf->pReadSeg : NULL;
+    uint32_t write = seg != NULL ? __atomic_load_n(&seg->write, __ATOMIC_ACQUIRE) : 0;
+    Msg_t* msg = rmv(&sf->fifo);
+    if ((msg != NULL) || (spilling == 0)) {
+      return msg;
+    }
+
+    // The fifo is empty, replay
+    if ((seg != NULL) && (seg->read < write)) {
+      msg = MsgPool_get_msg(&sf->replay_pool);
+      if (msg == NULL) {
+        return NULL;
+      }
+      SpillRecord_t* rec = &seg->records[seg->read];
+      msg->pRspQ = (MpscFifo_t*)(uintptr_t)rec->rsp_q;
+      msg->arg1 = rec->arg1;
+      msg->arg2 = rec->arg2;
+      seg->read += 1;
+      sf->replayed += 1;
+      return msg;
+    }
+
+    pthread_mutex_lock(&sf->lock);
+    seg = sf->pReadSeg;
+    if ((seg != NULL) && (seg->read < seg->write)) {
+      // A producer appended, check the fifo again first
+      pthread_mutex_unlock(&sf->lock);
+      continue;
+    }
+    if ((seg != NULL) && (seg->pNext != NULL)) {
+      sf->pReadSeg = seg->pNext;
+      pthread_mutex_unlock(&sf->lock);
+      segment_destroy(seg);
+      continue;
+    }
+    // All replayed, reuse the last segment and resume the fifo
+    if (seg != NULL) {
+      seg->read = 0;
+      __atomic_store_n(&seg->write, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&sf->spilling, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sf->lock);
+    return rmv(&sf->fifo);
+  }
+}
+
+/**
+ * @see spill.h
+ */
+void SpillFifo_get_stats(SpillFifo_t* sf, SpillStats_t* stats) {
+  stats->spilled = __atomic_load_n(&sf->spilled, __ATOMIC_RELAXED);
+  stats->replayed = sf->replayed;
+  stats->segments = __atomic_load_n(&sf->segments, __ATOMIC_RELAXED);
+  stats->spill_errors = __atomic_load_n(&sf->spill_errors, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,116 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A SpillFifo_t is a MpscFifo_t which spills to memory mapped files
+ * under sustained overload rather than holding every msg in memory.
+ *
+ * When the depth reaches threshold a producer serializes the msg's
+ * pRspQ, arg1 and arg2 into an append only segment and returns the
+ * msg to its pool at once. Until the consumer has replayed all that
+ * was spilled every msg is spilled so a producer's msgs stay in
+ * order. The consumer removes from the fifo first and replays the
+ * spilled msgs, in msgs from its own replay pool, once the fifo is
+ * empty. It only replays the records spilled before it found the fifo
+ * empty, a later record may follow a msg still being added.
+ *
+ * Appending and switching segments is under a mutex, the consumer
+ * reads records without it. Segments hold segment_records records,
+ * are files created in dir and unlinked at once, and are unmapped
+ * when replayed except the last which is reused.
+ */
+
+#ifndef _SPILL_H
+#define _SPILL_H
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SpillRecord_t {
+  uint64_t rsp_q;
+  uint64_t arg1;
+  uint64_t arg2;
+} SpillRecord_t;
+
+typedef struct SpillSegment_t SpillSegment_t;
+
+typedef struct SpillSegment_t {
+  SpillSegment_t* pNext;
+  SpillRecord_t* records;
+  uint32_t capacity;
+  ATOMIC(uint32_t) write;   // Published with release after the record is written
+  uint32_t read;            // Only used by the consumer
+  int fd;
+} SpillSegment_t;
+
+typedef struct SpillStats_t {
+  uint64_t spilled;
+  uint64_t replayed;
+  uint64_t segments;        // Segments created
+  uint64_t spill_errors;    // Msgs added to the fifo because a segment couldn't be created
+} SpillStats_t;
+
+typedef struct SpillFifo_t {
+  MpscFifo_t fifo;
+  uint32_t threshold;
+  uint32_t segment_records;
+  const char* dir;
+
+  pthread_mutex_t lock;
+  ATOMIC(uint32_t) spilling;
+  SpillSegment_t* pWriteSeg;    // Under lock
+  SpillSegment_t* pReadSeg;     // Only changed by the consumer under lock
+
+  MsgPool_t replay_pool;
+  ATOMIC(uint64_t) spilled;
+  ATOMIC(uint64_t) segments;
+  ATOMIC(uint64_t) spill_errors;
+  uint64_t replayed;            // Only used by the consumer
+} SpillFifo_t;
+
+/**
+ * Initialize sf with pStub. Msgs spill once threshold are queued in
+ * memory, replay_msg_count is the initial size of the replay pool
+ * which grows as needed.
+ *
+ * @return true if an error.
+ */
+bool SpillFifo_init(SpillFifo_t* sf, Msg_t* pStub, uint32_t threshold,
+    uint32_t segment_records, const char* dir, uint32_t replay_msg_count);
+
+/**
+ * Deinitialize sf, it must be empty and the replayed msgs returned.
+ */
+void SpillFifo_deinit(SpillFifo_t* sf);
+
+/**
+ * Add pMsg, may be used by multiple producers.
+ */
+void SpillFifo_add(SpillFifo_t* sf, Msg_t* pMsg);
+
+/**
+ * Remove a msg, used only by the consumer.
+ *
+ * @return NULL if empty
+ */
+Msg_t* SpillFifo_rmv(SpillFifo_t* sf);
+
+/**
+ * Return the statistics, replayed is only current if called by the
+ * consumer.
+ */
+void SpillFifo_get_stats(SpillFifo_t* sf, SpillStats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
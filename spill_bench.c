@@ -0,0 +1,241 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Overload a consumer 10x with and without spilling.
+ *
+ * The consumer spins work_ns per msg and the producers together send
+ * 10 times faster than that, each with at most window msgs from its
+ * pool outstanding. Without spilling a producer runs out of msgs
+ * and stalls, with spilling its msgs are returned as soon as they're
+ * written to a segment so it keeps sending at the offered rate. The
+ * consumer checks every producer's msgs arrive in order.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "spill.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OVERLOAD 10
+#define SEGMENT_RECORDS (64 * 1024)
+#define REPLAY_MSG_COUNT 64
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Producer {
+  pthread_t thread;
+  MsgPool_t pool;
+  SpillFifo_t* sf;
+  uint32_t idx;
+  uint64_t msg_count;
+  uint64_t gap_ticks;
+  uint64_t no_msgs;
+  uint64_t time_start;
+  uint64_t time_stop;
+} Producer;
+
+typedef struct Consumer {
+  pthread_t thread;
+  SpillFifo_t* sf;
+  uint32_t producer_count;
+  uint64_t work_ns;
+  _Atomic(uint32_t)* pProducersDone;
+  uint64_t* next_seq;       // Per producer
+  uint64_t received;
+  uint64_t out_of_order;
+  uint64_t time_stop;
+} Consumer;
+
+static void* producer(void* p) {
+  Producer* prod = (Producer*)p;
+
+  prod->time_start = ticks();
+  uint64_t next_send = prod->time_start;
+  for (uint64_t seq = 0; seq < prod->msg_count; seq++) {
+    while (ticks() < next_send) {
+      sched_yield();
+    }
+    next_send += prod->gap_ticks;
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&prod->pool)) == NULL) {
+      prod->no_msgs += 1;
+      sched_yield();
+    }
+    msg->arg1 = prod->idx;
+    msg->arg2 = seq;
+    SpillFifo_add(prod->sf, msg);
+  }
+  prod->time_stop = ticks();
+  return NULL;
+}
+
+static void* consumer(void* p) {
+  Consumer* c = (Consumer*)p;
+
+  while (true) {
+    Msg_t* msg = SpillFifo_rmv(c->sf);
+    if (msg == NULL) {
+      if (__atomic_load_n(c->pProducersDone, __ATOMIC_ACQUIRE) == c->producer_count) {
+        // Check again as the msgs may have been added before done
+        if ((msg = SpillFifo_rmv(c->sf)) == NULL) {
+          break;
+        }
+      } else {
+        sched_yield();
+        continue;
+      }
+    }
+    if (msg->arg2 != c->next_seq[msg->arg1]) {
+      c->out_of_order += 1;
+    }
+    c->next_seq[msg->arg1] = msg->arg2 + 1;
+    c->received += 1;
+    spin_ns(c->work_ns);
+    ret_msg(msg);
+  }
+  c->time_stop = ticks();
+  return NULL;
+}
+
+bool run(bool spill, uint32_t producer_count, uint64_t msg_count, uint32_t window,
+    uint64_t work_ns, uint32_t threshold) {
+  bool error = false;
+  const char* mode_name = spill ? "spill" : "memory";
+  SpillFifo_t sf;
+  MsgPool_t stubs;
+  Consumer c;
+  _Atomic(uint32_t) producers_done = 0;
+
+  Producer* producers = calloc(producer_count, sizeof(Producer));
+  uint64_t* next_seq = calloc(producer_count, sizeof(uint64_t));
+  if ((producers == NULL) || (next_seq == NULL) || MsgPool_init(&stubs, 1)) {
+    printf(LDR "run: ERROR unable to allocate\n", ldr());
+    return true;
+  }
+  if (SpillFifo_init(&sf, MsgPool_get_msg(&stubs), spill ? threshold : UINT32_MAX,
+        SEGMENT_RECORDS, "/tmp", REPLAY_MSG_COUNT)) {
+    return true;
+  }
+
+  memset(&c, 0, sizeof(c));
+  c.sf = &sf;
+  c.producer_count = producer_count;
+  c.work_ns = work_ns;
+  c.pProducersDone = &producers_done;
+  c.next_seq = next_seq;
+  pthread_create(&c.thread, NULL, consumer, &c);
+
+  // Together the producers offer OVERLOAD times what the consumer can do
+  uint64_t gap_ticks = (uint64_t)(((double)work_ns * producer_count / OVERLOAD)
+      / gTiming.ns_per_tick);
+  uint64_t time_start = ticks_serialized();
+  for (uint32_t i = 0; i < producer_count; i++) {
+    Producer* prod = &producers[i];
+    if (MsgPool_init(&prod->pool, window)) {
+      printf(LDR "run: ERROR unable to create producer pool\n", ldr());
+      return true;
+    }
+    prod->sf = &sf;
+    prod->idx = i;
+    prod->msg_count = msg_count;
+    prod->gap_ticks = gap_ticks;
+    pthread_create(&prod->thread, NULL, producer, prod);
+  }
+
+  uint64_t no_msgs = 0;
+  uint64_t send_ticks = 0;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+    no_msgs += producers[i].no_msgs;
+    if (producers[i].time_stop - time_start > send_ticks) {
+      send_ticks = producers[i].time_stop - time_start;
+    }
+  }
+  __atomic_store_n(&producers_done, producer_count, __ATOMIC_RELEASE);
+  pthread_join(c.thread, NULL);
+
+  SpillStats_t stats;
+  SpillFifo_get_stats(&sf, &stats);
+  SpillFifo_deinit(&sf);
+  for (uint32_t i = 0; i < producer_count; i++) {
+    MsgPool_deinit(&producers[i].pool);
+  }
+  MsgPool_deinit(&stubs);
+
+  uint64_t expected = msg_count * producer_count;
+  if ((c.received != expected) || (c.out_of_order != 0)) {
+    printf(LDR "run: ERROR %s received=%lu expected=%lu out_of_order=%lu\n",
+        ldr(), mode_name, c.received, expected, c.out_of_order);
+    error = true;
+  }
+
+  double offered_secs = ticks_to_ns(gap_ticks * msg_count) / ns_flt;
+  double send_secs = ticks_to_ns(send_ticks) / ns_flt;
+  double total_secs = ticks_to_ns(c.time_stop - time_start) / ns_flt;
+  printf("%-6s offered_per_sec=%.0f sent_per_sec=%.0f consumed_per_sec=%.0f "
+      "no_msgs=%lu spilled=%lu segments=%lu\n", mode_name,
+      offered_secs != 0.0 ? (double)expected / offered_secs : 0.0,
+      (double)expected / send_secs, (double)c.received / total_secs,
+      no_msgs, stats.spilled, stats.segments);
+
+  free(next_seq);
+  free(producers);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 6) {
+    printf("Usage:\n");
+    printf(" %s producer_count msg_count window work_ns threshold\n", argv[0]);
+    printf("  the consumer spins work_ns per msg and the producers offer %u times that,\n",
+        OVERLOAD);
+    printf("  each sends msg_count msgs with at most window outstanding and spills\n");
+    printf("  once threshold msgs are queued\n");
+    return 1;
+  }
+
+  u_int32_t producer_count;
+  sscanf(argv[1], "%u", &producer_count);
+  u_int64_t msg_count;
+  sscanf(argv[2], "%lu", &msg_count);
+  u_int32_t window;
+  sscanf(argv[3], "%u", &window);
+  u_int64_t work_ns;
+  sscanf(argv[4], "%lu", &work_ns);
+  u_int32_t threshold;
+  sscanf(argv[5], "%u", &threshold);
+  printf("spill_bench producer_count=%u msg_count=%lu window=%u work_ns=%lu threshold=%u\n",
+      producer_count, msg_count, window, work_ns, threshold);
+
+  if ((producer_count == 0) || (window == 0)) {
+    printf("producer_count and window must be > 0\n");
+    return 1;
+  }
+
+  error |= timing_init();
+  error |= run(false, producer_count, msg_count, window, work_ns, threshold);
+  error |= run(true, producer_count, msg_count, window, work_ns, threshold);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}
@@ -15,9 +15,17 @@
 
 #include "mpscfifo.h"
 #include "msg_pool.h"
+#include "dispatch.h"
+#include "histo.h"
 #include "diff_timespec.h"
+#include "perf_counters.h"
+#include "trace.h"
+#include "capture.h"
+#include "fault.h"
+#include "results.h"
 #include "dpf.h"
 
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <pthread.h>
 
@@ -27,7 +35,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <semaphore.h>
+#include <unistd.h>
 
 /**
  * We pass pointers in Msg_t.arg2 which is a uint64_t,
@@ -44,39 +54,129 @@ typedef struct ClientParams {
   MpscFifo_t cmdFifo;
 
   pthread_t thread;
+  uint32_t idx;
   uint32_t msg_count;
   uint32_t max_peer_count;
+  uint32_t topology;
+  const double* zipf_cdf;   // Of max_peer_count - 1 peers for TopoZipf
 
   ClientParams** peers;
+  uint32_t* peer_ids;       // peers[i]->idx for Dispatch_pick_p2c
   uint32_t peer_send_idx;
   uint32_t peers_connected;
+  bool p2c;                 // Send to peers with Dispatch_pick_p2c
+  DispatchSent_t* sent;     // Sequence counters of all the clients if p2c
+  Dispatch_t dispatch;
 
 
   MsgPool_t pool;
+  uint32_t slab_msg_count;  // 0 for a fixed size pool
+  MsgPoolStats_t pool_stats;
+  uint64_t trim_tick;       // When the pool was last trimmed
+
+  uint32_t reqs_outstanding; // TopoReqRep requests without a CmdDidNothing yet
+  Msg_t* deferred;          // CmdDisconnectAll or CmdStop held until reqs_outstanding is 0
 
   uint64_t error_count;
   uint64_t cmds_processed;
   uint64_t msgs_processed;
+  uint64_t no_msgs;         // Msgs not sent to peers as the pool was empty
+  Histo_t latency;          // Ticks from send to delivery, or the round trip for TopoReqRep
   sem_t sem_ready;
   sem_t sem_waiting;
+
+  pid_t tid;
+  PerfCounters_t perf;
 } ClientParams;
 
+// Trim grown slabs at most this often, trimming visits every free msg
+#define TRIM_INTERVAL_NS 10000000ull
+
 #define CmdUnknown       0 // arg2 == the command that's unknown
-#define CmdDoNothing     1
-#define CmdDidNothing    2
+#define CmdDoNothing     1 // arg2 == tick sent
+#define CmdDidNothing    2 // arg2 == tick sent
 #define CmdConnect       3 // arg2 == MpscFifo_t* to connect with
 #define CmdConnected     4 // arg2 == MpscFifo_t* connected to
 #define CmdDisconnectAll 5
 #define CmdDisconnected  6
 #define CmdStop          7
 #define CmdStopped       8
-#define CmdSendToPeers   9
+#define CmdSendToPeers   9 // arg2 == tick due if open loop otherwise 0
 #define CmdSent          10
+#define CmdConnectPeers  11 // arg2 == PeerList* of clients to connect with except self
+
+/**
+ * How the clients are connected and who they send to:
+ *
+ *  mesh      every client sends to every other, the default
+ *  ring      each client sends to the next
+ *  star      every client sends to client 0, the aggregator
+ *  zipf      every client sends to the others picked with a zipf
+ *            distribution so the low numbered clients are hot
+ *  pipeline  client 0 sends to client 1 which forwards to client 2
+ *            and so on, the last client is the sink
+ *  reqrep    as mesh but each msg is a request and the peer responds
+ */
+#define TopoMesh     0
+#define TopoRing     1
+#define TopoStar     2
+#define TopoZipf     3
+#define TopoPipeline 4
+#define TopoReqRep   5
+#define TOPO_COUNT   6
+static const char* topo_names[TOPO_COUNT] = {
+  "mesh", "ring", "star", "zipf", "pipeline", "reqrep"
+};
+
+/**
+ * Return true if client from sends to client to
+ */
+static bool topo_connects(uint32_t topology, uint32_t from, uint32_t to, uint32_t count) {
+  if (from == to) {
+    return false;
+  }
+  switch (topology) {
+    case TopoRing:     return to == (from + 1) % count;
+    case TopoStar:     return to == 0;
+    case TopoPipeline: return to == from + 1;
+    default:           return true;
+  }
+}
+
+/**
+ * Return true if client c is sent CmdSendToPeers
+ */
+static bool topo_is_source(uint32_t topology, uint32_t c) {
+  switch (topology) {
+    case TopoStar:     return c != 0;
+    case TopoPipeline: return c == 0;
+    default:           return true;
+  }
+}
+
+/**
+ * The clients to connect with, sent in one CmdConnectPeers
+ * rather than a CmdConnect per peer.
+ */
+typedef struct PeerList {
+  ClientParams* clients;
+  uint32_t count;
+} PeerList;
+
+#define DEINIT_TIMEOUT_NS 1000000000ull
+
+#define CAPTURE_MAX_RECORDS (16 * 1024 * 1024)
+
+#define PHASE_COUNT 5
+static const char* phase_names[PHASE_COUNT] = {
+  "startup", "looping", "disconnecting", "stopping", "complete"
+};
 
 /**
- * Send messages CmdDoNothing to all of the peers
+ * Send messages CmdDoNothing to all of the peers, sent is the tick
+ * recorded in arg2 for the latency.
  */
-void send_to_peers(ClientParams* cp) {
+void send_to_peers(ClientParams* cp, uint64_t sent) {
   DPF(LDR "send_to_peers:+param=%p\n", ldr(), cp);
 
   for (uint32_t i = 0; i < cp->peers_connected; i++) {
@@ -84,20 +184,37 @@ void send_to_peers(ClientParams* cp) {
     if (msg == NULL) {
       DPF(LDR "send_to_peers: param=%p whoops no more messages, sent to %u peers\n",
           ldr(), cp, i);
+      cp->no_msgs += cp->peers_connected - i;
       return;
     }
-    ClientParams* peer = cp->peers[cp->peer_send_idx];
+    ClientParams* peer;
+    if (cp->topology == TopoZipf) {
+      peer = cp->peers[Dispatch_pick_cdf(&cp->dispatch, cp->zipf_cdf, cp->peers_connected)];
+    } else if (cp->p2c) {
+      peer = cp->peers[Dispatch_pick_p2c(&cp->dispatch, cp->peer_ids, cp->peers_connected)];
+    } else {
+      peer = cp->peers[cp->peer_send_idx];
+      cp->peer_send_idx += 1;
+      if (cp->peer_send_idx >= cp->peers_connected) {
+        cp->peer_send_idx = 0;
+      }
+    }
     msg->arg1 = CmdDoNothing;
+    msg->arg2 = sent;
+    if (cp->topology == TopoReqRep) {
+      msg->pRspQ = &cp->cmdFifo;
+      cp->reqs_outstanding += 1;
+    }
     DPF(LDR "send_to_peers: param=%p send to peer=%p msg=%p msg->arg1=%lu CmdDoNothing\n",
        ldr(), cp, peer, msg, msg->arg1);
-    add(&peer->cmdFifo, msg);
+    if (cp->p2c) {
+      Dispatch_send(&cp->dispatch, peer->idx, &peer->cmdFifo, msg);
+    } else {
+      add(&peer->cmdFifo, msg);
+    }
     sem_post(&peer->sem_waiting);
     DPF(LDR "send_to_peers: param=%p SENT to peer=%p msg=%p msg->arg1=%lu CmdDoNothing\n",
        ldr(), cp, peer, msg, msg->arg1);
-    cp->peer_send_idx += 1;
-    if (cp->peer_send_idx >= cp->peers_connected) {
-      cp->peer_send_idx = 0;
-    }
   }
   DPF(LDR "send_to_peers:-param=%p\n", ldr(), cp);
 }
@@ -108,15 +225,22 @@ static void* client(void* p) {
 
   ClientParams* cp = (ClientParams*)p;
 
+  cp->tid = (pid_t)syscall(SYS_gettid);
   cp->error_count = 0;
   cp->cmds_processed = 0;
   cp->msgs_processed = 0;
+  cp->no_msgs = 0;
+  cp->trim_tick = ticks();
+  cp->reqs_outstanding = 0;
+  cp->deferred = NULL;
+  Histo_clear(&cp->latency);
 
   if (cp->max_peer_count > 0) {
     DPF(LDR "client: param=%p allocate peers max_peer_count=%u\n",
         ldr(), p, cp->max_peer_count);
     cp->peers = malloc(sizeof(ClientParams*) * cp->max_peer_count);
-    if (cp->peers == NULL) {
+    cp->peer_ids = malloc(sizeof(uint32_t) * cp->max_peer_count);
+    if ((cp->peers == NULL) || (cp->peer_ids == NULL)) {
       printf(LDR "client: param=%p ERROR unable to allocate peers max_peer_count=%u\n",
           ldr(), p, cp->max_peer_count);
       cp->error_count += 1;
@@ -125,14 +249,20 @@ static void* client(void* p) {
     DPF(LDR "client: param=%p No peers max_peer_count=%d\n",
         ldr(), p, cp->max_peer_count);
     cp->peers = NULL;
+    cp->peer_ids = NULL;
   }
   cp->peers_connected = 0;
   cp->peer_send_idx = 0;
+  Dispatch_init(&cp->dispatch, (uint64_t)cp->tid);
+  if (cp->sent != NULL) {
+    Dispatch_attach(&cp->dispatch, cp->sent, cp->idx);
+  }
 
 
   // Init local msg pool
   DPF(LDR "client: init msg pool=%p\n", ldr(), &cp->pool);
-  bool error = MsgPool_init(&cp->pool, cp->msg_count + 1); // One more for the cmdFifo
+  bool error = MsgPool_init_elastic(&cp->pool, cp->msg_count + 1, // One more for the cmdFifo
+      cp->slab_msg_count, cp->max_peer_count, 0);
   if (error) {
     printf(LDR "client: param=%p ERROR unable to create msgs for pool\n", ldr(), p);
     cp->error_count += 1;
@@ -152,7 +282,17 @@ static void* client(void* p) {
   while (true) {
     DPF(LDR "client: param=%p waiting\n", ldr(), p);
 #if USE_RMV == 1
-    sem_wait(&cp->sem_waiting);
+    if (sem_trywait(&cp->sem_waiting) != 0) {
+      // Idle, give back any grown slabs
+      if (cp->pool.slabs != NULL) {
+        uint64_t now = ticks();
+        if (ticks_to_ns(now - cp->trim_tick) >= (double)TRIM_INTERVAL_NS) {
+          cp->trim_tick = now;
+          MsgPool_trim(&cp->pool);
+        }
+      }
+      sem_wait(&cp->sem_waiting);
+    }
     while((msg = rmv(&cp->cmdFifo)) != NULL) {
 #else
     sched_yield();
@@ -165,12 +305,59 @@ static void* client(void* p) {
         switch (msg->arg1) {
           case CmdDoNothing: {
             DPF(LDR "client:+param=%p msg=%p CmdDoNothing\n", ldr(), p, msg);
-            send_rsp_or_ret(msg, CmdDidNothing);
+            if (cp->sent != NULL) {
+              // Only the peers' msgs count toward our p2c depth, not
+              // the CmdSendToPeers and control msgs from main
+              Dispatch_done(cp->sent, cp->idx);
+            }
+            if ((cp->topology == TopoPipeline) && (cp->peers_connected != 0)) {
+              // Forward to the next stage
+              ClientParams* peer = cp->peers[0];
+              if (cp->p2c) {
+                Dispatch_send(&cp->dispatch, peer->idx, &peer->cmdFifo, msg);
+              } else {
+                add(&peer->cmdFifo, msg);
+              }
+              sem_post(&peer->sem_waiting);
+            } else {
+              if (msg->pRspQ == NULL) {
+                Histo_record(&cp->latency, ticks() - msg->arg2);
+                send_rsp_or_ret(msg, CmdDidNothing);
+              } else {
+                // Wake the requester, it may be waiting for its last
+                // response to answer a deferred CmdDisconnectAll
+                ClientParams* requester = (ClientParams*)((char*)msg->pRspQ -
+                    offsetof(ClientParams, cmdFifo));
+                send_rsp_or_ret(msg, CmdDidNothing);
+                sem_post(&requester->sem_waiting);
+              }
+            }
             DPF(LDR "client:-param=%p msg=%p CmdDoNothing\n", ldr(), p, msg);
             break;
           }
+          case CmdDidNothing: {
+            // The response to a TopoReqRep request
+            Histo_record(&cp->latency, ticks() - msg->arg2);
+            ret_msg(msg);
+            cp->reqs_outstanding -= 1;
+            if ((cp->reqs_outstanding == 0) && (cp->deferred != NULL)) {
+              // The last round trip is done, answer the deferred cmd
+              bool stop = cp->deferred->arg1 == CmdStop;
+              send_rsp_or_ret(cp->deferred, stop ? CmdStopped : CmdDisconnected);
+              cp->deferred = NULL;
+              if (stop) {
+                goto done;
+              }
+            }
+            break;
+          }
           case CmdStop: {
             DPF(LDR "client: param=%p msg=%p CmdStop\n", ldr(), p, msg);
+            if (cp->reqs_outstanding != 0) {
+              // Our cmdFifo must outlive the responses to our requests
+              cp->deferred = msg;
+              break;
+            }
             send_rsp_or_ret(msg, CmdStopped);
             DPF(LDR "client:-param=%p msg=%p CmdStop\n", ldr(), p, msg);
             goto done;
@@ -178,9 +365,11 @@ static void* client(void* p) {
           case CmdConnect: {
             DPF(LDR "client:+param=%p msg=%p CmdConnect peers_connected=%u max_peer_count=%u\n",
                 ldr(), p, msg, cp->peers_connected, cp->max_peer_count);
-            if (cp->peers != NULL) {
+            if ((cp->peers != NULL) && topo_connects(cp->topology, cp->idx,
+                  ((ClientParams*)msg->arg2)->idx, cp->max_peer_count)) {
               if (cp->peers_connected < cp->max_peer_count) {
                 cp->peers[cp->peers_connected] = (ClientParams*)msg->arg2;
+                cp->peer_ids[cp->peers_connected] = cp->peers[cp->peers_connected]->idx;
                 DPF(LDR "client: param=%p CmdConnect to peer=%p\n",
                     ldr(), p, cp->peers[cp->peers_connected]);
                 cp->peers_connected += 1;
@@ -196,12 +385,46 @@ static void* client(void* p) {
                 ldr(), p, msg, cp->peers_connected, cp->max_peer_count);
             break;
           }
+          case CmdConnectPeers: {
+            PeerList* peer_list = (PeerList*)msg->arg2;
+            DPF(LDR "client:+param=%p msg=%p CmdConnectPeers count=%u\n",
+                ldr(), p, msg, peer_list->count);
+            if (cp->peers != NULL) {
+              for (uint32_t i = 0; i < peer_list->count; i++) {
+                ClientParams* peer = &peer_list->clients[i];
+                if (!topo_connects(cp->topology, cp->idx, peer->idx, peer_list->count)) {
+                  continue;
+                }
+                if (cp->peers_connected < cp->max_peer_count) {
+                  cp->peer_ids[cp->peers_connected] = peer->idx;
+                  cp->peers[cp->peers_connected++] = peer;
+                } else {
+                  printf(LDR "client: param=%p CmdConnectPeers ERROR to many peers "
+                      "peers_connected=%u >= cp->max_peer_count=%u\n",
+                      ldr(), p, cp->peers_connected, cp->max_peer_count);
+                  cp->error_count += 1;
+                  break;
+                }
+              }
+            }
+            // The PeerList may be gone once we respond
+            send_rsp_or_ret(msg, CmdConnected);
+            DPF(LDR "client:-param=%p msg=%p CmdConnectPeers peers_connected=%u\n",
+                ldr(), p, msg, cp->peers_connected);
+            break;
+          }
           case CmdDisconnectAll: {
             DPF(LDR "client:+param=%p msg=%p CmdDisconnectAll peers_connected=%u max_peer_count=%u\n",
                 ldr(), p, msg, cp->peers_connected, cp->max_peer_count);
             if (cp->peers != NULL) {
               cp->peers_connected = 0;
             }
+            if (cp->reqs_outstanding != 0) {
+              // Answered once the responses to our requests arrive so
+              // no peer responds after it's stopped
+              cp->deferred = msg;
+              break;
+            }
             send_rsp_or_ret(msg, CmdDisconnected);
             DPF(LDR "client:-param=%p msg=%p CmdDisconnectAll peers_connected=%u max_peer_count=%u\n",
                 ldr(), p, msg, cp->peers_connected, cp->max_peer_count);
@@ -209,8 +432,9 @@ static void* client(void* p) {
           }
           case CmdSendToPeers: {
             DPF(LDR "client:+param=%p msg=%p CmdSendToPeers\n", ldr(), p, msg);
+            uint64_t sent = msg->arg2 != 0 ? msg->arg2 : ticks();
             send_rsp_or_ret(msg, CmdSent);
-            send_to_peers(cp);
+            send_to_peers(cp, sent);
             DPF(LDR "client:-param=%p msg=%p CmdSendToPeers\n", ldr(), p, msg);
             break;
           }
@@ -236,11 +460,9 @@ static void* client(void* p) {
 done:
   // Flush any messages in the cmdFifo
   DPF(LDR "client: param=%p done, flushing fifo\n", ldr(), p);
-  uint32_t unprocessed = 0;
-  while ((msg = RMV(&cp->cmdFifo)) != NULL) {
-    printf(LDR "client: param=%p ret msg=%p\n", ldr(), p, msg);
-    unprocessed += 1;
-    ret_msg(msg);
+  uint32_t unprocessed = drain(&cp->cmdFifo);
+  if (unprocessed != 0) {
+    printf(LDR "client: param=%p returned %u unprocessed msgs\n", ldr(), p, unprocessed);
   }
 
   // deinit cmd fifo
@@ -248,6 +470,7 @@ done:
   cp->msgs_processed = deinitMpscFifo(&cp->cmdFifo, NULL);
 
   // deinit msg pool
+  MsgPool_get_stats(&cp->pool, &cp->pool_stats);
   DPF(LDR "client: param=%p deinit msg pool=%p\n", ldr(), p, &cp->pool);
   cp->msgs_processed += MsgPool_deinit(&cp->pool);
 
@@ -287,27 +510,197 @@ uint32_t wait_for_rsp(MpscFifo_t* fifo, uint64_t rsp_expected, void* client, uin
   return retv;
 }
 
+/**
+ * Sum the counters of the main thread and the clients into sample
+ */
+static void perf_snapshot(PerfCounters_t* main_perf, ClientParams* clients,
+    uint32_t clients_created, PerfSample_t* sample) {
+  PerfSample_clear(sample);
+  PerfCounters_read(main_perf, sample);
+  for (uint32_t i = 0; i < clients_created; i++) {
+    PerfCounters_read(&clients[i].perf, sample);
+  }
+}
+
+/**
+ * Report the counters per message for each phase
+ */
+static void perf_report(PerfSample_t samples[PHASE_COUNT + 1], uint64_t msgs_processed) {
+  for (uint32_t phase = 0; phase < PHASE_COUNT; phase++) {
+    PerfSample_t* begin = &samples[phase];
+    PerfSample_t* end = &samples[phase + 1];
+    printf(LDR "perf %s:", ldr(), phase_names[phase]);
+    for (uint32_t i = 0; i < PC_COUNT; i++) {
+      if (end->valid[i]) {
+        uint64_t delta = end->values[i] - begin->values[i];
+        printf(" %s=%lu(%.3f/msg)", PerfCounters_name(i), delta,
+            msgs_processed != 0 ? (double)delta / (double)msgs_processed : 0.0);
+      } else {
+        printf(" %s=n/a", PerfCounters_name(i));
+      }
+    }
+    printf("\n");
+  }
+}
+
+/**
+ * Check a response and return it to its pool
+ *
+ * Return 0 if successful !0 if an error
+ */
+static uint32_t check_rsp(Msg_t* msg, uint64_t rsp_expected) {
+  uint32_t retv = 0;
+  if (msg->arg1 != rsp_expected) {
+    printf(LDR "check_rsp: ERROR unexpected arg1=%lu expected %lu arg2=%lu\n",
+        ldr(), msg->arg1, rsp_expected, msg->arg2);
+    retv = 1;
+  }
+  ret_msg(msg);
+  return retv;
+}
+
+/**
+ * Get a msg from pool for a command, if there are none responses
+ * already on cmdFifo are checked so their msgs can be reused.
+ */
+static Msg_t* get_cmd_msg(MpscFifo_t* cmdFifo, MsgPool_t* pool, uint64_t rsp_expected,
+    uint32_t* rsps_received, uint32_t* errors) {
+  Msg_t* msg;
+  while ((msg = MsgPool_get_msg(pool)) == NULL) {
+    Msg_t* rsp = RMV(cmdFifo);
+    if (rsp != NULL) {
+      *errors += check_rsp(rsp, rsp_expected);
+      *rsps_received += 1;
+    } else {
+      sched_yield();
+    }
+  }
+  return msg;
+}
+
+/**
+ * Send cmd to a client and wait for its response
+ *
+ * Return 0 if successful !0 if an error
+ */
+static uint32_t send_cmd(MpscFifo_t* cmdFifo, MsgPool_t* pool, ClientParams* client,
+    uint32_t client_idx, uint64_t cmd, uint64_t arg2, uint64_t rsp_expected) {
+  uint32_t rsps_received = 0;
+  uint32_t errors = 0;
+  Msg_t* msg = get_cmd_msg(cmdFifo, pool, rsp_expected, &rsps_received, &errors);
+  msg->pRspQ = cmdFifo;
+  msg->arg1 = cmd;
+  msg->arg2 = arg2;
+  DPF(LDR "send_cmd: send client=%p msg=%p arg1=%lu\n", ldr(), client, msg, msg->arg1);
+  add(&client->cmdFifo, msg);
+  sem_post(&client->sem_waiting);
+  return errors + wait_for_rsp(cmdFifo, rsp_expected, client, client_idx);
+}
+
+/**
+ * Send cmd to every client without waiting then wait for all of
+ * the responses, so there is one round trip however many clients
+ * there are.
+ *
+ * Return 0 if successful !0 if an error
+ */
+static uint32_t send_to_all(MpscFifo_t* cmdFifo, MsgPool_t* pool, ClientParams* clients,
+    uint32_t clients_created, uint64_t cmd, uint64_t arg2, uint64_t rsp_expected) {
+  uint32_t rsps_received = 0;
+  uint32_t errors = 0;
+  for (uint32_t i = 0; i < clients_created; i++) {
+    ClientParams* client = &clients[i];
+    Msg_t* msg = get_cmd_msg(cmdFifo, pool, rsp_expected, &rsps_received, &errors);
+    msg->pRspQ = cmdFifo;
+    msg->arg1 = cmd;
+    msg->arg2 = arg2;
+    DPF(LDR "send_to_all: send %u client=%p msg=%p arg1=%lu\n", ldr(), i, client, msg, msg->arg1);
+    add(&client->cmdFifo, msg);
+    sem_post(&client->sem_waiting);
+  }
+  while (rsps_received < clients_created) {
+    Msg_t* msg = RMV(cmdFifo);
+    if (msg != NULL) {
+      errors += check_rsp(msg, rsp_expected);
+      rsps_received += 1;
+    } else {
+      sched_yield();
+    }
+  }
+  return errors;
+}
+
+/**
+ * Send cmd to every client, serially waiting for each response if
+ * serial_ctrl otherwise pipelined.
+ *
+ * Return 0 if successful !0 if an error
+ */
+static uint32_t ctrl_all(MpscFifo_t* cmdFifo, MsgPool_t* pool, ClientParams* clients,
+    uint32_t clients_created, bool serial_ctrl, uint64_t cmd, uint64_t rsp_expected) {
+  if (!serial_ctrl) {
+    return send_to_all(cmdFifo, pool, clients, clients_created, cmd, 0, rsp_expected);
+  }
+  uint32_t errors = 0;
+  for (uint32_t i = 0; i < clients_created; i++) {
+    errors += send_cmd(cmdFifo, pool, &clients[i], i, cmd, 0, rsp_expected);
+  }
+  return errors;
+}
+
+/**
+ * Print the sum of the clients pool stats and the main pool stats
+ */
+static void pool_stats_report(ClientParams* clients, uint32_t clients_created,
+    MsgPoolStats_t* main_stats) {
+  MsgPoolStats_t sum = { 0 };
+  for (uint32_t i = 0; i < clients_created; i++) {
+    MsgPoolStats_t* stats = &clients[i].pool_stats;
+    sum.peak_msg_count += stats->peak_msg_count;
+    sum.grow_count += stats->grow_count;
+    sum.trim_count += stats->trim_count;
+  }
+  printf(LDR "pool main: peak_msg_count=%u grow_count=%lu trim_count=%lu\n", ldr(),
+      main_stats->peak_msg_count, main_stats->grow_count, main_stats->trim_count);
+  printf(LDR "pool clients: peak_msg_count=%u grow_count=%lu trim_count=%lu\n", ldr(),
+      sum.peak_msg_count, sum.grow_count, sum.trim_count);
+}
+
 bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
-    const uint32_t msg_count) {
+    const uint32_t msg_count, const uint32_t slab_msg_count, const bool serial_ctrl,
+    const bool p2c, const bool perf, const uint32_t topology, const uint64_t rate) {
   bool error;
   MpscFifo_t cmdFifo;
-  ClientParams* clients;
+  ClientParams* clients = NULL;
   MsgPool_t pool;
   uint32_t clients_created = 0;
   uint64_t mt_msgs_sent = 0;
   uint64_t mt_no_msgs = 0;
-
-  struct timespec time_start;
-  struct timespec time_looping;
-  struct timespec time_done;
-  struct timespec time_disconnected;
-  struct timespec time_stopped;
-  struct timespec time_complete;
-
-  printf(LDR "multi_thread_msg:+client_count=%u loops=%lu msg_count=%u\n",
-      ldr(), client_count, loops, msg_count);
-
-  clock_gettime(CLOCK_REALTIME, &time_start);
+  uint32_t sources = 0;
+  double* zipf_cdf = NULL;
+  DispatchSent_t sent = { 0 };
+  MsgPoolStats_t pool_stats = { 0 };
+
+  uint64_t time_start;
+  uint64_t time_looping;
+  uint64_t time_done;
+  uint64_t time_disconnected;
+  uint64_t time_stopped;
+  uint64_t time_complete;
+
+  PerfCounters_t main_perf = { .leader = -1 };
+  PerfSample_t perf_samples[PHASE_COUNT + 1];
+
+  printf(LDR "multi_thread_msg:+client_count=%u loops=%lu msg_count=%u slab_msg_count=%u "
+      "serial_ctrl=%u p2c=%u topology=%s rate=%lu\n", ldr(), client_count, loops, msg_count,
+      slab_msg_count, serial_ctrl, p2c, topo_names[topology], rate);
+
+  if (perf) {
+    PerfCounters_open(&main_perf, 0);
+    perf_snapshot(&main_perf, NULL, 0, &perf_samples[0]);
+  }
+  time_start = ticks_serialized();
+  time_looping = time_start; // In case we abort before looping
 
   if (client_count == 0) {
     printf(LDR "multi_thread_msg: ERROR client_count=%d, aborting\n",
@@ -317,14 +710,21 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
   }
 
   clients = malloc(sizeof(ClientParams) * client_count);
-  if (clients == NULL) {
+  zipf_cdf = malloc(sizeof(double) * client_count);
+  if ((clients == NULL) || (zipf_cdf == NULL)) {
     printf(LDR "multi_thread_msg: ERROR Unable to allocate clients array, aborting\n", ldr());
     error = true;
     goto done;
   }
+  Dispatch_zipf_init(zipf_cdf, client_count - 1);
+  if (p2c && DispatchSent_init(&sent, client_count, client_count)) {
+    printf(LDR "multi_thread_msg: ERROR Unable to allocate the sequence counters, aborting\n", ldr());
+    error = true;
+    goto done;
+  }
 
   DPF(LDR "multi_thread_msg: init msg pool=%p\n", ldr(), &pool);
-  error = MsgPool_init(&pool, msg_count);
+  error = MsgPool_init_elastic(&pool, msg_count, slab_msg_count, client_count, 0);
   if (error) {
     printf(LDR "multi_thread_msg: ERROR Unable to allocate messages, aborting\n", ldr());
     goto done;
@@ -337,8 +737,15 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
   // Create the clients
   for (uint32_t i = 0; i < client_count; i++, clients_created++) {
     ClientParams* param = &clients[i];
+    param->idx = i;
+    param->topology = topology;
+    param->zipf_cdf = zipf_cdf;
     param->msg_count = msg_count;
+    param->slab_msg_count = slab_msg_count;
+    param->p2c = p2c;
+    param->sent = p2c ? &sent : NULL;
     param->max_peer_count = client_count;
+    param->perf.leader = -1;
 
     sem_init(&param->sem_ready, 0, 0);
     sem_init(&param->sem_waiting, 0, 0);
@@ -353,48 +760,68 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
 
     // Wait until it starts
     sem_wait(&param->sem_ready);
+
+    if (perf) {
+      PerfCounters_open(&param->perf, param->tid);
+    }
   }
   DPF(LDR "multi_thread_msg: created %u clients\n", ldr(), clients_created);
 
 
-  // Connect every client to every other client except themselves
-  for (uint32_t i = 0; i < clients_created; i++) {
-    ClientParams* client = &clients[i];
-    for (uint32_t peer_idx = 0; peer_idx < clients_created; peer_idx++) {
-      ClientParams* peer = &clients[peer_idx];
-      if (peer_idx != i) {
-        Msg_t* msg = MsgPool_get_msg(&pool);
-        if (msg != NULL) {
-          msg->pRspQ = &cmdFifo;
-          msg->arg1 = CmdConnect;
-          msg->arg2 = (uint64_t)peer;
-          DPF(LDR "multi_thread_msg: send client=%p msg=%p arg1=%lu CmdConnect\n",
-              ldr(), client, msg, msg->arg1);
-          add(&client->cmdFifo, msg);
-          sem_post(&client->sem_waiting);
-        }
-        if (wait_for_rsp(&cmdFifo, CmdConnected, client, i)) {
-          error = true;
-          goto done;
+  // Connect the clients as topology requires
+  if (serial_ctrl) {
+    for (uint32_t i = 0; (i < clients_created) && !error; i++) {
+      for (uint32_t peer_idx = 0; peer_idx < clients_created; peer_idx++) {
+        if (topo_connects(topology, i, peer_idx, clients_created)) {
+          if (send_cmd(&cmdFifo, &pool, &clients[i], i, CmdConnect,
+                (uint64_t)&clients[peer_idx], CmdConnected)) {
+            error = true;
+            break;
+          }
         }
       }
     }
+  } else {
+    PeerList peer_list = { .clients = clients, .count = clients_created };
+    error = send_to_all(&cmdFifo, &pool, clients, clients_created,
+        CmdConnectPeers, (uint64_t)&peer_list, CmdConnected) != 0;
+  }
+  if (error) {
+    goto done;
   }
 
   DPF(LDR "multi_thread_msg: send CmdSendToPeers to %u clients\n", ldr(), clients_created);
 
-  clock_gettime(CLOCK_REALTIME, &time_looping);
+  time_looping = ticks_serialized();
+  if (perf) {
+    perf_snapshot(&main_perf, clients, clients_created, &perf_samples[1]);
+  }
 
-  // Loop though all the clients asking them to send to their peers
+  // Loop though the source clients asking them to send to their peers,
+  // if open loop each loop is due rate times a second whether or not
+  // the clients keep up and the latency is from when it was due
+  for (uint32_t c = 0; c < clients_created; c++) {
+    sources += topo_is_source(topology, c) ? 1 : 0;
+  }
+  double ticks_per_loop = rate != 0 ? (ns_flt / (double)rate) / gTiming.ns_per_tick : 0.0;
   for (uint32_t i = 0; i < loops; i++) {
+    uint64_t due = 0;
+    if (rate != 0) {
+      due = time_looping + (uint64_t)(i * ticks_per_loop);
+      while (ticks() < due) {
+        sched_yield();
+      }
+    }
     for (uint32_t c = 0; c < clients_created; c++) {
-      // Test both flavors of rmv
-      Msg_t* msg;
-      msg = RMV(&pool.fifo);
+      if (!topo_is_source(topology, c)) {
+        continue;
+      }
+      Msg_t* msg = MsgPool_get_msg(&pool);
 
       if (msg != NULL) {
         ClientParams* client = &clients[c];
         msg->arg1 = CmdSendToPeers;
+        msg->arg2 = due;
         DPF(LDR "multi_thread_msg: send client=%p msg=%p arg1=%lu CmdSendToPeers\n",
             ldr(), client, msg, msg->arg1);
         add(&client->cmdFifo, msg);
@@ -412,73 +839,43 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
   error = false;
 
 done:
-  clock_gettime(CLOCK_REALTIME, &time_done);
+  time_done = ticks_serialized();
+  if (perf) {
+    perf_snapshot(&main_perf, clients, clients_created, &perf_samples[2]);
+  }
 
+  // A pipeline is disconnected in order, as each stage responds after
+  // forwarding what it had, so no msgs are in flight when it's done
   DPF(LDR "multi_thread_msg: done, send CmdDisconnectAll %u clients\n",
       ldr(), clients_created);
-  for (uint32_t i = 0; i < clients_created; i++) {
-    ClientParams* client = &clients[i];
+  error |= ctrl_all(&cmdFifo, &pool, clients, clients_created,
+      serial_ctrl || (topology == TopoPipeline), CmdDisconnectAll, CmdDisconnected) != 0;
 
-    // Request the client to stop
-    Msg_t* msg = MsgPool_get_msg(&pool);
-    bool once = false;
-    while (msg == NULL) {
-      if (!once) {
-        once = true;
-        DPF(LDR "multi_thread_msg: waiting for a msg to send %u CmdDisconnectAll\n",
-            ldr(), i);
-      }
-      sched_yield();
-      msg = MsgPool_get_msg(&pool);
-    }
-    msg->pRspQ = &cmdFifo;
-    msg->arg1 = CmdDisconnectAll;
-    DPF(LDR "multi_thread_msg: send %u client=%p msg=%p msg->arg1=%lu CmdDisconnectAll\n",
-        ldr(), i, client, msg, msg->arg1);
-    add(&client->cmdFifo, msg);
-    sem_post(&client->sem_waiting);
-    if (wait_for_rsp(&cmdFifo, CmdDisconnected, client, i)) {
-      error = true;
-      goto done;
-    }
+  time_disconnected = ticks_serialized();
+  if (perf) {
+    perf_snapshot(&main_perf, clients, clients_created, &perf_samples[3]);
   }
 
-  clock_gettime(CLOCK_REALTIME, &time_disconnected);
-
   DPF(LDR "multi_thread_msg: done, send CmdStop %u clients\n",
       ldr(), clients_created);
-  for (uint32_t i = 0; i < clients_created; i++) {
-    ClientParams* client = &clients[i];
+  error |= ctrl_all(&cmdFifo, &pool, clients, clients_created, serial_ctrl,
+      CmdStop, CmdStopped) != 0;
 
-    // Request the client to stop
-    Msg_t* msg = MsgPool_get_msg(&pool);
-    bool once = false;
-    while (msg == NULL) {
-      if (!once) {
-        once = true;
-        DPF(LDR "multi_thread_msg: waiting for msg to send %u CmdStop\n", ldr(), i);
-      }
-      sched_yield();
-      msg = MsgPool_get_msg(&pool);
-    }
-    DPF(LDR "multi_thread_msg: send %u CmdStop\n", ldr(), i);
-    msg->pRspQ = &cmdFifo;
-    msg->arg1 = CmdStop;
-    DPF(LDR "multi_thread_msg: send client=%p msg=%p msg->arg1=%lu CmdStop\n", ldr(),
-       client, msg, msg->arg1);
-    add(&client->cmdFifo, msg);
-    sem_post(&client->sem_waiting);
-    if (wait_for_rsp(&cmdFifo, CmdStopped, client, i)) {
-      error = true;
-      goto done;
-    }
+  time_stopped = ticks_serialized();
+  if (perf) {
+    perf_snapshot(&main_perf, clients, clients_created, &perf_samples[4]);
   }
 
-  clock_gettime(CLOCK_REALTIME, &time_stopped);
+  // Deinit the cmdFifo before joining as its stub may belong to a
+  // client's pool which the client waits for
+  DPF(LDR "multi_thread_msg: deinit cmdFifo=%p\n", ldr(), &cmdFifo);
+  uint64_t msgs_processed = deinitMpscFifo(&cmdFifo, NULL);
 
   DPF(LDR "multi_thread_msg: done, joining %u clients\n", ldr(), clients_created);
   uint64_t cmds_processed = 0;
-  uint64_t msgs_processed = 0;
+  uint64_t no_msgs = 0;
+  Histo_t latency;
+  Histo_clear(&latency);
   for (uint32_t i = 0; i < clients_created; i++) {
     ClientParams* client = &clients[i];
     // Wait until the thread completes
@@ -487,8 +884,12 @@ done:
       printf(LDR "multi_thread_msg: ERROR joining failed, clients[%u]=%p retv=%d\n",
           ldr(), i, (void*)client, retv);
     }
+  }
+  for (uint32_t i = 0; i < clients_created; i++) {
+    ClientParams* client = &clients[i];
 
-    // Cleanup resources
+    // Cleanup resources, once all have been joined as a TopoReqRep
+    // responder may post its requester's sem_waiting as it stops
     sem_destroy(&client->sem_ready);
     sem_destroy(&client->sem_waiting);
 
@@ -500,21 +901,29 @@ done:
     }
     cmds_processed += client->cmds_processed;
     msgs_processed += client->msgs_processed;
+    no_msgs += client->no_msgs;
+    Histo_merge(&latency, &client->latency);
     DPF(LDR "multi_thread_msg: clients[%u]=%p msgs_processed=%lu error_count=%lu\n",
         ldr(), i, (void*)client, client->msgs_processed, client->error_count);
   }
 
-  // Deinit the cmdFifo
-  DPF(LDR "multi_thread_msg: deinit cmdFifo=%p\n", ldr(), &cmdFifo);
-  msgs_processed += deinitMpscFifo(&cmdFifo, NULL);
-
-  // Deinit the msg pool
+  // Deinit the msg pool, all the clients are gone so don't hang
+  MsgPool_get_stats(&pool, &pool_stats);
   DPF(LDR "multi_thread_msg: deinit msg pool=%p\n", ldr(), &pool);
-  msgs_processed += MsgPool_deinit(&pool);
+  uint64_t pool_msgs_processed = 0;
+  if (MsgPool_try_deinit(&pool, DEINIT_TIMEOUT_NS, &pool_msgs_processed)) {
+    printf(LDR "multi_thread_msg: ERROR pool=%p outstanding=%lu after clients stopped\n",
+        ldr(), &pool, MsgPool_outstanding(&pool));
+    error = true;
+  }
+  msgs_processed += pool_msgs_processed;
 
-  clock_gettime(CLOCK_REALTIME, &time_complete);
+  time_complete = ticks_serialized();
+  if (perf) {
+    perf_snapshot(&main_perf, clients, clients_created, &perf_samples[5]);
+  }
 
-  uint64_t expected_value = loops * clients_created;
+  uint64_t expected_value = loops * sources;
   uint64_t sum = mt_msgs_sent + mt_no_msgs;
   if (sum != expected_value) {
     printf(LDR "multi_thread_msg: ERROR sum=%lu != expected_value=%lu\n",
@@ -525,20 +934,20 @@ done:
   printf(LDR "multi_thread_msg: cmds_processed=%lu msgs_processed=%lu mt_msgs_sent=%lu "
       "mt_no_msgs=%lu\n", ldr(), cmds_processed, msgs_processed, mt_msgs_sent, mt_no_msgs);
 
-  DPF(LDR "time_start=%lu.%lu\n", ldr(), time_start.tv_sec, time_start.tv_nsec);
-  DPF(LDR "time_looping=%lu.%lu\n", ldr(), time_looping.tv_sec, time_looping.tv_nsec);
-  DPF(LDR "time_done=%lu.%lu\n", ldr(), time_done.tv_sec, time_done.tv_nsec);
-  DPF(LDR "time_disconnected=%lu.%lu\n", ldr(), time_disconnected.tv_sec, time_disconnected.tv_nsec);
-  DPF(LDR "time_stopped=%lu.%lu\n", ldr(), time_stopped.tv_sec, time_stopped.tv_nsec);
-  DPF(LDR "time_complete=%lu.%lu\n", ldr(), time_complete.tv_sec, time_complete.tv_nsec);
+  DPF(LDR "time_start=%lu\n", ldr(), time_start);
+  DPF(LDR "time_looping=%lu\n", ldr(), time_looping);
+  DPF(LDR "time_done=%lu\n", ldr(), time_done);
+  DPF(LDR "time_disconnected=%lu\n", ldr(), time_disconnected);
+  DPF(LDR "time_stopped=%lu\n", ldr(), time_stopped);
+  DPF(LDR "time_complete=%lu\n", ldr(), time_complete);
 
-  printf(LDR "startup=%.6f\n", ldr(), diff_timespec_ns(&time_looping, &time_start) / ns_flt);
-  printf(LDR "looping=%.6f\n", ldr(), diff_timespec_ns(&time_done, &time_looping) / ns_flt);
-  printf(LDR "disconnecting=%.6f\n", ldr(), diff_timespec_ns(&time_disconnected, &time_done) / ns_flt);
-  printf(LDR "stopping=%.6f\n", ldr(), diff_timespec_ns(&time_stopped, &time_disconnected) / ns_flt);
-  printf(LDR "complete=%.6f\n", ldr(), diff_timespec_ns(&time_complete, &time_stopped) / ns_flt);
+  printf(LDR "startup=%.6f\n", ldr(), diff_ticks_ns(time_looping, time_start) / ns_flt);
+  printf(LDR "looping=%.6f\n", ldr(), diff_ticks_ns(time_done, time_looping) / ns_flt);
+  printf(LDR "disconnecting=%.6f\n", ldr(), diff_ticks_ns(time_disconnected, time_done) / ns_flt);
+  printf(LDR "stopping=%.6f\n", ldr(), diff_ticks_ns(time_stopped, time_disconnected) / ns_flt);
+  printf(LDR "complete=%.6f\n", ldr(), diff_ticks_ns(time_complete, time_stopped) / ns_flt);
 
-  double processing_ns = diff_timespec_ns(&time_complete, &time_looping);
+  double processing_ns = diff_ticks_ns(time_complete, time_looping);
   printf(LDR "processing=%.3fs\n", ldr(), processing_ns / ns_flt);
   double cmds_per_sec = (cmds_processed * ns_flt) / processing_ns;
   printf(LDR "cmds_per_sec=%.3f\n", ldr(), cmds_per_sec);
@@ -548,7 +957,34 @@ done:
   printf(LDR "msgs_per_sec=%.3f\n", ldr(), msgs_per_sec);
   double ns_per_msg = (float)processing_ns / (float)msgs_processed;
   printf(LDR "ns_per_msg=%.1fns\n", ldr(), ns_per_msg);
-  printf(LDR "total=%.3f\n", ldr(), diff_timespec_ns(&time_complete, &time_start) / ns_flt);
+  printf(LDR "total=%.3f\n", ldr(), diff_ticks_ns(time_complete, time_start) / ns_flt);
+  double delivering_ns = diff_ticks_ns(time_disconnected, time_looping);
+  printf(LDR "topology=%s load=%s delivered=%lu delivered_per_sec=%.3f no_msgs=%lu\n", ldr(),
+      topo_names[topology], rate != 0 ? "open" : "closed", latency.count,
+      delivering_ns != 0.0 ? (latency.count * ns_flt) / delivering_ns : 0.0, no_msgs);
+  Histo_print(&latency, topology == TopoReqRep ? "round_trip_ns" : "latency_ns",
+      gTiming.ns_per_tick);
+
+  char scenario[RESULTS_MAX_NAME];
+  snprintf(scenario, sizeof(scenario), "%s_%s_c%u_l%lu_m%u", topo_names[topology],
+      rate != 0 ? "open" : "closed", client_count, loops, msg_count);
+  error |= results_save("test", scenario, "ns_per_msg", ns_per_msg);
+  error |= results_save("test", scenario, "ns_per_cmd", ns_per_cmd);
+  error |= results_save("test", scenario, "latency_p99_ns",
+      (double)Histo_percentile(&latency, 99.0) * gTiming.ns_per_tick);
+  pool_stats_report(clients, clients_created, &pool_stats);
+
+  if (perf) {
+    perf_report(perf_samples, msgs_processed);
+    for (uint32_t i = 0; i < clients_created; i++) {
+      PerfCounters_close(&clients[i].perf);
+    }
+    PerfCounters_close(&main_perf);
+  }
+
+  DispatchSent_deinit(&sent);
+  free(zipf_cdf);
+  free(clients);
 
   printf(LDR "multi_thread_msg:-error=%u\n\n", ldr(), error);
 
@@ -558,21 +994,120 @@ done:
 int main(int argc, char* argv[]) {
   bool error = false;
 
-  if (argc != 4) {
+  bool perf = false;
+  const char* trace_path = NULL;
+  const char* capture_path = NULL;
+  uint32_t slab_msg_count = 0;
+  bool serial_ctrl = false;
+  bool p2c = false;
+  uint32_t topology = TopoMesh;
+  uint64_t rate = 0;
+  bool faults = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "2c:e:f:pr:St:T:")) != -1) {
+    switch (opt) {
+      case '2':
+        p2c = true;
+        break;
+      case 'c':
+        capture_path = optarg;
+        break;
+      case 'S':
+        serial_ctrl = true;
+        break;
+      case 'e':
+        sscanf(optarg, "%u", &slab_msg_count);
+        break;
+      case 'f':
+        if (fault_parse(optarg)) {
+          argc = 0; // Force usage
+        }
+        faults = true;
+        break;
+      case 'p':
+        perf = true;
+        break;
+      case 'r':
+        sscanf(optarg, "%lu", &rate);
+        break;
+      case 't':
+        trace_path = optarg;
+        break;
+      case 'T':
+        for (topology = 0; topology < TOPO_COUNT; topology++) {
+          if (strcmp(optarg, topo_names[topology]) == 0) {
+            break;
+          }
+        }
+        if (topology == TOPO_COUNT) {
+          printf("Unknown topology %s\n", optarg);
+          argc = 0; // Force usage
+        }
+        break;
+      default:
+        argc = 0; // Force usage
+        break;
+    }
+  }
+
+  if ((argc - optind) != 3) {
     printf("Usage:\n");
-    printf(" %s client_count loops msg_count\n", argv[0]);
+    printf(" %s [-2] [-c capture_file] [-e slab_msg_count] [-f fault]... [-p] [-r rate] [-S]"
+        " [-t trace_file] [-T topology] client_count loops msg_count\n", argv[0]);
+    printf("  -2 send to peers with the power of two choices rather than round robin\n");
+    printf("  -c capture the msgs sent to capture_file, see replay\n");
+    printf("  -e elastic pools which grow by slab_msg_count msgs when low\n");
+    printf("  -f inject faults, point:rate_ppm:kind[:delay_ns] where point is add_link,\n");
+    printf("     rmv_stall or ret_msg and kind is yield, spin or sleep, see fault.h\n");
+    printf("  -p report perf_event_open counters per phase\n");
+    printf("  -r open loop, rate loops a second rather than as fast as msgs are available\n");
+    printf("  -S connect, disconnect and stop each client serially\n");
+    printf("  -t record a trace and write it to trace_file, see trace_decode\n");
+    printf("  -T mesh, ring, star, zipf, pipeline or reqrep, default mesh\n");
     return 1;
   }
 
   u_int32_t client_count;
-  sscanf(argv[1], "%u", & client_count);
+  sscanf(argv[optind + 0], "%u", & client_count);
   u_int64_t loops;
-  sscanf(argv[2], "%lu", &loops);
+  sscanf(argv[optind + 1], "%lu", &loops);
   u_int32_t msg_count;
-  sscanf(argv[3], "%i", &msg_count);
+  sscanf(argv[optind + 2], "%i", &msg_count);
   printf("test client_count=%u loops=%lu msg_count=%u\n", client_count, loops, msg_count);
 
-  error |= multi_thread_main(client_count, loops, msg_count);
+  error |= timing_init();
+  printf("timing use_tsc=%u ns_per_tick=%.6f overhead=%lu\n",
+      gTiming.use_tsc, gTiming.ns_per_tick, gTiming.overhead);
+
+  if (trace_path != NULL) {
+    trace_enable(true);
+  }
+  if (capture_path != NULL) {
+    error |= capture_start(capture_path, CAPTURE_MAX_RECORDS);
+  }
+  if (faults) {
+    fault_enable(true);
+  }
+
+  error |= multi_thread_main(client_count, loops, msg_count, slab_msg_count,
+      serial_ctrl, p2c, perf, topology, rate);
+
+  if (trace_path != NULL) {
+    trace_enable(false);
+    error |= trace_dump(trace_path);
+  }
+  if (capture_path != NULL) {
+    error |= capture_stop();
+  }
+  if (faults) {
+    fault_enable(false);
+    printf("faults");
+    for (uint32_t i = 0; i < FAULT_POINT_COUNT; i++) {
+      printf(" %s=%lu", fault_point_name(i), fault_injected(i));
+    }
+    printf("\n");
+  }
+  printf("stalls=%lu stall_yields=%lu\n", gMpscStalls, gMpscStallYields);
 
   if (!error) {
     printf("Success\n");
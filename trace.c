@@ -0,0 +1,168 @@
+/**
+ * This software is released into the public domain.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "trace.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TRACE_DEFAULT_RECORDS 65536
+
+typedef struct TraceRing_t TraceRing_t;
+
+typedef struct TraceRing_t {
+  TraceRing_t* pNext;   // Next ring in gRings
+  uint32_t tid;
+  uint64_t mask;
+  uint64_t head;        // Total records written
+  TraceRecord_t records[];
+} TraceRing_t;
+
+_Atomic(uint32_t) gTraceEnabled = 0;
+
+static uint32_t gRecordsPerRing = TRACE_DEFAULT_RECORDS;
+static TraceRing_t* gRings = NULL;
+static __thread TraceRing_t* tRing = NULL;
+
+/**
+ * Allocate a ring for the calling thread and push it on gRings.
+ */
+static TraceRing_t* ring_create(void) {
+  uint64_t count = __atomic_load_n(&gRecordsPerRing, __ATOMIC_RELAXED);
+  TraceRing_t* ring = malloc(sizeof(TraceRing_t) + (sizeof(TraceRecord_t) * count));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->tid = (uint32_t)syscall(SYS_gettid);
+  ring->mask = count - 1;
+  ring->head = 0;
+
+  ring->pNext = __atomic_load_n(&gRings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&gRings, &ring->pNext, ring,
+        true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  DPF("ring_create: tid=%u ring=%p count=%lu\n", ring->tid, ring, count);
+  return ring;
+}
+
+/**
+ * @see trace.h
+ */
+void trace_init(uint32_t records_per_ring) {
+  uint32_t count = 1;
+  while (count < records_per_ring) {
+    count <<= 1;
+  }
+  __atomic_store_n(&gRecordsPerRing, count, __ATOMIC_RELAXED);
+}
+
+/**
+ * @see trace.h
+ */
+void trace_enable(bool enable) {
+  __atomic_store_n(&gTraceEnabled, enable ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @see trace.h
+ */
+void trace_record(uint16_t event, const void* pQ, const void* pMsg,
+    uint64_t arg1, uint64_t arg2) {
+  TraceRing_t* ring = tRing;
+  if (__builtin_expect(ring == NULL, 0)) {
+    ring = tRing = ring_create();
+    if (ring == NULL) {
+      return;
+    }
+  }
+  uint64_t head = ring->head;
+  TraceRecord_t* r = &ring->records[head & ring->mask];
+  r->tick = ticks();
+  r->tid = ring->tid;
+  r->event = event;
+  r->reserved = 0;
+  r->pQ = (uint64_t)pQ;
+  r->pMsg = (uint64_t)pMsg;
+  r->arg1 = arg1;
+  r->arg2 = arg2;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @see trace.h
+ */
+bool trace_dump(const char* path) {
+  bool error = false;
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) {
+    printf("trace_dump: ERROR unable to open %s\n", path);
+    return true;
+  }
+
+  TraceFileHeader_t hdr = {
+    .magic = TRACE_MAGIC,
+    .ns_per_tick = gTiming.ns_per_tick,
+    .ring_count = 0,
+    .record_size = sizeof(TraceRecord_t),
+  };
+  TraceRing_t* rings = __atomic_load_n(&gRings, __ATOMIC_ACQUIRE);
+  for (TraceRing_t* ring = rings; ring != NULL; ring = ring->pNext) {
+    hdr.ring_count += 1;
+  }
+  error |= fwrite(&hdr, sizeof(hdr), 1, f) != 1;
+
+  for (TraceRing_t* ring = rings; ring != NULL; ring = ring->pNext) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t size = ring->mask + 1;
+    TraceFileRing_t fr = {
+      .tid = ring->tid,
+      .reserved = 0,
+      .count = head < size ? head : size,
+      .dropped = head < size ? 0 : head - size,
+    };
+    error |= fwrite(&fr, sizeof(fr), 1, f) != 1;
+
+    // Oldest first
+    for (uint64_t i = head - fr.count; i < head; i++) {
+      error |= fwrite(&ring->records[i & ring->mask], sizeof(TraceRecord_t), 1, f) != 1;
+    }
+  }
+
+  error |= fclose(f) != 0;
+  if (error) {
+    printf("trace_dump: ERROR writing %s\n", path);
+  }
+  return error;
+}
+
+/**
+ * @see trace.h
+ */
+const char* trace_event_name(uint16_t event) {
+  switch (event) {
+    case TRACE_ADD:       return "add";
+    case TRACE_RMV:       return "rmv";
+    case TRACE_RMV_EMPTY: return "rmv_empty";
+    case TRACE_RMV_STALL: return "rmv_stall";
+    case TRACE_RET_MSG:   return "ret_msg";
+    case TRACE_SEND_RSP:  return "send_rsp";
+    case TRACE_POOL_GROW: return "pool_grow";
+    case TRACE_POOL_TRIM: return "pool_trim";
+    case TRACE_RMV_EXPIRED: return "rmv_expired";
+    default:              return NULL;
+  }
+}
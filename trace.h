@@ -0,0 +1,109 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Low overhead binary tracing.
+ *
+ * Each thread writes fixed size TraceRecord_t's into its own
+ * memory ring so recording is a handful of stores and never
+ * blocks or calls into the kernel. Tracing is compiled in when
+ * USE_TRACE is 1 and is enabled at runtime with trace_enable().
+ * trace_dump() writes the rings to a file which trace_decode
+ * merges into a single timeline.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef USE_TRACE
+#define USE_TRACE 1
+#endif
+
+#define TRACE_MAGIC 0x314352544353504Dull // "MPSCTRC1"
+
+#define TRACE_ADD          1 // arg1, arg2 of the msg
+#define TRACE_RMV          2 // arg1, arg2 of the msg
+#define TRACE_RMV_EMPTY    3
+#define TRACE_RMV_STALL    4 // arg1 number of times yielded
+#define TRACE_RET_MSG      5
+#define TRACE_SEND_RSP     6 // arg1 is the response
+#define TRACE_POOL_GROW    7 // arg1 msgs added, arg2 msg_count
+#define TRACE_POOL_TRIM    8 // arg1 msgs freed, arg2 msg_count
+#define TRACE_RMV_EXPIRED  9 // arg1 of the msg, arg2 its deadline
+#define TRACE_USER         64 // First event available to applications
+
+typedef struct TraceRecord_t {
+  uint64_t tick;
+  uint32_t tid;
+  uint16_t event;
+  uint16_t reserved;
+  uint64_t pQ;
+  uint64_t pMsg;
+  uint64_t arg1;
+  uint64_t arg2;
+} TraceRecord_t;
+
+/**
+ * Header of a trace file, followed by ring_count rings each of
+ * which is a TraceFileRing_t followed by count TraceRecord_t's in
+ * the order they were recorded.
+ */
+typedef struct TraceFileHeader_t {
+  uint64_t magic;
+  double ns_per_tick;
+  uint32_t ring_count;
+  uint32_t record_size;
+} TraceFileHeader_t;
+
+typedef struct TraceFileRing_t {
+  uint32_t tid;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t dropped; // Records overwritten because the ring wrapped
+} TraceFileRing_t;
+
+extern _Atomic(uint32_t) gTraceEnabled;
+
+/**
+ * Set the number of records in each threads ring, rounded up to a
+ * power of two. Only affects rings created after the call.
+ */
+void trace_init(uint32_t records_per_ring);
+
+/**
+ * Enable or disable recording
+ */
+void trace_enable(bool enable);
+
+/**
+ * Record an event in the calling threads ring, use TRACE.
+ */
+void trace_record(uint16_t event, const void* pQ, const void* pMsg,
+    uint64_t arg1, uint64_t arg2);
+
+/**
+ * Write all rings to path, should be called when the
+ * traced threads are quiescent.
+ *
+ * @return true if an error.
+ */
+bool trace_dump(const char* path);
+
+/**
+ * Return the name of a built in event
+ */
+const char* trace_event_name(uint16_t event);
+
+#if USE_TRACE
+#define TRACE(event, pQ, pMsg, arg1, arg2) do { \
+  if (__builtin_expect(__atomic_load_n(&gTraceEnabled, __ATOMIC_RELAXED), 0)) { \
+    trace_record((event), (pQ), (pMsg), (arg1), (arg2)); \
+  } \
+} while (0)
+#else
+#define TRACE(event, pQ, pMsg, arg1, arg2) ((void)(0))
+#endif
+
+#endif
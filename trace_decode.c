@@ -0,0 +1,112 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Decode a file written by trace_dump, merging the per thread
+ * rings into a single timeline ordered by tick.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct Ring {
+  TraceFileRing_t hdr;
+  TraceRecord_t* records;
+  uint64_t next;
+} Ring;
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+  Ring* rings = NULL;
+  TraceFileHeader_t hdr = { .ring_count = 0 };
+
+  if (argc != 2) {
+    printf("Usage:\n");
+    printf(" %s trace_file\n", argv[0]);
+    return 1;
+  }
+
+  FILE* f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    printf("trace_decode: ERROR unable to open %s\n", argv[1]);
+    return 1;
+  }
+
+  if ((fread(&hdr, sizeof(hdr), 1, f) != 1) || (hdr.magic != TRACE_MAGIC)
+      || (hdr.record_size != sizeof(TraceRecord_t))) {
+    printf("trace_decode: ERROR %s is not a trace file\n", argv[1]);
+    error = true;
+    goto done;
+  }
+
+  rings = calloc(hdr.ring_count, sizeof(Ring));
+  if (rings == NULL) {
+    printf("trace_decode: ERROR unable to allocate %u rings\n", hdr.ring_count);
+    error = true;
+    goto done;
+  }
+
+  uint64_t first_tick = UINT64_MAX;
+  for (uint32_t i = 0; i < hdr.ring_count; i++) {
+    Ring* ring = &rings[i];
+    if (fread(&ring->hdr, sizeof(ring->hdr), 1, f) != 1) {
+      printf("trace_decode: ERROR truncated ring %u\n", i);
+      error = true;
+      goto done;
+    }
+    ring->records = malloc(sizeof(TraceRecord_t) * (ring->hdr.count + 1));
+    if ((ring->records == NULL)
+        || (fread(ring->records, sizeof(TraceRecord_t), ring->hdr.count, f) != ring->hdr.count)) {
+      printf("trace_decode: ERROR reading ring %u tid=%u\n", i, ring->hdr.tid);
+      error = true;
+      goto done;
+    }
+    printf("ring %u tid=%u records=%lu dropped=%lu\n",
+        i, ring->hdr.tid, ring->hdr.count, ring->hdr.dropped);
+    if ((ring->hdr.count != 0) && (ring->records[0].tick < first_tick)) {
+      first_tick = ring->records[0].tick;
+    }
+  }
+
+  // Each ring is in tick order so repeatedly take the earliest head
+  while (true) {
+    Ring* earliest = NULL;
+    for (uint32_t i = 0; i < hdr.ring_count; i++) {
+      Ring* ring = &rings[i];
+      if ((ring->next < ring->hdr.count) && ((earliest == NULL)
+            || (ring->records[ring->next].tick < earliest->records[earliest->next].tick))) {
+        earliest = ring;
+      }
+    }
+    if (earliest == NULL) {
+      break;
+    }
+
+    TraceRecord_t* r = &earliest->records[earliest->next++];
+    double ns = (double)(r->tick - first_tick) * hdr.ns_per_tick;
+    const char* name = trace_event_name(r->event);
+    if (name != NULL) {
+      printf("%14.1f %6u %-10s", ns, r->tid, name);
+    } else {
+      printf("%14.1f %6u event_%-4u", ns, r->tid, r->event);
+    }
+    printf(" q=%lx msg=%lx arg1=%lu arg2=%lu\n", r->pQ, r->pMsg, r->arg1, r->arg2);
+  }
+
+done:
+  if (rings != NULL) {
+    for (uint32_t i = 0; i < hdr.ring_count; i++) {
+      free(rings[i].records);
+    }
+    free(rings);
+  }
+  fclose(f);
+  return error ? 1 : 0;
+}
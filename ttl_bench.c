@@ -0,0 +1,229 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Overload a consumer and compare its goodput, the msgs it handles
+ * within ttl_ns of when they were due, with and without TTLs.
+ *
+ * producer_count producers send open loop at rate msgs a second in
+ * total, dropping a msg when their pool of window msgs is empty. The
+ * consumer spins work_ns per msg so it's overloaded when rate is
+ * above 1e9 / work_ns. Without TTLs the consumer handles every stale
+ * msg, with them the producers use add_ttl and the consumer rmv_live
+ * which returns the expired msgs to their pools unhandled.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PRODUCERS 64
+
+_Atomic(uint64_t) gTick = 0;
+
+typedef struct Producer {
+  MsgPool_t pool;
+  pthread_t thread;
+  MpscFifo_t* fifo;
+  uint64_t msg_count;
+  uint64_t start;           // Tick of the first due msg
+  uint64_t interval;        // Ticks between msgs
+  uint64_t ttl_ns;          // 0 for none
+  uint64_t no_msgs;
+} Producer;
+
+typedef struct Consumer {
+  MpscFifo_t fifo;
+  pthread_t thread;
+  uint64_t work_ns;
+  uint64_t ttl_ns;          // For goodput, with or without rmv_live
+  bool use_ttl;
+  ATOMIC(uint32_t) producers_done;
+  uint32_t producer_count;
+  uint64_t good;
+  uint64_t late;
+  uint64_t stop;            // Tick the consumer finished
+} Consumer;
+
+static void* producer(void* param) {
+  Producer* p = (Producer*)param;
+  for (uint64_t i = 0; i < p->msg_count; i++) {
+    uint64_t due = p->start + (i * p->interval);
+    while (ticks() < due) {
+      sched_yield();
+    }
+    Msg_t* msg = MsgPool_get_msg(&p->pool);
+    if (msg == NULL) {
+      p->no_msgs += 1;
+      continue;
+    }
+    msg->arg2 = due;
+    if (p->ttl_ns != 0) {
+      add_ttl(p->fifo, msg, p->ttl_ns);
+    } else {
+      add(p->fifo, msg);
+    }
+  }
+  return NULL;
+}
+
+static void* consumer(void* param) {
+  Consumer* c = (Consumer*)param;
+  while (true) {
+    Msg_t* msg = c->use_ttl ? rmv_live(&c->fifo, NULL) : rmv(&c->fifo);
+    if (msg == NULL) {
+      if (__atomic_load_n(&c->producers_done, __ATOMIC_ACQUIRE) == c->producer_count) {
+        // Check again as the last msgs may have been added before done
+        msg = c->use_ttl ? rmv_live(&c->fifo, NULL) : rmv(&c->fifo);
+        if (msg == NULL) {
+          break;
+        }
+      } else {
+        sched_yield();
+        continue;
+      }
+    }
+    spin_ns(c->work_ns);
+    if (diff_ticks_fast_ns(ticks(), msg->arg2) <= (double)c->ttl_ns) {
+      c->good += 1;
+    } else {
+      c->late += 1;
+    }
+    ret_msg(msg);
+  }
+  c->stop = ticks();
+  return NULL;
+}
+
+/**
+ * Run one pass, with TTLs if use_ttl
+ */
+bool run(bool use_ttl, uint32_t producer_count, uint64_t msg_count, uint64_t rate,
+    uint64_t work_ns, uint64_t ttl_ns, uint32_t window) {
+  bool error = false;
+  Producer producers[MAX_PRODUCERS];
+  Consumer c;
+  memset(&c, 0, sizeof(c));
+  c.work_ns = work_ns;
+  c.ttl_ns = ttl_ns;
+  c.use_ttl = use_ttl;
+  c.producer_count = producer_count;
+
+  uint64_t per_producer = msg_count / producer_count;
+  double interval_ns = (ns_flt * producer_count) / (double)rate;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    Producer* p = &producers[i];
+    memset(p, 0, sizeof(*p));
+    // One more in the first pool for the consumer's stub
+    if (MsgPool_init(&p->pool, window + (i == 0 ? 1 : 0))) {
+      printf(LDR "run: ERROR unable to create pool %u\n", ldr(), i);
+      return true;
+    }
+    p->fifo = &c.fifo;
+    p->msg_count = per_producer;
+    p->interval = (uint64_t)(interval_ns / gTiming.ns_per_tick);
+    p->ttl_ns = use_ttl ? ttl_ns : 0;
+  }
+  initMpscFifo(&c.fifo, MsgPool_get_msg(&producers[0].pool));
+  pthread_create(&c.thread, NULL, consumer, &c);
+
+  uint64_t start = ticks();
+  for (uint32_t i = 0; i < producer_count; i++) {
+    // Stagger the producers so the msgs are evenly spaced
+    producers[i].start = start + (uint64_t)((interval_ns * i) /
+        (producer_count * gTiming.ns_per_tick));
+    pthread_create(&producers[i].thread, NULL, producer, &producers[i]);
+  }
+  uint64_t no_msgs = 0;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+    no_msgs += producers[i].no_msgs;
+    __atomic_fetch_add(&c.producers_done, 1, __ATOMIC_RELEASE);
+  }
+  pthread_join(c.thread, NULL);
+
+  uint64_t sent = (per_producer * producer_count) - no_msgs;
+  uint64_t expired = c.fifo.msgs_expired;
+  if (c.good + c.late + expired != sent) {
+    printf(LDR "run: ERROR good=%lu late=%lu expired=%lu != sent=%lu\n",
+        ldr(), c.good, c.late, expired, sent);
+    error = true;
+  }
+
+  // The fifo first as its stub may be any of the pools' msgs
+  deinitMpscFifo(&c.fifo, NULL);
+  for (uint32_t i = 0; i < producer_count; i++) {
+    MsgPool_deinit(&producers[i].pool);
+  }
+
+  double secs = diff_ticks_fast_ns(c.stop, start) / ns_flt;
+  printf("%-6s sent=%lu no_msgs=%lu good=%lu late=%lu expired=%lu secs=%.3f "
+      "goodput_per_sec=%.0f\n", use_ttl ? "ttl" : "no_ttl", sent, no_msgs, c.good, c.late,
+      expired, secs, (double)c.good / secs);
+  return error;
+}
+
+int main(int argc, char* argv[]) {
+  bool error = false;
+
+  if (argc != 7) {
+    printf("Usage:\n");
+    printf(" %s producer_count msg_count rate work_ns ttl_ns window\n", argv[0]);
+    printf("  producer_count producers send msg_count msgs at rate msgs a second,\n");
+    printf("  the consumer spins work_ns per msg which is good if handled within\n");
+    printf("  ttl_ns, each producer has a pool of window msgs\n");
+    return 1;
+  }
+
+  u_int32_t producer_count;
+  sscanf(argv[1], "%u", &producer_count);
+  u_int64_t msg_count;
+  sscanf(argv[2], "%lu", &msg_count);
+  u_int64_t rate;
+  sscanf(argv[3], "%lu", &rate);
+  u_int64_t work_ns;
+  sscanf(argv[4], "%lu", &work_ns);
+  u_int64_t ttl_ns;
+  sscanf(argv[5], "%lu", &ttl_ns);
+  u_int32_t window;
+  sscanf(argv[6], "%u", &window);
+
+  struct timespec res;
+  clock_getres(CLOCK_MONOTONIC_COARSE, &res);
+  printf("ttl_bench producer_count=%u msg_count=%lu rate=%lu work_ns=%lu ttl_ns=%lu window=%u "
+      "capacity_per_sec=%.0f coarse_res_ns=%ld\n", producer_count, msg_count, rate, work_ns,
+      ttl_ns, window, work_ns != 0 ? ns_flt / (double)work_ns : 0.0, res.tv_nsec);
+
+  if ((producer_count == 0) || (producer_count > MAX_PRODUCERS) || (msg_count < producer_count) ||
+      (rate == 0) || (ttl_ns == 0) || (window == 0)) {
+    printf("producer_count must be 1 to %u, msg_count >= producer_count, "
+        "rate, ttl_ns and window must be > 0\n", MAX_PRODUCERS);
+    return 1;
+  }
+
+  error |= timing_init();
+
+  error |= run(false, producer_count, msg_count, rate, work_ns, ttl_ns, window);
+  error |= run(true, producer_count, msg_count, rate, work_ns, ttl_ns, window);
+
+  if (!error) {
+    printf("Success\n");
+  }
+
+  return error ? 1 : 0;
+}